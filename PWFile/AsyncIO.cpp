@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "AsyncIO.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+AsyncIO::AsyncIO(unsigned depth)
+{
+	ringFd = -1;
+	entries = 0;
+	toSubmit = 0;
+	inFlight = 0;
+	sqRing = cqRing = MAP_FAILED;
+	sqes = (struct io_uring_sqe *)MAP_FAILED;
+	sqRingSize = cqRingSize = sqesSize = 0;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ringFd = io_uring_setup(depth, &params);
+	if(ringFd < 0) return;
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	// newer kernels map both rings with one mmap
+	bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if(singleMap)
+	{
+		if(cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+		cqRingSize = sqRingSize;
+	}
+
+	sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+		ringFd, IORING_OFF_SQ_RING);
+	if(sqRing == MAP_FAILED) return;
+
+	if(singleMap)
+		cqRing = sqRing;
+	else
+		cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+			ringFd, IORING_OFF_CQ_RING);
+	if(cqRing == MAP_FAILED) return;
+
+	sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe *)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED) return;
+
+	unsigned char *sq = (unsigned char *)sqRing;
+	sqHead = (unsigned *)(sq + params.sq_off.head);
+	sqTail = (unsigned *)(sq + params.sq_off.tail);
+	sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	sqArray = (unsigned *)(sq + params.sq_off.array);
+
+	unsigned char *cq = (unsigned char *)cqRing;
+	cqHead = (unsigned *)(cq + params.cq_off.head);
+	cqTail = (unsigned *)(cq + params.cq_off.tail);
+	cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	entries = params.sq_entries;
+}
+
+AsyncIO::~AsyncIO()
+{
+	// don't leave the kernel writing into buffers that are about to go away
+	Drain();
+	Shutdown();
+}
+
+// unmap and close the ring; closing it has the kernel cancel anything still in flight, and 
+//  from then on Available() is false
+void AsyncIO::Shutdown()
+{
+	if(sqes != MAP_FAILED) munmap(sqes, sqesSize);
+	if(cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+	if(sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+	if(ringFd >= 0) close(ringFd);
+
+	ringFd = -1;
+	entries = 0;
+	toSubmit = 0;
+	inFlight = 0;
+	sqRing = cqRing = MAP_FAILED;
+	sqes = (struct io_uring_sqe *)MAP_FAILED;
+}
+
+bool AsyncIO::Available()
+{
+	return entries > 0;
+}
+
+unsigned AsyncIO::Depth()
+{
+	return entries;
+}
+
+unsigned AsyncIO::InFlight()
+{
+	return inFlight;
+}
+
+bool AsyncIO::Queue(int opcode, int fd, void *buffer, size_t length, off_t offset, uint64_t tag)
+{
+	if(!Available()) return false;
+
+	// we're the only producer, so the tail is ours; the kernel moves the head
+	unsigned tail = *sqTail;
+	unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+	if(tail - head >= entries || inFlight >= entries) return false;
+
+	unsigned index = tail & *sqMask;
+	struct io_uring_sqe *sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buffer;
+	sqe->len = length;
+	sqe->off = offset;
+	sqe->user_data = tag;
+
+	sqArray[index] = index;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	++toSubmit;
+	++inFlight;
+
+	return true;
+}
+
+bool AsyncIO::QueueRead(int fd, void *buffer, size_t length, off_t offset, uint64_t tag)
+{
+	return Queue(IORING_OP_READ, fd, buffer, length, offset, tag);
+}
+
+bool AsyncIO::QueueWrite(int fd, const void *buffer, size_t length, off_t offset, uint64_t tag)
+{
+	return Queue(IORING_OP_WRITE, fd, (void *)buffer, length, offset, tag);
+}
+
+bool AsyncIO::Submit()
+{
+	while(toSubmit > 0)
+	{
+		int submitted = io_uring_enter(ringFd, toSubmit, 0, 0);
+		if(submitted < 0)
+		{
+			if(errno == EINTR) continue;
+			return false;
+		}
+		if(submitted == 0) return false;
+		toSubmit -= submitted;
+	}
+
+	return true;
+}
+
+bool AsyncIO::Wait(uint64_t &tag, int &result)
+{
+	if(inFlight == 0) return false;
+
+	Submit();
+
+	for(;;)
+	{
+		// the kernel produces completions at the tail, we consume at the head
+		unsigned head = *cqHead;
+		unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		if(head != tail)
+		{
+			struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+			tag = cqe->user_data;
+			result = cqe->res;
+			__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+			--inFlight;
+			return true;
+		}
+
+		if(io_uring_enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			return false;
+	}
+}
+
+void AsyncIO::Drain()
+{
+	if(!Available()) return;
+
+	// requests the kernel hasn't taken yet can just be taken back off the queue
+	if(!Submit())
+	{
+		__atomic_store_n(sqTail, *sqTail - toSubmit, __ATOMIC_RELEASE);
+		inFlight -= toSubmit;
+		toSubmit = 0;
+	}
+
+	// The rest are the kernel's until they complete.  Waiting only fails for a reason other 
+	//  than a signal if the ring itself is in trouble, so after a few tries give up on it; 
+	//  shutting it down has the kernel cancel the requests rather than finish them later.
+	uint64_t tag;
+	int result;
+	unsigned failures = 0;
+	while(inFlight > 0)
+	{
+		if(Wait(tag, result))
+		{
+			failures = 0;
+			continue;
+		}
+
+		if(++failures >= DRAIN_RETRIES)
+		{
+			Shutdown();
+			return;
+		}
+		sched_yield();
+	}
+}
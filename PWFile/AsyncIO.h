@@ -0,0 +1,66 @@
+#ifndef AsyncIO_h_included
+#define AsyncIO_h_included
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Minimal Linux io_uring wrapper, talking to the kernel through the raw syscalls so there's 
+//  no liburing dependency.  Reads and writes are queued with a tag, submitted in one batch, 
+//  and their completions come back in whatever order the device finishes them.  If the 
+//  kernel doesn't support io_uring, Available() returns false and callers should stay on 
+//  blocking I/O.
+class AsyncIO
+{
+protected:
+	int ringFd;
+	unsigned entries;
+	unsigned toSubmit;
+	unsigned inFlight;
+
+	void *sqRing;
+	void *cqRing;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+
+	// how many failed waits in a row Drain puts up with before it shuts the ring down
+	enum { DRAIN_RETRIES = 100 };
+
+	bool Queue(int opcode, int fd, void *buffer, size_t length, off_t offset, uint64_t tag);
+	void Shutdown();
+
+public:
+	AsyncIO(unsigned depth);
+	~AsyncIO();
+
+	bool Available();
+	unsigned Depth();
+	unsigned InFlight();
+
+	// these only queue the request; nothing goes to the kernel until Submit or Wait
+	bool QueueRead(int fd, void *buffer, size_t length, off_t offset, uint64_t tag);
+	bool QueueWrite(int fd, const void *buffer, size_t length, off_t offset, uint64_t tag);
+	bool Submit();
+
+	// submits anything queued, then waits for one completion; result is the byte count or 
+	//  a negative errno.  Returns false if nothing is in flight.
+	bool Wait(uint64_t &tag, int &result);
+
+	// waits out everything in flight, throwing the results away, so the buffers can be reused;
+	//  for after an error, when the caller stops taking completions part way.  If the ring 
+	//  keeps failing, it's shut down instead, and Available() is false after.
+	void Drain();
+};
+
+#endif
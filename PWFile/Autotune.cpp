@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+using namespace std;
+
+#include "Autotune.h"
+#include "CryptKeeperDES.h"
+#include "PBKDF2.h"
+#include "Pipeline.h"
+#include "misc.h"
+
+static const char *kernelNames[] = { "portable", "openssl" };
+
+static double Seconds()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static vector<unsigned char> FromHex(const char *hex)
+{
+	vector<unsigned char> bytes(strlen(hex) / 2 + 1);
+	int length = 0;
+	Hex2Bin(hex, &bytes[0], length);
+	bytes.resize(length);
+
+	return bytes;
+}
+
+TuneProfile DefaultProfile()
+{
+	TuneProfile profile;
+	profile.desKernel = DES_KERNEL_PORTABLE;
+	profile.kdfKernel = KDF_KERNEL_PORTABLE;
+	profile.threads = 0;
+	profile.pipelineChunk = 1024 * 1024;
+	profile.cacheChunk = 65536;
+
+	return profile;
+}
+
+string CPUModel()
+{
+	FILE *fp = fopen("/proc/cpuinfo", "r");
+	if(fp == NULL) return "unknown";
+
+	char line[512];
+	string model = "unknown";
+	while(fgets(line, sizeof(line), fp) != NULL)
+	{
+		if(strncmp(line, "model name", 10) != 0) continue;
+
+		char *colon = strchr(line, ':');
+		if(colon == NULL) continue;
+
+		model = colon + 2;
+		while(!model.empty() && (model[model.length() - 1] == '\n' || model[model.length() - 1] == ' '))
+			model.erase(model.length() - 1);
+		break;
+	}
+
+	fclose(fp);
+	return model;
+}
+
+// tabs separate the fields of the profile file
+string MachineKey()
+{
+	string key = CPUModel();
+	for(size_t i = 0; i < key.length(); ++i)
+		if(key[i] == '\t') key[i] = ' ';
+
+	char cores[32];
+	sprintf(cores, "/%u", thread::hardware_concurrency());
+
+	return key + cores;
+}
+
+string DefaultProfilePath()
+{
+	const char *cache = getenv("XDG_CACHE_HOME");
+	if(cache != NULL && cache[0] != '\0') return string(cache) + "/pwfile.tune";
+
+	const char *home = getenv("HOME");
+	if(home == NULL || home[0] == '\0') return "";
+
+	string directory = string(home) + "/.cache";
+	mkdir(directory.c_str(), 0700);
+
+	return directory + "/pwfile.tune";
+}
+
+static int KernelFromName(const string &name)
+{
+	for(int i = 0; i < (int)(sizeof(kernelNames) / sizeof(kernelNames[0])); ++i)
+		if(name == kernelNames[i]) return i;
+
+	return -1;
+}
+
+bool LoadProfile(const string &path, const string &machine, TuneProfile &profile)
+{
+	FILE *fp = fopen(path.c_str(), "r");
+	if(fp == NULL) return false;
+
+	bool found = false;
+	char line[1024];
+	while(!found && fgets(line, sizeof(line), fp) != NULL)
+	{
+		char *version = strtok(line, "\t");
+		char *key = strtok(NULL, "\t");
+		char *settings = strtok(NULL, "\n");
+		if(version == NULL || key == NULL || settings == NULL) continue;
+		if(strcmp(version, "1") != 0 || machine != key) continue;
+
+		TuneProfile loaded = DefaultProfile();
+		int fields = 0;
+		for(char *setting = strtok(settings, " "); setting != NULL; setting = strtok(NULL, " "))
+		{
+			char *value = strchr(setting, '=');
+			if(value == NULL) continue;
+			*value++ = '\0';
+
+			if(strcmp(setting, "des") == 0 && (loaded.desKernel = KernelFromName(value)) >= 0) ++fields;
+			else if(strcmp(setting, "kdf") == 0 && (loaded.kdfKernel = KernelFromName(value)) >= 0) ++fields;
+			else if(strcmp(setting, "threads") == 0 && (loaded.threads = atoi(value)) >= 0) ++fields;
+			else if(strcmp(setting, "chunk") == 0 && (loaded.pipelineChunk = strtoull(value, NULL, 10)) > 0) ++fields;
+			else if(strcmp(setting, "cache") == 0 && (loaded.cacheChunk = strtoull(value, NULL, 10)) > 0) ++fields;
+		}
+
+		// a line that's been edited into something unusable is measured again
+		if(fields == 5 && loaded.pipelineChunk % 16 == 0 && loaded.cacheChunk % 16 == 0)
+		{
+			profile = loaded;
+			found = true;
+		}
+	}
+
+	fclose(fp);
+	return found;
+}
+
+// every other machine's line is kept, and the new file renamed over the old one, so a file
+//  shared by several machines is never seen half written
+bool SaveProfile(const string &path, const string &machine, const TuneProfile &profile)
+{
+	vector<string> lines;
+
+	FILE *fp = fopen(path.c_str(), "r");
+	if(fp != NULL)
+	{
+		char line[1024];
+		while(fgets(line, sizeof(line), fp) != NULL)
+		{
+			string text = line;
+			string prefix = "1\t" + machine + "\t";
+			if(text.compare(0, prefix.length(), prefix) != 0) lines.push_back(text);
+		}
+		fclose(fp);
+	}
+
+	char entry[1024];
+	snprintf(entry, sizeof(entry), "1\t%s\tdes=%s kdf=%s threads=%d chunk=%zu cache=%zu\n", machine.c_str(),
+		kernelNames[profile.desKernel], kernelNames[profile.kdfKernel], profile.threads, profile.pipelineChunk,
+		profile.cacheChunk);
+	lines.push_back(entry);
+
+	char suffix[32];
+	sprintf(suffix, ".%d", (int)getpid());
+	string temporary = path + suffix;
+
+	fp = fopen(temporary.c_str(), "w");
+	if(fp == NULL) return false;
+
+	bool ok = true;
+	for(size_t i = 0; i < lines.size(); ++i)
+		ok = ok && fputs(lines[i].c_str(), fp) >= 0;
+	ok = fclose(fp) == 0 && ok;
+
+	if(ok && rename(temporary.c_str(), path.c_str()) == 0) return true;
+
+	unlink(temporary.c_str());
+	return false;
+}
+
+// FIPS 81 single DES, and the SP 800-67 triple DES example
+bool CheckDESKernel(int kernel)
+{
+	static const char *cases[][3] = {
+		{ "133457799BBCDFF1", "0123456789ABCDEF", "85E813540F0AB405" },
+		{ "0123456789ABCDEF23456789ABCDEF01456789ABCDEF0123", "5468652071756663" "6B2062726F776E20" "666F78206A756D70",
+			"A826FD8CE53B855F" "CCE21C8112256FE6" "68D5C05DD9B6B900" }
+	};
+
+	for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+	{
+		vector<unsigned char> key = FromHex(cases[i][0]);
+		vector<unsigned char> plain = FromHex(cases[i][1]);
+		vector<unsigned char> expected = FromHex(cases[i][2]);
+
+		DESCipher cipher;
+		cipher.kernel = kernel;
+		cipher.SetKey(&key[0], key.size());
+		if(kernel == DES_KERNEL_OPENSSL && cipher.encryptEVP == NULL) return false;
+
+		vector<unsigned char> data = plain;
+		cipher.Encrypt(&data[0], data.size() / DESCipher::BLOCK_SIZE);
+		if(data != expected) return false;
+
+		cipher.Decrypt(&data[0], data.size() / DESCipher::BLOCK_SIZE);
+		if(data != plain) return false;
+	}
+
+	return true;
+}
+
+// RFC 2202 style empty HMAC, and RFC 6070 PBKDF2, including a key longer than one block
+bool CheckKDFKernel(int kernel)
+{
+	int previous = GetKDFKernel();
+	SetKDFKernel(kernel);
+
+	bool ok = HMAC_SHA1(vector<unsigned char>(), vector<unsigned char>()) ==
+		FromHex("fbdb1d1b18aa6c08324b7d64b71fb76370690e1d");
+
+	const char *salt = "salt";
+	ok = ok && StretchKey(20, 1, "password", vector<unsigned char>(salt, salt + 4)) ==
+		FromHex("0c60c80f961f0e71f3a9b524af6012062fe037a6");
+	ok = ok && StretchKey(20, 2, "password", vector<unsigned char>(salt, salt + 4)) ==
+		FromHex("ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957");
+
+	const char *longSalt = "saltSALTsaltSALTsaltSALTsaltSALTsalt";
+	ok = ok && StretchKey(25, 4096, "passwordPASSWORDpassword", vector<unsigned char>(longSalt, longSalt + 36)) ==
+		FromHex("3d2eec4fe41c849b80c8d83662c0e44a8b291a964cf2f07038");
+
+	SetKDFKernel(previous);
+	return ok;
+}
+
+// bytes a second through one cipher, for about 20ms
+static double MeasureDES(int kernel)
+{
+	DESCipher cipher;
+	cipher.kernel = kernel;
+	vector<unsigned char> key = GenerateRandom(24);
+	cipher.SetKey(&key[0], key.size());
+
+	vector<unsigned char> data(16384, 0x5a);
+	size_t bytes = 0;
+	double start = Seconds();
+	double elapsed;
+	do
+	{
+		cipher.Encrypt(&data[0], data.size() / DESCipher::BLOCK_SIZE);
+		bytes += data.size();
+		elapsed = Seconds() - start;
+	} while(elapsed < 0.02);
+
+	return bytes / elapsed;
+}
+
+// PBKDF2 passes a second
+static double MeasureKDF(int kernel)
+{
+	int previous = GetKDFKernel();
+	SetKDFKernel(kernel);
+
+	vector<unsigned char> salt = GenerateRandom(16);
+	size_t passes = 0;
+	double start = Seconds();
+	double elapsed;
+	do
+	{
+		StretchKey(24, 1024, "password", salt);
+		passes += 1024;
+		elapsed = Seconds() - start;
+	} while(elapsed < 0.02);
+
+	SetKDFKernel(previous);
+	return passes / elapsed;
+}
+
+static string TemporaryFile()
+{
+	const char *directory = getenv("TMPDIR");
+	string name = string(directory != NULL && directory[0] != '\0' ? directory : "/tmp") + "/pwtuneXXXXXX";
+
+	vector<char> buffer(name.begin(), name.end());
+	buffer.push_back('\0');
+
+	int fd = mkstemp(&buffer[0]);
+	if(fd < 0) return "";
+	close(fd);
+
+	return &buffer[0];
+}
+
+static string RandomKey()
+{
+	vector<unsigned char> key = GenerateRandom(24);
+	string hex;
+	Bin2Hex(&key[0], key.size(), hex);
+
+	return hex;
+}
+
+// bytes a second for a whole file through the pipeline, to a file in TMPDIR
+static double MeasurePipeline(const vector<unsigned char> &input, int threads, size_t chunk)
+{
+	string name = TemporaryFile();
+	if(name.empty()) return 0;
+
+	FILE *in = fmemopen((void *)&input[0], input.size(), "r");
+	CryptKeeperDES ck(RandomKey().c_str());
+
+	double rate = 0;
+	if(in != NULL && ck.Open(name.c_str(), "w"))
+	{
+		double start = Seconds();
+		bool ok = PipelineEncrypt(ck, in, threads, chunk);
+		double elapsed = Seconds() - start;
+
+		if(ok) rate = input.size() / elapsed;
+		ck.Close();
+	}
+
+	if(in != NULL) fclose(in);
+	unlink(name.c_str());
+
+	return rate;
+}
+
+// bytes a second reading a file through in 4k reads, the way pwfile does without a pipeline
+static size_t MeasureCache(size_t bytes)
+{
+	static const size_t chunks[] = { 16384, 65536, 262144, 1048576 };
+	size_t best = 65536;
+
+	string name = TemporaryFile();
+	if(name.empty()) return best;
+
+	string key = RandomKey();
+	{
+		CryptKeeperDES ck(key.c_str());
+		vector<unsigned char> data(bytes, 0xa5);
+		if(!ck.Open(name.c_str(), "w") || ck.Write(&data[0], data.size()) != data.size())
+		{
+			unlink(name.c_str());
+			return best;
+		}
+		ck.Close();
+	}
+
+	double bestRate = 0;
+	for(size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i)
+	{
+		CryptKeeperDES ck(key.c_str());
+		ck.SetCache(chunks[i], 4 * 1024 * 1024 / chunks[i], 4);
+		if(!ck.Open(name.c_str(), "r")) continue;
+
+		unsigned char buffer[4096];
+		size_t total = 0;
+		double start = Seconds();
+		for(size_t size = sizeof(buffer); size == sizeof(buffer); total += size)
+			size = ck.Read(buffer, sizeof(buffer));
+		double elapsed = Seconds() - start;
+		ck.Close();
+
+		if(total == bytes && total / elapsed > bestRate)
+		{
+			bestRate = total / elapsed;
+			best = chunks[i];
+		}
+	}
+
+	unlink(name.c_str());
+	return best;
+}
+
+TuneProfile MeasureProfile()
+{
+	TuneProfile profile = DefaultProfile();
+
+	// kernels that don't pass are never timed
+	double bestDES = 0;
+	double bestKDF = 0;
+	for(int kernel = 0; kernel < DES_KERNELS; ++kernel)
+	{
+		double rate = CheckDESKernel(kernel) ? MeasureDES(kernel) : 0;
+		if(rate > bestDES)
+		{
+			bestDES = rate;
+			profile.desKernel = kernel;
+		}
+	}
+	for(int kernel = 0; kernel < KDF_KERNELS; ++kernel)
+	{
+		double rate = CheckKDFKernel(kernel) ? MeasureKDF(kernel) : 0;
+		if(rate > bestKDF)
+		{
+			bestKDF = rate;
+			profile.kdfKernel = kernel;
+		}
+	}
+
+	// the rest is measured with the kernel that will be used
+	int previous = GetDESKernel();
+	SetDESKernel(profile.desKernel);
+
+	// powers of two up to the core count, and the core count
+	unsigned cores = thread::hardware_concurrency();
+	if(cores == 0) cores = 1;
+	vector<int> threadCounts;
+	for(unsigned count = 1; count < cores; count *= 2)
+		threadCounts.push_back(count);
+	threadCounts.push_back(cores);
+
+	static const size_t chunkSizes[] = { 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+	const size_t megabyte = 1024 * 1024;
+
+	// each run sized for about 50ms if the threads scale, and at least two chunks per thread
+	vector<double> threadRates(threadCounts.size(), 0);
+	vector<size_t> threadChunks(threadCounts.size(), profile.pipelineChunk);
+	for(size_t t = 0; t < threadCounts.size(); ++t)
+	{
+		size_t bytes = (size_t)(bestDES * 0.05 * threadCounts[t]);
+		bytes = bytes < megabyte ? megabyte : (bytes + megabyte - 1) / megabyte * megabyte;
+		if(bytes > 64 * megabyte) bytes = 64 * megabyte;
+		vector<unsigned char> input(bytes, 0x3c);
+
+		for(size_t c = 0; c < sizeof(chunkSizes) / sizeof(chunkSizes[0]); ++c)
+		{
+			if(c > 0 && bytes < 2 * threadCounts[t] * chunkSizes[c]) break;
+
+			double rate = MeasurePipeline(input, threadCounts[t], chunkSizes[c]);
+			if(rate > threadRates[t])
+			{
+				threadRates[t] = rate;
+				threadChunks[t] = chunkSizes[c];
+			}
+		}
+	}
+
+	// the fewest threads within 5% of the best, since more would only load the machine
+	double bestPipeline = 0;
+	for(size_t t = 0; t < threadRates.size(); ++t)
+		if(threadRates[t] > bestPipeline) bestPipeline = threadRates[t];
+	for(size_t t = 0; t < threadRates.size(); ++t)
+	{
+		if(bestPipeline > 0 && threadRates[t] >= bestPipeline * 0.95)
+		{
+			profile.threads = threadCounts[t];
+			profile.pipelineChunk = threadChunks[t];
+			break;
+		}
+	}
+
+	size_t cacheBytes = (size_t)(bestDES * 0.02);
+	if(cacheBytes < megabyte) cacheBytes = megabyte;
+	if(cacheBytes > 16 * megabyte) cacheBytes = 16 * megabyte;
+	profile.cacheChunk = MeasureCache(cacheBytes);
+
+	SetDESKernel(previous);
+	return profile;
+}
+
+TuneProfile GetProfile(const string &path, bool retune)
+{
+	TuneProfile profile = DefaultProfile();
+	if(path.empty()) return profile;
+
+	string machine = MachineKey();
+	if(!retune && LoadProfile(path, machine, profile)) return profile;
+
+	profile = MeasureProfile();
+	SaveProfile(path, machine, profile);
+
+	return profile;
+}
+
+// the portable kernels are what's left if a check fails, so only the others are checked
+void ApplyProfile(const TuneProfile &profile)
+{
+	int des = profile.desKernel;
+	if(des != DES_KERNEL_PORTABLE && !CheckDESKernel(des)) des = DES_KERNEL_PORTABLE;
+	SetDESKernel(des);
+
+	int kdf = profile.kdfKernel;
+	if(kdf != KDF_KERNEL_PORTABLE && !CheckKDFKernel(kdf)) kdf = KDF_KERNEL_PORTABLE;
+	SetKDFKernel(kdf);
+}
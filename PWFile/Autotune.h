@@ -0,0 +1,56 @@
+#ifndef Autotune_h_included
+#define Autotune_h_included
+
+#include <stddef.h>
+#include <string>
+using namespace std;
+
+/* Startup autotuner.  The DES and PBKDF2 kernels, the pipeline's thread count and chunk size,
+ * and the decrypted chunk cache size are each measured on the machine, and the fastest kept.
+ * A kernel has to give the right answers for the known answer tests before it's timed, and
+ * again before a saved profile switches to it.  Profiles are saved one line per CPU model
+ * and core count, so a home directory shared across different machines works:
+
+   1	Intel(R) Xeon(R) Gold 6248 CPU @ 2.50GHz/40	des=openssl kdf=openssl threads=16 chunk=1048576 cache=65536
+
+ * The first field is the format version; lines of other versions are left alone.  Delete a
+ * line, or run with retune, to measure that machine again.
+*/
+
+struct TuneProfile
+{
+	int desKernel;
+	int kdfKernel;
+	int threads;
+	size_t pipelineChunk;
+	size_t cacheChunk;
+};
+
+// the settings used before anything is measured: the portable kernels, no pipeline
+TuneProfile DefaultProfile();
+
+// the model name from /proc/cpuinfo, and with the core count, what the profile file is keyed by
+string CPUModel();
+string MachineKey();
+// $XDG_CACHE_HOME/pwfile.tune, or ~/.cache/pwfile.tune; empty if there's no home directory
+string DefaultProfilePath();
+
+bool LoadProfile(const string &path, const string &machine, TuneProfile &profile);
+bool SaveProfile(const string &path, const string &machine, const TuneProfile &profile);
+
+// run the known answer tests for one kernel
+bool CheckDESKernel(int kernel);
+bool CheckKDFKernel(int kernel);
+
+// measures everything; takes a second or two, most of it running the pipeline
+TuneProfile MeasureProfile();
+
+// The profile for this machine from the file at path, or measured and saved there if the file
+//  has none (or retune is set).  With no path, nothing is measured and the defaults are used,
+//  since measuring on every run would cost more than it saves.
+TuneProfile GetProfile(const string &path, bool retune);
+
+// switch new keys over to the profile's kernels, after checking them again
+void ApplyProfile(const TuneProfile &profile);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef BasicCryptKeeper_h_included
+#define BasicCryptKeeper_h_included
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <vector>
+#include <string>
+using namespace std;
+
+#include "CryptKeeper.h"
+
+/* A block cipher keeper with the cipher fixed at compile time.  Each block is XORed with
+ * the nonce, with the block counter in its last 8 bytes, and then encrypted, the same as the
+ * virtual per block functions always did; but here the block size is a constant, the nonce
+ * mixing is inline, and a whole run of blocks goes to the cipher in one call, so the loops
+ * in Read and Write come down to straight line code with no virtual call per block.
+ *
+ * The policy is a class with:
+ *
+ *   enum { BLOCK_SIZE = n };                          8 or more, a multiple of 8
+ *   void SetKey(const unsigned char *key, size_t length);
+ *   void Encrypt(unsigned char *blocks, size_t count);   in place, ECB
+ *   void Decrypt(unsigned char *blocks, size_t count);
+ */
+
+template <class CipherPolicy>
+class BasicCryptKeeper : public CryptKeeper
+{
+protected:
+	enum { BLOCK_SIZE = CipherPolicy::BLOCK_SIZE };
+
+	CipherPolicy cipher;
+
+	// the nonce with the counter over its last 8 bytes, byte for byte what ModifyNonce makes
+	inline void CounterBlock(size_t counter, unsigned char *block)
+	{
+		memcpy(block, &nonce[0], BLOCK_SIZE - sizeof(size_t));
+
+		const unsigned char *counterBytes = (const unsigned char *)&counter;
+		for(size_t i = 0; i < sizeof(size_t); ++i)
+			block[BLOCK_SIZE - 1 - i] = counterBytes[i];
+	}
+
+	inline void MixNonce(unsigned char *blocks, size_t count, size_t counter)
+	{
+		for(size_t i = 0; i < count; ++i, blocks += BLOCK_SIZE)
+		{
+			unsigned char mask[BLOCK_SIZE];
+			CounterBlock(counter + i, mask);
+
+			for(size_t j = 0; j < BLOCK_SIZE; ++j)
+				blocks[j] ^= mask[j];
+		}
+	}
+
+	virtual void EncryptRun(unsigned char *blocks, size_t count, size_t counter)
+	{
+		MixNonce(blocks, count, counter);
+		cipher.Encrypt(blocks, count);
+	}
+
+	virtual void DecryptRun(unsigned char *blocks, size_t count, size_t counter)
+	{
+		cipher.Decrypt(blocks, count);
+		MixNonce(blocks, count, counter);
+	}
+
+	virtual void EncryptBlock(vector<unsigned char> &data, size_t offset, size_t counter)
+	{
+		assert(offset + BLOCK_SIZE <= data.size());
+		EncryptRun(&data[offset], 1, counter);
+	}
+
+	virtual void DecryptBlock(vector<unsigned char> &data, size_t offset, size_t counter)
+	{
+		assert(offset + BLOCK_SIZE <= data.size());
+		DecryptRun(&data[offset], 1, counter);
+	}
+
+	// the first 6 hex digits of a block of 0s encrypted with no nonce
+	virtual string GetKCV()
+	{
+		unsigned char block[BLOCK_SIZE];
+		memset(block, 0, sizeof(block));
+		cipher.Encrypt(block, 1);
+
+		char kcv[16];
+		sprintf(kcv, "%06x", (int)block[0] << 16 | (int)block[1] << 8 | (int)block[2]);
+
+		return string(kcv);
+	}
+
+	virtual bool SetKey(const vector<unsigned char> &newKey)
+	{
+		CryptKeeper::SetKey(newKey);
+		cipher.SetKey(key.empty() ? NULL : &key[0], key.size());
+		return true;
+	}
+
+public:
+	BasicCryptKeeper(const char *key) : CryptKeeper(key)
+	{
+		blockSize = BLOCK_SIZE;
+	}
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef BoundedQueue_h_included
+#define BoundedQueue_h_included
+
+#include <stddef.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+// Lock-free bounded multi-producer, multi-consumer queue (Dmitry Vyukov's design).  Each cell
+//  carries a sequence number that tells producers and consumers whether it's their turn, so
+//  the only contention is a compare-and-swap on the head or tail position.  Capacity must be 
+//  a power of two.
+template <class T> class BoundedQueue
+{
+protected:
+	struct Cell
+	{
+		atomic<size_t> sequence;
+		T data;
+	};
+
+	Cell *cells;
+	size_t mask;
+	atomic<size_t> enqueuePos;
+	atomic<size_t> dequeuePos;
+
+	// Push and Pop sleep on changed once a short spin hasn't got them anywhere.  A sleeper 
+	//  counts itself in waiters before it looks at the queue again, and every push or pop 
+	//  looks at waiters after it's done, with a fence on both sides, so either the sleeper 
+	//  sees the change or the one who made it sees the sleeper and wakes it.  With nobody 
+	//  asleep, the lock-free path never touches the mutex.
+	enum { SPIN_LIMIT = 64 };
+	mutex waitMutex;
+	condition_variable changed;
+	atomic<int> waiters;
+
+	void Wake()
+	{
+		atomic_thread_fence(memory_order_seq_cst);
+		if(waiters.load(memory_order_relaxed) == 0) return;
+
+		lock_guard<mutex> guard(waitMutex);
+		changed.notify_all();
+	}
+
+	// the queue operations themselves; the public ones wake any sleepers after
+	bool Enqueue(const T &value)
+	{
+		size_t pos = enqueuePos.load(memory_order_relaxed);
+		for(;;)
+		{
+			Cell *cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(memory_order_acquire);
+			ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+			if(diff == 0)
+			{
+				if(enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+				{
+					cell->data = value;
+					cell->sequence.store(pos + 1, memory_order_release);
+					return true;
+				}
+			}
+			else if(diff < 0)
+				return false;
+			else
+				pos = enqueuePos.load(memory_order_relaxed);
+		}
+	}
+
+	bool Dequeue(T &value)
+	{
+		size_t pos = dequeuePos.load(memory_order_relaxed);
+		for(;;)
+		{
+			Cell *cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(memory_order_acquire);
+			ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+			if(diff == 0)
+			{
+				if(dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+				{
+					value = cell->data;
+					cell->sequence.store(pos + mask + 1, memory_order_release);
+					return true;
+				}
+			}
+			else if(diff < 0)
+				return false;
+			else
+				pos = dequeuePos.load(memory_order_relaxed);
+		}
+	}
+
+public:
+	BoundedQueue(size_t capacity)
+	{
+		cells = new Cell[capacity];
+		mask = capacity - 1;
+		for(size_t i = 0; i < capacity; ++i)
+			cells[i].sequence.store(i, memory_order_relaxed);
+		enqueuePos.store(0, memory_order_relaxed);
+		dequeuePos.store(0, memory_order_relaxed);
+		waiters.store(0);
+	}
+
+	~BoundedQueue()
+	{
+		delete [] cells;
+	}
+
+	bool TryPush(const T &value)
+	{
+		if(!Enqueue(value)) return false;
+		Wake();
+		return true;
+	}
+
+	bool TryPop(T &value)
+	{
+		if(!Dequeue(value)) return false;
+		Wake();
+		return true;
+	}
+
+	// blocking versions; these yield for a few tries, then sleep until there's room or data
+	void Push(const T &value)
+	{
+		for(int spin = 0; spin < SPIN_LIMIT; ++spin)
+		{
+			if(TryPush(value)) return;
+			this_thread::yield();
+		}
+
+		{
+			unique_lock<mutex> lock(waitMutex);
+			waiters.fetch_add(1);
+			atomic_thread_fence(memory_order_seq_cst);
+			while(!Enqueue(value)) changed.wait(lock);
+			waiters.fetch_sub(1);
+		}
+		Wake();
+	}
+
+	T Pop()
+	{
+		T value;
+		for(int spin = 0; spin < SPIN_LIMIT; ++spin)
+		{
+			if(TryPop(value)) return value;
+			this_thread::yield();
+		}
+
+		{
+			unique_lock<mutex> lock(waitMutex);
+			waiters.fetch_add(1);
+			atomic_thread_fence(memory_order_seq_cst);
+			while(!Dequeue(value)) changed.wait(lock);
+			waiters.fetch_sub(1);
+		}
+		Wake();
+
+		return value;
+	}
+};
+
+#endif
@@ -0,0 +1,69 @@
+#include <string.h>
+#include <assert.h>
+
+#include "ChunkMAC.h"
+
+ChunkMAC::ChunkMAC()
+{
+	inner = EVP_MD_CTX_new();
+	outer = EVP_MD_CTX_new();
+}
+
+ChunkMAC::~ChunkMAC()
+{
+	EVP_MD_CTX_free(inner);
+	EVP_MD_CTX_free(outer);
+}
+
+// RFC 2104; keys longer than the 64 byte SHA-256 block are hashed first
+void ChunkMAC::SetKey(const unsigned char *key, size_t length)
+{
+	unsigned char block[64];
+	memset(block, 0, sizeof(block));
+
+	if(length > sizeof(block))
+	{
+		unsigned int digestLength = 0;
+		EVP_Digest(key, length, block, &digestLength, EVP_sha256(), NULL);
+	}
+	else if(length > 0)
+	{
+		memcpy(block, key, length);
+	}
+
+	unsigned char pad[64];
+
+	for(size_t i = 0; i < sizeof(block); ++i) pad[i] = block[i] ^ 0x36;
+	EVP_DigestInit_ex(inner, EVP_sha256(), NULL);
+	EVP_DigestUpdate(inner, pad, sizeof(pad));
+
+	for(size_t i = 0; i < sizeof(block); ++i) pad[i] = block[i] ^ 0x5c;
+	EVP_DigestInit_ex(outer, EVP_sha256(), NULL);
+	EVP_DigestUpdate(outer, pad, sizeof(pad));
+}
+
+// the chunk number goes in first, little endian, so chunks can't be swapped around
+void ChunkMAC::Tag(uint64_t index, const unsigned char *data, size_t length, unsigned char *tag)
+{
+	unsigned char prefix[8];
+	for(int i = 0; i < 8; ++i)
+		prefix[i] = (unsigned char)(index >> (8 * i));
+
+	unsigned char digest[TAG_SIZE];
+	unsigned int digestLength = 0;
+
+	EVP_MD_CTX *work = EVP_MD_CTX_new();
+
+	EVP_MD_CTX_copy_ex(work, inner);
+	EVP_DigestUpdate(work, prefix, sizeof(prefix));
+	if(length > 0) EVP_DigestUpdate(work, data, length);
+	EVP_DigestFinal_ex(work, digest, &digestLength);
+
+	EVP_MD_CTX_copy_ex(work, outer);
+	EVP_DigestUpdate(work, digest, sizeof(digest));
+	EVP_DigestFinal_ex(work, tag, &digestLength);
+
+	EVP_MD_CTX_free(work);
+
+	assert(digestLength == TAG_SIZE);
+}
@@ -0,0 +1,27 @@
+#ifndef ChunkMAC_h_included
+#define ChunkMAC_h_included
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+// HMAC-SHA256 over a chunk of ciphertext and its chunk number.  The inner and outer pad
+//  states are hashed once when the key is set, and each tag starts from a copy of them, so
+//  Tag can be called from several threads at once.
+class ChunkMAC
+{
+protected:
+	EVP_MD_CTX *inner;
+	EVP_MD_CTX *outer;
+
+public:
+	enum { TAG_SIZE = 32 };
+
+	ChunkMAC();
+	~ChunkMAC();
+
+	void SetKey(const unsigned char *key, size_t length);
+	void Tag(uint64_t index, const unsigned char *data, size_t length, unsigned char *tag);
+};
+
+#endif
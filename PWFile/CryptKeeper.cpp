@@ -4,12 +4,22 @@
 #include <memory.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
 using namespace std;
 
 #include "CryptKeeper.h"
 #include "misc.h"
+#include "RekeyJournal.h"
 
 // accepts the file encryption key in the clear; it's the caller's responsibility to 
 //  handle providing the key from secure storage
@@ -25,14 +35,322 @@ CryptKeeper::CryptKeeper(const char *enckey)
 	fileSize = 0;
 	fp = NULL;
 
+	mapBase = NULL;
+	mapLength = 0;
+
+	// 64k chunks, 4M of cache, and read 256k ahead on sequential access
+	cacheChunkSize = 65536;
+	cacheChunks = 64;
+	readaheadChunks = 4;
+	lastReadEnd = 0;
+	memset(&cacheStats, 0, sizeof(cacheStats));
+
+	// gather up to 1M of writes before encrypting them
+	pendingStart = 0;
+	pendingLimit = 1024 * 1024;
+
+	// 16 chunks, so a 1M batch per read and write
+	streamChunks = 16;
+
+	aio = NULL;
+	aioExtent = 0;
+
+	// a 16k gap costs less to read through than another syscall
+	gatherGap = 16384;
+
+	backgroundKey = false;
+	keyPending.store(false);
+	keyRejected = false;
+	keyUsable = true;
+
+	metrics = IOMetrics::ProcessEnabled() ? new IOMetrics() : NULL;
+	traceHook = NULL;
+	traceContext = NULL;
+
 	// for DES
 	blockSize = 8;
 	headerSize = 64;
+	textHeaderSize = 64;
 	fileVersion = "1.0";
+
+	headerVersion = 2;
+	cipherId = CIPHER_3DES;
+	kdfId = KDF_NONE;
+	kdfKeyLength = 0;
+	kdfIterations = 0;
+	headerWritten = false;
+	headerDataLength = 0;
+	compressed = false;
+	keystreamCipher = false;
+	writeFailed = false;
+
+	streamFormat = false;
+	authenticated = false;
+	macChunkSize = 65536;
+	macReady = false;
+	rootPending = false;
+	rootValid = true;
+	rootChanged = false;
+	tagsChanged = false;
+	integrityFailed = false;
+	memset(rootTag, 0, sizeof(rootTag));
+	taggedLength = 0;
+	touchedEnd = 0;
 }
 
 CryptKeeper::~CryptKeeper()
 {
+	delete aio;
+	delete metrics;
+}
+
+void CryptKeeper::EnableMetrics(bool enable)
+{
+	if(enable && metrics == NULL) metrics = new IOMetrics();
+	if(!enable)
+	{
+		delete metrics;
+		metrics = NULL;
+	}
+}
+
+IOMetrics *CryptKeeper::GetMetrics()
+{
+	return metrics;
+}
+
+void CryptKeeper::SetTraceHook(TraceHook hook, void *context)
+{
+	traceHook = hook;
+	traceContext = context;
+}
+
+// one or more syscalls (or io_uring completions) that moved bytes of ciphertext
+void CryptKeeper::CountIO(bool write, size_t bytes, size_t calls, uint64_t started)
+{
+	if(metrics == NULL) return;
+
+	Count(write ? METRIC_BYTES_WRITTEN : METRIC_BYTES_READ, bytes);
+	Count(write ? METRIC_WRITE_CALLS : METRIC_READ_CALLS, calls);
+	Count(METRIC_IO_NS, IOMetrics::Now() - started);
+}
+
+bool CryptKeeper::SetKey(const vector<unsigned char> &newKey)
+{
+	key = newKey;
+	keyUsable = true;
+
+	// the MAC key comes from this one
+	macReady = false;
+
+	return true;
+}
+
+// nothing to do when the key is given up front
+void CryptKeeper::DeriveKey()
+{
+}
+
+void CryptKeeper::MakeKey(function<vector<unsigned char>()> make)
+{
+	if(!backgroundKey)
+	{
+		SetKey(make());
+		return;
+	}
+
+	keyFuture = async(launch::async, make);
+	keyPending.store(true);
+}
+
+// cheap once the key is in, so everything that needs the key calls this first
+bool CryptKeeper::WaitKey()
+{
+	if(!keyPending.load()) return !keyRejected && keyUsable;
+
+	lock_guard<mutex> guard(keyMutex);
+	if(!keyPending.load()) return !keyRejected && keyUsable;
+
+	keyRejected = !SetKey(keyFuture.get()) || !CheckKey();
+	keyPending.store(false);
+
+	return !keyRejected;
+}
+
+// whether the key is the one the file was written with: the key check MAC if the header has
+//  one, after the key check value, which is cheaper and turns away almost every wrong key
+bool CryptKeeper::CheckKey()
+{
+	if(!keyUsable) return false;
+	if(!fileKCV.empty() && fileKCV != GetKCV()) return false;
+	if(fileKeyCheck.empty()) return true;
+
+	PrepareMAC();
+	vector<unsigned char> check;
+	KeyCheck(check);
+
+	return check == fileKeyCheck;
+}
+
+// Open's last step, once the header is read or created.  A key made here is checked now, and
+//  a wrong one closes the file again before any data is read; one made in the background is
+//  checked by WaitKey, with the first chunks read in meanwhile.
+bool CryptKeeper::StartKey()
+{
+	keyRejected = false;
+	DeriveKey();
+
+	if(keyPending.load())
+	{
+		PrefetchHead();
+		return true;
+	}
+
+	if(CheckKey()) return true;
+	keyRejected = true;
+
+	return AbandonOpen();
+}
+
+// undo an Open that got as far as opening the file, and fail it
+bool CryptKeeper::AbandonOpen()
+{
+	if(mapBase != NULL)
+	{
+		munmap(mapBase, mapLength);
+		mapBase = NULL;
+		mapLength = 0;
+	}
+
+	fclose(fp);
+	fp = NULL;
+
+	return false;
+}
+
+// The plaintext of a block a write only partly covers, from its ciphertext, which has been
+//  read into block; whole says it was all there.  A block that wasn't is zeros, and for a 
+//  keystream cipher the zeros are ciphertext, so the part the write doesn't cover goes back
+//  out as zeros rather than as keystream.
+void CryptKeeper::PrepareBlock(unsigned char *block, size_t index, bool whole)
+{
+	if(!whole) memset(block, 0, blockSize);
+	if(whole || keystreamCipher) DecryptBlocks(block, 1, index);
+}
+
+// Mark [start, end) of the data as written under this nonce, or return false if any of it
+//  already was; only a keystream cipher keeps track.
+bool CryptKeeper::ClaimKeystream(size_t start, size_t end)
+{
+	if(!keystreamCipher || start >= end) return true;
+
+	lock_guard<mutex> guard(metaMutex);
+
+	// only the range before start and the first one after it can overlap
+	map<size_t, size_t>::iterator next = keystreamUsed.upper_bound(start);
+	if(next != keystreamUsed.end() && next->first < end) return false;
+
+	map<size_t, size_t>::iterator previous = keystreamUsed.end();
+	if(next != keystreamUsed.begin())
+	{
+		previous = next;
+		if((--previous)->second > start) return false;
+	}
+
+	// join up with the ranges either side where they touch, so appends stay one range
+	if(next != keystreamUsed.end() && next->first == end)
+	{
+		end = next->second;
+		keystreamUsed.erase(next);
+	}
+	if(previous != keystreamUsed.end() && previous->second == start) previous->second = end;
+	else keystreamUsed[start] = end;
+
+	return true;
+}
+
+void CryptKeeper::DeriveKeyInBackground(bool enable)
+{
+	backgroundKey = enable;
+}
+
+bool CryptKeeper::VerifyKey()
+{
+	return fp != NULL && WaitKey();
+}
+
+// while the key is being made, have the kernel start reading the first chunks in, so the 
+//  first Read finds them in the page cache
+void CryptKeeper::PrefetchHead()
+{
+	size_t bytes = (readaheadChunks + 1) * cacheChunkSize;
+
+	if(mapBase != NULL)
+		madvise(mapBase, mapLength < headerSize + bytes ? mapLength : headerSize + bytes, MADV_WILLNEED);
+	else if(fp != NULL)
+		posix_fadvise(fileno(fp), headerSize, bytes, POSIX_FADV_WILLNEED);
+}
+
+void CryptKeeper::DecryptRun(unsigned char *blocks, size_t count, size_t counter)
+{
+	vector<unsigned char> block(blockSize);
+
+	for(size_t i = 0; i < count; ++i, blocks += blockSize)
+	{
+		memcpy(&block[0], blocks, blockSize);
+		DecryptBlock(block, 0, counter + i);
+		memcpy(blocks, &block[0], blockSize);
+	}
+}
+
+void CryptKeeper::EncryptRun(unsigned char *blocks, size_t count, size_t counter)
+{
+	vector<unsigned char> block(blockSize);
+
+	for(size_t i = 0; i < count; ++i, blocks += blockSize)
+	{
+		memcpy(&block[0], blocks, blockSize);
+		EncryptBlock(block, 0, counter + i);
+		memcpy(blocks, &block[0], blockSize);
+	}
+}
+
+void CryptKeeper::DecryptBlocks(unsigned char *blocks, size_t count, size_t counter)
+{
+	if(count == 0) return;
+
+	MetricsTimer timer(metrics, METRIC_CIPHER_NS);
+	DecryptRun(blocks, count, counter);
+
+	Count(METRIC_BLOCKS_DECRYPTED, count);
+	Count(METRIC_BYTES_DECRYPTED, count * blockSize);
+}
+
+void CryptKeeper::EncryptBlocks(unsigned char *blocks, size_t count, size_t counter)
+{
+	if(count == 0) return;
+
+	MetricsTimer timer(metrics, METRIC_CIPHER_NS);
+	EncryptRun(blocks, count, counter);
+
+	Count(METRIC_BLOCKS_ENCRYPTED, count);
+	Count(METRIC_BYTES_ENCRYPTED, count * blockSize);
+}
+
+void CryptKeeper::DecryptBlocks(vector<unsigned char> &data, size_t offset, size_t count, size_t counter)
+{
+	if(count == 0) return;
+	assert(offset + count * blockSize <= data.size());
+
+	DecryptBlocks(&data[offset], count, counter);
+}
+
+void CryptKeeper::EncryptBlocks(vector<unsigned char> &data, size_t offset, size_t count, size_t counter)
+{
+	if(count == 0) return;
+	assert(offset + count * blockSize <= data.size());
+
+	EncryptBlocks(&data[offset], count, counter);
 }
 
 void CryptKeeper::ModifyNonce(size_t counter, vector<unsigned char> &modifiedNonce)
@@ -42,12 +360,217 @@ void CryptKeeper::ModifyNonce(size_t counter, vector<unsigned char> &modifiedNon
 	modifiedNonce = nonce;
 
 	unsigned char *counterBytes = (unsigned char *)&counter;
-	for(int i = 0; i < sizeof(size_t); ++i)
+	for(size_t i = 0; i < sizeof(size_t); ++i)
 		modifiedNonce[blockSize - 1 - i] = counterBytes[i];
 
 	return;
 }
 
+// read raw ciphertext blocks, from the mapping if there is one, otherwise from the file; 
+//  returns the number of bytes actually available
+size_t CryptKeeper::ReadCiphertext(size_t blockStart, size_t blockCount, unsigned char *dest)
+{
+	size_t position = blockStart * blockSize + headerSize;
+
+	uint64_t started = MetricsClock();
+
+	// a mapping takes no syscalls, but the page faults are I/O all the same
+	if(mapBase != NULL)
+	{
+		if(position >= mapLength) return 0;
+
+		size_t bytes = blockCount * blockSize;
+		if(position + bytes > mapLength) bytes = mapLength - position;
+
+		memcpy(dest, mapBase + position, bytes);
+		CountIO(false, bytes, 0, started);
+		return bytes;
+	}
+
+	fseeko(fp, position, SEEK_SET);
+	size_t bytes = fread((void *)dest, 1, blockCount * blockSize, fp);
+	CountIO(false, bytes, 1, started);
+
+	return bytes;
+}
+
+bool CryptKeeper::EnableAsyncIO(unsigned depth, size_t extent)
+{
+	delete aio;
+	aio = new AsyncIO(depth);
+
+	if(!aio->Available())
+	{
+		delete aio;
+		aio = NULL;
+		return false;
+	}
+
+	// extents have to stay block aligned
+	aioExtent = extent - extent % blockSize;
+	if(aioExtent == 0) aioExtent = blockSize;
+
+	return true;
+}
+
+// only worth going through the ring for something that splits into several extents
+bool CryptKeeper::UseAsyncIO(size_t bytes)
+{
+	return aio != NULL && aio->Available() && mapBase == NULL && bytes >= 2 * aioExtent;
+}
+
+// Read blocks into dest at destOffset and decrypt them; returns the number of bytes read.
+//  With io_uring, the extents are all queued up front and each one is decrypted as soon as 
+//  its read completes, so the cipher work overlaps the rest of the I/O.
+size_t CryptKeeper::ReadDecrypt(size_t blockStart, size_t blockCount, unsigned char *dest)
+{
+	size_t total = blockCount * blockSize;
+	if(total == 0) return 0;
+
+	if(!UseAsyncIO(total))
+	{
+		size_t bytes = ReadCiphertext(blockStart, blockCount, dest);
+		bytes = CheckCiphertext(blockStart, bytes, dest);
+		DecryptBlocks(dest, bytes / blockSize, blockStart);
+		return bytes;
+	}
+
+	// stdio may still be holding on to writes
+	fflush(fp);
+	int fd = fileno(fp);
+
+	size_t extents = (total + aioExtent - 1) / aioExtent;
+	vector<size_t> extentBytes(extents, 0);
+	size_t next = 0;
+	size_t done = 0;
+
+	while(done < extents)
+	{
+		while(next < extents)
+		{
+			size_t offset = next * aioExtent;
+			size_t length = total - offset < aioExtent ? total - offset : aioExtent;
+			if(!aio->QueueRead(fd, dest + offset, length, 
+				blockStart * blockSize + offset + headerSize, next)) break;
+			++next;
+		}
+
+		uint64_t tag;
+		int result;
+		uint64_t started = MetricsClock();
+		if(!aio->Wait(tag, result))
+		{
+			// what's still in flight lands in dest, so it has to finish before we return; it
+			//  doesn't count, as it isn't decrypted
+			aio->Drain();
+			break;
+		}
+		++done;
+
+		if(result <= 0) continue;
+		CountIO(false, result, 1, started);
+
+		size_t offset = tag * aioExtent;
+		size_t bytes = CheckCiphertext(blockStart + offset / blockSize, result, dest + offset);
+		extentBytes[tag] = bytes;
+
+		DecryptBlocks(dest + offset, bytes / blockSize, blockStart + offset / blockSize);
+	}
+
+	// a short extent is the end of the file
+	size_t bytes = 0;
+	for(size_t i = 0; i < extents; ++i)
+	{
+		bytes += extentBytes[i];
+		if(extentBytes[i] < aioExtent) break;
+	}
+
+	return bytes < total ? bytes : total;
+}
+
+// Encrypt blocks from data and write them out; returns false if any of it didn't make it to
+//  the file.  With io_uring, each extent is queued as soon as it's encrypted, so the next 
+//  extent is encrypted while the previous ones are written.
+bool CryptKeeper::EncryptWrite(size_t blockStart, size_t blockCount, vector<unsigned char> &data)
+{
+	size_t total = blockCount * blockSize;
+	assert(total <= data.size());
+
+	if(!UseAsyncIO(total))
+	{
+		EncryptBlocks(data, 0, blockCount, blockStart);
+		TagCiphertext(blockStart, total, &data[0]);
+
+		uint64_t started = MetricsClock();
+		fseeko(fp, blockStart * blockSize + headerSize, SEEK_SET);
+		size_t written = fwrite((void *)&data[0], 1, total, fp);
+		CountIO(true, written, 1, started);
+		return written == total;
+	}
+
+	fflush(fp);
+	int fd = fileno(fp);
+	size_t position = blockStart * blockSize + headerSize;
+	bool ok = true;
+
+	size_t extents = (total + aioExtent - 1) / aioExtent;
+	for(size_t i = 0; i < extents; ++i)
+	{
+		size_t offset = i * aioExtent;
+		size_t length = total - offset < aioExtent ? total - offset : aioExtent;
+		EncryptBlocks(data, offset, length / blockSize, blockStart + offset / blockSize);
+		TagCiphertext(blockStart + offset / blockSize, length, &data[offset]);
+
+		// if the ring is full, wait for an earlier write to make room; if nothing comes back,
+		//  the ring is no good, and this extent goes out the slow way
+		bool queued = aio->QueueWrite(fd, &data[offset], length, position + offset, i);
+		while(!queued && FinishAsyncWrite(fd, data, total, position, ok))
+			queued = aio->QueueWrite(fd, &data[offset], length, position + offset, i);
+
+		if(queued) aio->Submit();
+		else if(!PWriteCiphertext(blockStart + offset / blockSize, length / blockSize, &data[offset])) ok = false;
+	}
+
+	while(FinishAsyncWrite(fd, data, total, position, ok));
+
+	// anything still in flight after a wait failed never told us it was written
+	if(aio->InFlight() > 0) ok = false;
+	aio->Drain();
+
+	// make sure stdio doesn't serve anything stale from before these writes
+	fflush(fp);
+
+	return ok;
+}
+
+// wait for one of EncryptWrite's extents, and finish off a short or failed write the slow way;
+//  ok is cleared if even that doesn't get all of it out.  Returns false once there's nothing
+//  more to wait for.
+bool CryptKeeper::FinishAsyncWrite(int fd, vector<unsigned char> &data, size_t total, size_t position, bool &ok)
+{
+	uint64_t tag;
+	int result;
+	uint64_t started = MetricsClock();
+	if(!aio->Wait(tag, result)) return false;
+
+	size_t offset = tag * aioExtent;
+	size_t length = total - offset < aioExtent ? total - offset : aioExtent;
+	size_t done = result > 0 ? result : 0;
+	size_t calls = 1;
+	while(done < length)
+	{
+		ssize_t rest = pwrite(fd, &data[offset + done], length - done, position + offset + done);
+		++calls;
+		if(rest < 0 && errno == EINTR) continue;
+		if(rest <= 0) break;
+		done += rest;
+	}
+	if(done > 0) CountIO(true, done, calls, started);
+	if(done < length) ok = false;
+
+	return true;
+}
+
 /*
  * Read the blocks containing the target data from the file
  * Decrypt the data using the block offset
@@ -55,156 +578,1638 @@ void CryptKeeper::ModifyNonce(size_t counter, vector<unsigned char> &modifiedNon
  */
 size_t CryptKeeper::Read(void *buffer, size_t count)
 {
+	OperationTimer timer(metrics, traceHook, traceContext, OP_READ, fileOffset, count);
+	// with DeriveKeyInBackground, the first call that needs the key waits here for it
+	if(!WaitKey()) return 0;
 	assert(fileOffset >= 0);
 
+	// pending writes have to be on disk before we read the blocks back
+	FlushPending();
+
 	size_t start = fileOffset;
 	size_t end = fileOffset + count;
 
 	// truncate to end of file
-	if(end >= fileSize - 1) end = fileSize - 1;
+	if(end >= GetDataLength()) end = GetDataLength();
 
 	if(start >= end) return 0;
 
-	size_t blockStart = start / blockSize;
-	size_t blockEnd = (end + blockSize - 1) / blockSize;
-	size_t blockCount = blockEnd - blockStart;
-	size_t bytes = blockCount * blockSize;
-
-	// resize buffer if needed; make it a bit bigger to allow partial blocks on each end
-	if(blockBuffer.size() < (blockCount + 2) * blockSize)
+	// anything short of a large bulk read is served from the chunk cache
+	if(mapBase != NULL || end - start < cacheChunkSize * cacheChunks / 2)
 	{
-		blockBuffer.resize((blockCount + 2) * blockSize, 0);
-	}
+		size_t total = 0;
+		while(total < end - start)
+		{
+			size_t length = 0;
+			const unsigned char *span = NextSpan(end - start - total, length);
+			if(span == NULL || length == 0) break;
+
+			memcpy((unsigned char *)buffer + total, span, length);
+			total += length;
+		}
 
-	fseek(fp, blockStart * blockSize + headerSize, SEEK_SET);
-	fread((void *)&blockBuffer[0], 1, bytes, fp);
+		return total;
+	}
 
-	// decrypt blockBuffer
-	for(int i = 0; i < blockCount; ++i)
+	// Whole blocks are decrypted straight into the caller's buffer, a window at a time; only 
+	//  a part block at either end goes through blockBuffer.
+	size_t position = start;
+	while(position < end)
 	{
-		DecryptBlock(blockBuffer, i * blockSize, blockStart + i);
+		unsigned char *dest = (unsigned char *)buffer + (position - start);
+		size_t within = position % blockSize;
+
+		if(within != 0 || end - position < blockSize)
+		{
+			if(blockBuffer.size() < blockSize) blockBuffer.resize(blockSize, 0);
+
+			size_t length = blockSize - within < end - position ? blockSize - within : end - position;
+			if(ReadDecrypt(position / blockSize, 1, &blockBuffer[0]) < within + length) break;
+
+			memcpy(dest, &blockBuffer[within], length);
+			position += length;
+			continue;
+		}
+
+		size_t blocks = (end - position) / blockSize;
+		if(blocks > pendingLimit / blockSize) blocks = pendingLimit / blockSize;
+
+		// stop short if the file is, or a chunk failed its check
+		size_t bytes = ReadDecrypt(position / blockSize, blocks, dest);
+		position += bytes;
+		if(bytes < blocks * blockSize) break;
 	}
-	
-	// copy relevant data from blockBuffer
-	memcpy(buffer, (void *)&blockBuffer[start % blockSize], end - start);
 
 	// upate file offset
-	fileOffset = end;
+	fileOffset = position;
+	lastReadEnd = position;
 
 	assert(fileOffset >= 0);
-	return end - start;
+	return position - start;
 }
 
 /*
- * Read any existing data in the target blocks from the file and decrypt
- * Write the new data into the block buffer at the appropriate spot
- * Encrypt the blocks and write them back out.
+ * Collect the new data in the write-behind buffer; consecutive writes are gathered
+ * into one extent, which gets encrypted and written out when it's big enough, or 
+ * when we seek, read, or close.  A big write goes through pendingLimit bytes at a time.
  */
 size_t CryptKeeper::Write(void *buffer, size_t count)
 {
+	OperationTimer timer(metrics, traceHook, traceContext, OP_WRITE, fileOffset, count);
+	if(!WaitKey()) return 0;
 	assert(fileOffset >= 0);
 
+	if(count == 0) return 0;
+
 	size_t start = fileOffset;
 	size_t end = start + count;
-	size_t blockStart = start / blockSize;
-	size_t blockEnd = (end + blockSize - 1) / blockSize;
-	size_t blockCount = blockEnd - blockStart;
-	size_t bytes = 0;
+	if(!ClaimKeystream(start, end)) return 0;
 
-	// resize buffer if needed; make it a bit bigger to allow partial blocks on each end
-	if(blockBuffer.size() < (blockCount + 2) * blockSize)
+	// a write that doesn't carry on from the pending data has to flush it first
+	if(!pending.empty() && start != pendingStart + pending.size() && !FlushPending()) return 0;
+
+	// start on a block boundary, with whatever was in front of us in the first block
+	if(pending.empty())
 	{
-		blockBuffer.resize((blockCount + 2) * blockSize, 0);
-	}
-	
-	// zero out buffer
-	memset(&blockBuffer[0], 0, blockBuffer.size());
-	
-	// if we're writing into existing data blocks, fill the buffer with decrypted data to overlay onto
-	if(blockStart * blockSize < fileSize)
-	{
-		// see how many bytes to read
-		size_t readEnd = (end + blockSize - 1) / blockSize;
-		
-		// read existing data into blockBuffer and decrypt
-		fseek(fp, blockStart * blockSize + headerSize, SEEK_SET);
-		bytes = fread((void *)&blockBuffer[0], 1, blockSize * blockCount, fp);
-	
-		// decrypt data read into blockBuffer (but not any pad at the end)
-		for(int i = 0; i < bytes / blockSize; ++i)
+		size_t within = start % blockSize;
+		pendingStart = start - within;
+
+		if(within != 0)
 		{
-			DecryptBlock(blockBuffer, i * blockSize, blockStart + i);
+			pending.resize(blockSize, 0);
+			Count(METRIC_RMW_BLOCKS, 1);
+
+			// the old data in front of us gets tagged along with ours, so its chunk has to 
+			//  check out first, or we'd be vouching for it
+			size_t bytes = ReadCiphertext(pendingStart / blockSize, 1, &pending[0]);
+			if(CheckCiphertext(pendingStart / blockSize, bytes, &pending[0]) < bytes)
+			{
+				pending.clear();
+				return 0;
+			}
+
+			PrepareBlock(&pending[0], pendingStart / blockSize, bytes == blockSize);
+			pending.resize(within);
 		}
 	}
-	
-	// copy new data into blockBuffer
-	memcpy((void *)&blockBuffer[start % blockSize], buffer, end - start);
-	
-	// encrypt blockBuffer here
-	for(int i = 0; i < blockCount; ++i)
-	{
-		EncryptBlock(blockBuffer, i * blockSize, blockStart + i);
-	}
-
-	// write to file
-	fseek(fp, blockStart * blockSize + headerSize, SEEK_SET);
-	fwrite((void *)&blockBuffer[0], 1, blockCount * blockSize, fp);
 
 	// update file offset
 	fileOffset += count;
 
+	// any cached chunks we overwrote are stale now
+	InvalidateChunks(start, end);
+
 	// update the file size if we wrote past the end
 	if(fileOffset > fileSize - 1) fileSize = fileOffset + 1;
 
+	// pendingLimit is whole blocks, so each flush but the last ends on a block boundary
+	unsigned char *source = (unsigned char *)buffer;
+	size_t remaining = count;
+	while(remaining > 0)
+	{
+		size_t room = pending.size() < pendingLimit ? pendingLimit - pending.size() : 0;
+		size_t length = remaining < room ? remaining : room;
+
+		pending.insert(pending.end(), source, source + length);
+		source += length;
+		remaining -= length;
+
+		if(pending.size() >= pendingLimit && !FlushPending()) return 0;
+		if(pending.empty()) pendingStart = end - remaining;
+	}
+
 	assert(fileOffset >= 0);
 
 	return count;
 }
-/* Set the file size to zero, create a random nonce. */
-void CryptKeeper::InitFileHeader()
+
+/*
+ * The pending extent already starts on a block boundary, so only a partial last block 
+ * needs the existing data read and decrypted to fill it out.  Encrypt the blocks where 
+ * they are and write them back out in one go.
+ */
+bool CryptKeeper::FlushPending()
 {
-	// set size to zero
-	fileSize = 0;
+	if(pending.empty()) return true;
 
-	// create the nonce  
-	nonce = GenerateRandom(blockSize);
+	size_t start = pendingStart;
+	size_t end = start + pending.size();
+	size_t blockStart = start / blockSize;
+	size_t blockEnd = (end + blockSize - 1) / blockSize;
+	size_t blockCount = blockEnd - blockStart;
+
+	TouchChunks(start, end);
+
+	// partial last block
+	pending.resize(blockCount * blockSize, 0);
+	if(end % blockSize != 0)
+	{
+		unsigned char block[blockSize];
+		Count(METRIC_RMW_BLOCKS, 1);
+		PrepareBlock(block, blockEnd - 1, ReadCiphertext(blockEnd - 1, 1, block) == blockSize);
+
+		size_t within = end % blockSize;
+		memcpy(&pending[(blockCount - 1) * blockSize + within], block + within, blockSize - within);
+	}
+
+	bool ok = EncryptWrite(blockStart, blockCount, pending);
+	if(!ok) writeFailed = true;
+
+	pending.clear();
+	return ok;
+}
+
+void CryptKeeper::SetCache(size_t chunkSize, size_t chunks, size_t readahead)
+{
+	assert(chunkSize % blockSize == 0);
+
+	ClearCache();
+
+	cacheChunkSize = chunkSize;
+	cacheChunks = chunks > readahead ? chunks : readahead + 1;
+	readaheadChunks = readahead;
+}
+
+CacheStats CryptKeeper::GetCacheStats()
+{
+	return cacheStats;
+}
+
+void CryptKeeper::ClearCache()
+{
+	cache.clear();
+	cacheIndex.clear();
+	lastReadEnd = 0;
+}
+
+// drop any cached chunks overlapping the byte range [start, end)
+void CryptKeeper::InvalidateChunks(size_t start, size_t end)
+{
+	if(cache.empty() || start >= end) return;
+
+	map<size_t, list<CacheChunk>::iterator>::iterator it = cacheIndex.lower_bound(start / cacheChunkSize);
+	while(it != cacheIndex.end() && it->first <= (end - 1) / cacheChunkSize)
+	{
+		cache.erase(it->second);
+		cacheIndex.erase(it++);
+	}
+}
+
+// put an empty chunk at the front of the cache, recycling the least recently used chunk's
+//  buffer if the cache is full; length is set to the amount of data the chunk should hold
+CryptKeeper::CacheChunk *CryptKeeper::AllocateChunk(size_t index)
+{
+	size_t dataLength = GetDataLength();
+	size_t start = index * cacheChunkSize;
+	if(start >= dataLength) return NULL;
+
+	if(cache.size() >= cacheChunks)
+	{
+		cacheIndex.erase(cache.back().index);
+		cache.splice(cache.begin(), cache, --cache.end());
+	}
+	else
+	{
+		cache.push_front(CacheChunk());
+	}
+
+	CacheChunk &chunk = cache.front();
+	chunk.index = index;
+	chunk.readahead = false;
+	chunk.data.resize(cacheChunkSize);
+	cacheIndex[index] = cache.begin();
+
+	chunk.length = cacheChunkSize;
+	if(start + chunk.length > dataLength) chunk.length = dataLength - start;
+
+	return &chunk;
+}
+
+// decrypt a chunk into the front of the cache
+CryptKeeper::CacheChunk *CryptKeeper::LoadChunk(size_t index)
+{
+	CacheChunk *chunk = AllocateChunk(index);
+	if(chunk == NULL) return NULL;
+
+	size_t start = index * cacheChunkSize;
+	size_t blockCount = (chunk->length + blockSize - 1) / blockSize;
+	size_t bytes = ReadDecrypt(start / blockSize, blockCount, &chunk->data[0]);
+
+	if(bytes < chunk->length) chunk->length = bytes;
+
+	return chunk;
+}
+
+CryptKeeper::CacheChunk *CryptKeeper::GetChunk(size_t index, bool sequential)
+{
+	map<size_t, list<CacheChunk>::iterator>::iterator it = cacheIndex.find(index);
+	if(it == cacheIndex.end())
+	{
+		if(sequential) ++cacheStats.sequentialMisses;
+		else ++cacheStats.randomMisses;
+		Count(METRIC_CACHE_MISSES, 1);
+
+		return LoadChunk(index);
+	}
+
+	if(sequential) ++cacheStats.sequentialHits;
+	else ++cacheStats.randomHits;
+	Count(METRIC_CACHE_HITS, 1);
+
+	CacheChunk &chunk = *it->second;
+	if(chunk.readahead)
+	{
+		++cacheStats.readaheadHits;
+		chunk.readahead = false;
+	}
+
+	// move to the front of the LRU list
+	cache.splice(cache.begin(), cache, it->second);
+
+	return &chunk;
+}
+
+// Make sure the chunks following a sequential read are already decrypted.  With io_uring
+//  the reads for all of them go out together, and each is decrypted as it arrives.
+void CryptKeeper::Readahead(size_t index)
+{
+	bool async = (aio != NULL && mapBase == NULL);
+
+	vector<CacheChunk *> batch;
+	for(size_t i = index; i < index + readaheadChunks; ++i)
+	{
+		if(cacheIndex.find(i) != cacheIndex.end()) continue;
+
+		CacheChunk *chunk = async ? AllocateChunk(i) : LoadChunk(i);
+		if(chunk == NULL) break;
+
+		chunk->readahead = true;
+		++cacheStats.readaheadChunks;
+		batch.push_back(chunk);
+	}
+
+	if(!async || batch.empty()) return;
+
+	fflush(fp);
+	int fd = fileno(fp);
+
+	size_t next = 0;
+	size_t done = 0;
+	vector<bool> finished(batch.size(), false);
+	while(done < batch.size())
+	{
+		while(next < batch.size())
+		{
+			CacheChunk *chunk = batch[next];
+			size_t blockCount = (chunk->length + blockSize - 1) / blockSize;
+			if(!aio->QueueRead(fd, &chunk->data[0], blockCount * blockSize, 
+				chunk->index * cacheChunkSize + headerSize, next)) break;
+			++next;
+		}
+
+		uint64_t tag;
+		int result;
+		if(!aio->Wait(tag, result))
+		{
+			// the chunk buffers can't be reused until the kernel is done with them
+			aio->Drain();
+			break;
+		}
+		++done;
+		finished[tag] = true;
+
+		CacheChunk *chunk = batch[tag];
+		size_t bytes = result > 0 ? result : 0;
+		bytes = CheckCiphertext(chunk->index * cacheChunkSize / blockSize, bytes, &chunk->data[0]);
+		DecryptBlocks(chunk->data, 0, bytes / blockSize, chunk->index * cacheChunkSize / blockSize);
+		if(bytes < chunk->length) chunk->length = bytes;
+	}
+
+	// don't keep chunks that failed to read, or that weren't decrypted
+	for(size_t i = 0; i < batch.size(); ++i)
+	{
+		if(finished[i] && batch[i]->length > 0) continue;
+
+		map<size_t, list<CacheChunk>::iterator>::iterator it = cacheIndex.find(batch[i]->index);
+		cache.erase(it->second);
+		cacheIndex.erase(it);
+	}
+}
+
+const unsigned char *CryptKeeper::ReadSpan(size_t count, size_t &length)
+{
+	OperationTimer timer(metrics, traceHook, traceContext, OP_READ, fileOffset, count);
+	length = 0;
+	if(!WaitKey()) return NULL;
+
+	return NextSpan(count, length);
+}
+
+// ReadSpan, without the timing, for Read to use
+const unsigned char *CryptKeeper::NextSpan(size_t count, size_t &length)
+{
+	length = 0;
+
+	FlushPending();
+
+	size_t dataLength = GetDataLength();
+	if((size_t)fileOffset >= dataLength) return NULL;
+
+	bool sequential = ((size_t)fileOffset == lastReadEnd);
+	CacheChunk *chunk = GetChunk(fileOffset / cacheChunkSize, sequential);
+	size_t within = fileOffset % cacheChunkSize;
+	if(chunk == NULL || within >= chunk->length) return NULL;
+
+	// the current chunk is at the front, so there's room behind it for the readahead
+	if(sequential && readaheadChunks > 0) Readahead(chunk->index + 1);
+
+	length = chunk->length - within;
+	if(length > count) length = count;
+
+	fileOffset += length;
+	lastReadEnd = fileOffset;
+
+	return &chunk->data[within];
+}
+
+// Map the whole file read-only; the address space is all we need, so this works for files 
+//  larger than RAM, and the kernel pages the ciphertext in as chunks are decrypted.  A file
+//  with no ciphertext after the header has nothing to map (and mmap won't take a length of
+//  0), so it's opened unmapped and reads come back empty the usual way.  Any other file that
+//  can't be mapped fails the open.
+bool CryptKeeper::OpenMapped(const char *filename)
+{
+	fp = fopen(filename, "r");
+	if(fp == NULL) return false;
+
+	if(!ReadFileHeader()) return AbandonOpen();
+	fileOffset = 0;
+	readOnly = true;
+
+	struct stat st;
+	if(fstat(fileno(fp), &st) != 0) return AbandonOpen();
+	if(st.st_size <= headerSize) return true;
+
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if(base == MAP_FAILED) return AbandonOpen();
+
+	mapBase = (unsigned char *)base;
+	mapLength = st.st_size;
+
+	return true;
+}
+
+bool CryptKeeper::EncryptChunk(vector<unsigned char> &chunk, size_t offset)
+{
+	if(!WaitKey()) return false;
+	assert(offset % blockSize == 0);
+
+	size_t length = chunk.size();
+	size_t blockCount = (length + blockSize - 1) / blockSize;
+	chunk.resize(blockCount * blockSize, 0);
+
+	EncryptBlocks(chunk, 0, blockCount, offset / blockSize);
+
+	// the padding goes out as zeros, not keystream
+	if(keystreamCipher) memset(&chunk[0] + length, 0, chunk.size() - length);
+
+	return true;
+}
+
+bool CryptKeeper::DecryptChunk(vector<unsigned char> &chunk, size_t offset)
+{
+	if(!WaitKey()) return false;
+	assert(offset % blockSize == 0);
+
+	size_t blockCount = (chunk.size() + blockSize - 1) / blockSize;
+	chunk.resize(blockCount * blockSize, 0);
+
+	DecryptBlocks(chunk, 0, blockCount, offset / blockSize);
+
+	return true;
+}
+
+size_t CryptKeeper::ReadChunk(vector<unsigned char> &chunk, size_t offset, size_t length)
+{
+	if(!WaitKey()) return 0;
+	assert(offset % blockSize == 0);
+
+	FlushPending();
+
+	size_t dataLength = GetDataLength();
+	if(offset >= dataLength) 
+	{
+		chunk.clear();
+		return 0;
+	}
+	if(offset + length > dataLength) length = dataLength - offset;
+
+	size_t blockCount = (length + blockSize - 1) / blockSize;
+	chunk.resize(blockCount * blockSize);
+
+	size_t bytes = ReadCiphertext(offset / blockSize, blockCount, &chunk[0]);
+	bytes = CheckCiphertext(offset / blockSize, bytes, &chunk[0]);
+	chunk.resize(bytes - bytes % blockSize);
+
+	// only whole blocks can be decrypted, so a short read ends at the last of them
+	return chunk.size() < length ? chunk.size() : length;
+}
+
+bool CryptKeeper::WriteChunk(vector<unsigned char> &chunk, size_t offset, size_t length)
+{
+	if(!WaitKey()) return false;
+	assert(offset % blockSize == 0);
+	assert(chunk.size() % blockSize == 0);
+	if(!ClaimKeystream(offset, offset + length)) return false;
+
+	if(!FlushPending()) return false;
+	InvalidateChunks(offset, offset + chunk.size());
+
+	TouchChunks(offset, offset + length);
+	TagCiphertext(offset / blockSize, chunk.size(), &chunk[0]);
+
+	uint64_t started = MetricsClock();
+	fseeko(fp, offset + headerSize, SEEK_SET);
+	size_t written = fwrite((void *)&chunk[0], 1, chunk.size(), fp);
+	CountIO(true, written, 1, started);
+	if(written != chunk.size()) return false;
+
+	// update the file size if we wrote past the end
+	if(offset + length >= GetDataLength()) fileSize = offset + length + 1;
+
+	return true;
+}
+
+size_t CryptKeeper::GetBlockSize()
+{
+	return blockSize;
+}
+
+size_t CryptKeeper::GetDataLength()
+{
+	return fileSize > 0 ? (size_t)(fileSize - 1) : 0;
+}
+
+bool CryptKeeper::CanOverwrite()
+{
+	return !keystreamCipher;
+}
+
+bool CryptKeeper::Flush()
+{
+	if(!WaitKey()) return false;
+	FlushPending();
+	if(fp != NULL && fflush(fp) != 0) writeFailed = true;
+
+	return !writeFailed;
+}
+
+// pread the raw ciphertext (or copy it from the mapping); returns the bytes available
+size_t CryptKeeper::PReadCiphertext(size_t blockStart, size_t blockCount, unsigned char *dest)
+{
+	if(mapBase != NULL) return ReadCiphertext(blockStart, blockCount, dest);
+
+	int fd = fileno(fp);
+	size_t position = blockStart * blockSize + headerSize;
+	size_t total = blockCount * blockSize;
+	size_t bytes = 0;
+
+	uint64_t started = MetricsClock();
+	size_t calls = 0;
+	while(bytes < total)
+	{
+		ssize_t result = pread(fd, dest + bytes, total - bytes, position + bytes);
+		++calls;
+		if(result <= 0) break;
+		bytes += result;
+	}
+
+	CountIO(false, bytes, calls, started);
+	return bytes;
+}
+
+bool CryptKeeper::PWriteCiphertext(size_t blockStart, size_t blockCount, unsigned char *source)
+{
+	int fd = fileno(fp);
+	size_t position = blockStart * blockSize + headerSize;
+	size_t total = blockCount * blockSize;
+	size_t bytes = 0;
+
+	uint64_t started = MetricsClock();
+	size_t calls = 0;
+	while(bytes < total)
+	{
+		ssize_t result = pwrite(fd, source + bytes, total - bytes, position + bytes);
+		++calls;
+		if(result <= 0) break;
+		bytes += result;
+	}
+
+	CountIO(true, bytes, calls, started);
+	return bytes == total;
+}
+
+size_t CryptKeeper::ReadAt(size_t offset, void *buffer, size_t count)
+{
+	OperationTimer timer(metrics, traceHook, traceContext, OP_READ, offset, count);
+	if(!WaitKey()) return 0;
+	size_t dataLength;
+	{
+		lock_guard<mutex> guard(metaMutex);
+		dataLength = GetDataLength();
+	}
+
+	if(offset >= dataLength) return 0;
+
+	size_t end = offset + count;
+	if(end > dataLength) end = dataLength;
+
+	size_t blockStart = offset / blockSize;
+	size_t blockEnd = (end + blockSize - 1) / blockSize;
+	size_t blockCount = blockEnd - blockStart;
+
+	// scratch space is per thread, so concurrent readers don't share a buffer
+	static thread_local vector<unsigned char> scratch;
+	if(scratch.size() < blockCount * blockSize) scratch.resize(blockCount * blockSize);
+
+	// hold the blocks only while reading them, so a writer can't leave us half a block; 
+	//  checking a chunk tag needs the whole chunk held still
+	size_t lockStart = blockStart;
+	size_t lockEnd = blockEnd;
+	ChunkBlockRange(lockStart, lockEnd);
+
+	blockLocks.Lock(lockStart, lockEnd, true);
+	size_t bytes = PReadCiphertext(blockStart, blockCount, &scratch[0]);
+	bytes = CheckCiphertext(blockStart, bytes, &scratch[0]);
+	blockLocks.Unlock(lockStart, lockEnd, true);
+
+	DecryptBlocks(scratch, 0, bytes / blockSize, blockStart);
+
+	// the file might have been shorter than the header said
+	size_t available = blockStart * blockSize + bytes - bytes % blockSize;
+	if(end > available) end = available;
+	if(offset >= end) return 0;
+
+	memcpy(buffer, &scratch[offset % blockSize], end - offset);
+
+	return end - offset;
+}
+
+size_t CryptKeeper::WriteAt(size_t offset, const void *buffer, size_t count)
+{
+	OperationTimer timer(metrics, traceHook, traceContext, OP_WRITE, offset, count);
+	if(!WaitKey()) return 0;
+	if(count == 0) return 0;
+
+	size_t end = offset + count;
+	if(!ClaimKeystream(offset, end)) return 0;
+
+	size_t blockStart = offset / blockSize;
+	size_t blockEnd = (end + blockSize - 1) / blockSize;
+	size_t blockCount = blockEnd - blockStart;
+	size_t last = (blockCount - 1) * blockSize;
+
+	static thread_local vector<unsigned char> scratch;
+	if(scratch.size() < blockCount * blockSize) scratch.resize(blockCount * blockSize);
+
+	size_t lockStart = blockStart;
+	size_t lockEnd = blockEnd;
+	ChunkBlockRange(lockStart, lockEnd);
+
+	blockLocks.Lock(lockStart, lockEnd, false);
+
+	TouchChunks(offset, end);
+
+	// partial blocks at either end need the existing data to overlay onto
+	if(offset % blockSize != 0)
+	{
+		Count(METRIC_RMW_BLOCKS, 1);
+		PrepareBlock(&scratch[0], blockStart, PReadCiphertext(blockStart, 1, &scratch[0]) == blockSize);
+	}
+	if(end % blockSize != 0 && (blockCount > 1 || offset % blockSize == 0))
+	{
+		Count(METRIC_RMW_BLOCKS, 1);
+		PrepareBlock(&scratch[last], blockEnd - 1, PReadCiphertext(blockEnd - 1, 1, &scratch[last]) == blockSize);
+	}
+
+	memcpy(&scratch[offset % blockSize], buffer, count);
+	EncryptBlocks(scratch, 0, blockCount, blockStart);
+	TagCiphertext(blockStart, blockCount * blockSize, &scratch[0]);
+
+	bool ok = PWriteCiphertext(blockStart, blockCount, &scratch[0]);
+
+	blockLocks.Unlock(lockStart, lockEnd, false);
+
+	if(!ok) return 0;
+
+	{
+		lock_guard<mutex> guard(metaMutex);
+
+		// update the file size if we wrote past the end
+		if(end >= GetDataLength()) fileSize = end + 1;
+
+		InvalidateChunks(offset, end);
+	}
+
+	return count;
+}
+
+// Turn the ranges into the block extents that cover them, merging extents that overlap or 
+//  touch, sorted by position; ranges past the end of the data (if there is one) are cut 
+//  short.  Returns the scratch space the extents need.
+size_t CryptKeeper::MergeExtents(IORange *ranges, size_t count, size_t dataLength, vector<Extent> &extents)
+{
+	extents.clear();
+
+	for(size_t i = 0; i < count; ++i)
+	{
+		ranges[i].done = 0;
+
+		size_t end = ranges[i].offset + ranges[i].length;
+		if(end > dataLength) end = dataLength;
+		if(ranges[i].offset >= end) continue;
+
+		Extent extent = { ranges[i].offset / blockSize, (end + blockSize - 1) / blockSize, 0, 0 };
+		extents.push_back(extent);
+	}
+
+	sort(extents.begin(), extents.end(), [](const Extent &a, const Extent &b) { return a.blockStart < b.blockStart; });
+
+	size_t merged = 0;
+	for(size_t i = 1; i < extents.size(); ++i)
+	{
+		if(extents[i].blockStart <= extents[merged].blockEnd)
+		{
+			if(extents[i].blockEnd > extents[merged].blockEnd) extents[merged].blockEnd = extents[i].blockEnd;
+		}
+		else
+		{
+			extents[++merged] = extents[i];
+		}
+	}
+	if(!extents.empty()) extents.resize(merged + 1);
+
+	size_t scratch = 0;
+	for(size_t i = 0; i < extents.size(); ++i)
+	{
+		extents[i].scratch = scratch;
+		scratch += (extents[i].blockEnd - extents[i].blockStart) * blockSize;
+	}
+
+	return scratch;
+}
+
+// the extent holding the block with this data offset
+size_t CryptKeeper::FindExtent(const vector<Extent> &extents, size_t offset)
+{
+	size_t block = offset / blockSize;
+	size_t low = 0;
+	size_t high = extents.size();
+
+	while(high - low > 1)
+	{
+		size_t middle = (low + high) / 2;
+		if(extents[middle].blockStart <= block) low = middle;
+		else high = middle;
+	}
+
+	return low;
+}
+
+// Lock the block spans, widened to whole chunks, in order; spans that end up sharing a 
+//  chunk are locked together so we never wait on ourselves, and taking them in order means 
+//  two calls can't each hold what the other wants.
+void CryptKeeper::LockExtents(const vector<pair<size_t, size_t> > &spans, vector<pair<size_t, size_t> > &locks, bool shared)
+{
+	locks.clear();
+
+	for(size_t i = 0; i < spans.size(); ++i)
+	{
+		size_t start = spans[i].first;
+		size_t end = spans[i].second;
+		ChunkBlockRange(start, end);
+
+		if(!locks.empty() && start <= locks.back().second)
+		{
+			if(end > locks.back().second) locks.back().second = end;
+		}
+		else
+		{
+			locks.push_back(make_pair(start, end));
+		}
+	}
+
+	for(size_t i = 0; i < locks.size(); ++i)
+		blockLocks.Lock(locks[i].first, locks[i].second, shared);
+}
+
+void CryptKeeper::UnlockExtents(const vector<pair<size_t, size_t> > &locks, bool shared)
+{
+	for(size_t i = 0; i < locks.size(); ++i)
+		blockLocks.Unlock(locks[i].first, locks[i].second, shared);
+}
+
+// preadv until everything's in or the file ends, stepping over the buffers as they fill; 
+//  returns the bytes read
+static size_t PReadFully(int fd, vector<struct iovec> &iov, off_t position)
+{
+	size_t total = 0;
+	size_t first = 0;
+
+	while(first < iov.size())
+	{
+		size_t count = iov.size() - first < IOV_MAX ? iov.size() - first : IOV_MAX;
+		ssize_t result = preadv(fd, &iov[first], count, position + total);
+		if(result < 0 && errno == EINTR) continue;
+		if(result <= 0) break;
+
+		total += result;
+		while(first < iov.size() && (size_t)result >= iov[first].iov_len)
+		{
+			result -= iov[first].iov_len;
+			++first;
+		}
+		if(first < iov.size())
+		{
+			iov[first].iov_base = (unsigned char *)iov[first].iov_base + result;
+			iov[first].iov_len -= result;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * Merge the ranges into block extents, then read extents that are close together with 
+ * one preadv, the gaps between them going to a throwaway buffer.  Each extent is checked 
+ * and decrypted once, and the ranges copied out of it.
+ */
+// traced with the offset of the first range, and the number of ranges
+size_t CryptKeeper::ReadV(IORange *ranges, size_t count)
+{
+	OperationTimer timer(metrics, traceHook, traceContext, OP_READ, count > 0 ? ranges[0].offset : 0, count);
+	if(!WaitKey()) return 0;
+	size_t dataLength;
+	{
+		lock_guard<mutex> guard(metaMutex);
+		dataLength = GetDataLength();
+	}
+
+	vector<Extent> extents;
+	size_t scratchSize = MergeExtents(ranges, count, dataLength, extents);
+	if(extents.empty()) return 0;
+
+	static thread_local vector<unsigned char> scratch;
+	static thread_local vector<unsigned char> gap;
+	if(scratch.size() < scratchSize) scratch.resize(scratchSize);
+	if(gap.size() < gatherGap + 1) gap.resize(gatherGap + 1);
+
+	// group the extents into runs that one preadv can read
+	vector<pair<size_t, size_t> > groups;
+	size_t first = 0;
+	for(size_t i = 1; i <= extents.size(); ++i)
+	{
+		if(i < extents.size() && (extents[i].blockStart - extents[i - 1].blockEnd) * blockSize <= gatherGap &&
+			2 * (i - first) < IOV_MAX)
+			continue;
+
+		groups.push_back(make_pair(first, i));
+		first = i;
+	}
+
+	vector<pair<size_t, size_t> > spans;
+	for(size_t g = 0; g < groups.size(); ++g)
+		spans.push_back(make_pair(extents[groups[g].first].blockStart, extents[groups[g].second - 1].blockEnd));
+
+	vector<pair<size_t, size_t> > locks;
+	LockExtents(spans, locks, true);
+
+	vector<struct iovec> iov;
+	for(size_t g = 0; g < groups.size(); ++g)
+	{
+		size_t groupStart = extents[groups[g].first].blockStart;
+		size_t bytes;
+
+		if(mapBase != NULL)
+		{
+			// it's all in memory already, so there are no syscalls to save
+			for(size_t i = groups[g].first; i < groups[g].second; ++i)
+			{
+				size_t blocks = extents[i].blockEnd - extents[i].blockStart;
+				extents[i].bytes = PReadCiphertext(extents[i].blockStart, blocks, &scratch[extents[i].scratch]);
+			}
+		}
+		else
+		{
+			iov.clear();
+			for(size_t i = groups[g].first; i < groups[g].second; ++i)
+			{
+				if(i > groups[g].first)
+				{
+					size_t skip = (extents[i].blockStart - extents[i - 1].blockEnd) * blockSize;
+					if(skip > 0)
+					{
+						struct iovec piece = { &gap[0], skip };
+						iov.push_back(piece);
+					}
+				}
+
+				struct iovec piece = { &scratch[extents[i].scratch], (extents[i].blockEnd - extents[i].blockStart) * blockSize };
+				iov.push_back(piece);
+			}
+
+			uint64_t started = MetricsClock();
+			bytes = PReadFully(fileno(fp), iov, groupStart * blockSize + headerSize);
+			CountIO(false, bytes, 1, started);
+
+			// the file might be shorter than the header said
+			for(size_t i = groups[g].first; i < groups[g].second; ++i)
+			{
+				size_t before = (extents[i].blockStart - groupStart) * blockSize;
+				size_t length = (extents[i].blockEnd - extents[i].blockStart) * blockSize;
+				extents[i].bytes = bytes <= before ? 0 : (bytes - before < length ? bytes - before : length);
+			}
+		}
+
+		for(size_t i = groups[g].first; i < groups[g].second; ++i)
+			extents[i].bytes = CheckCiphertext(extents[i].blockStart, extents[i].bytes, &scratch[extents[i].scratch]);
+	}
+
+	UnlockExtents(locks, true);
+
+	for(size_t i = 0; i < extents.size(); ++i)
+	{
+		extents[i].bytes -= extents[i].bytes % blockSize;
+		DecryptBlocks(scratch, extents[i].scratch, extents[i].bytes / blockSize, extents[i].blockStart);
+	}
+
+	size_t total = 0;
+	for(size_t r = 0; r < count; ++r)
+	{
+		size_t end = ranges[r].offset + ranges[r].length;
+		if(end > dataLength) end = dataLength;
+		if(ranges[r].offset >= end) continue;
+
+		Extent &extent = extents[FindExtent(extents, ranges[r].offset)];
+		size_t available = extent.blockStart * blockSize + extent.bytes;
+		if(end > available) end = available;
+		if(ranges[r].offset >= end) continue;
+
+		memcpy(ranges[r].buffer, &scratch[extent.scratch + ranges[r].offset - extent.blockStart * blockSize], 
+			end - ranges[r].offset);
+
+		ranges[r].done = end - ranges[r].offset;
+		total += ranges[r].done;
+	}
+
+	return total;
+}
+
+/*
+ * Merge the ranges into block extents.  Only blocks at the edges of what the ranges 
+ * cover need the existing data read and decrypted; then the ranges are copied in, in 
+ * order, and each extent is encrypted once and written with one pwrite.
+ */
+size_t CryptKeeper::WriteV(IORange *ranges, size_t count)
+{
+	OperationTimer timer(metrics, traceHook, traceContext, OP_WRITE, count > 0 ? ranges[0].offset : 0, count);
+	if(!WaitKey()) return 0;
+	vector<Extent> extents;
+	size_t scratchSize = MergeExtents(ranges, count, SIZE_MAX, extents);
+	if(extents.empty()) return 0;
+
+	// ranges of one call can overlap each other, since each block is only encrypted once
+	if(keystreamCipher)
+	{
+		vector<pair<size_t, size_t> > written;
+		for(size_t r = 0; r < count; ++r)
+			if(ranges[r].length > 0) written.push_back(make_pair(ranges[r].offset, ranges[r].offset + ranges[r].length));
+		sort(written.begin(), written.end());
+
+		for(size_t i = 0; i < written.size(); ++i)
+		{
+			size_t start = written[i].first;
+			size_t end = written[i].second;
+			while(i + 1 < written.size() && written[i + 1].first <= end) end = max(end, written[++i].second);
+			if(!ClaimKeystream(start, end)) return 0;
+		}
+	}
+
+	static thread_local vector<unsigned char> scratch;
+	if(scratch.size() < scratchSize) scratch.resize(scratchSize);
+
+	vector<pair<size_t, size_t> > spans;
+	for(size_t i = 0; i < extents.size(); ++i)
+		spans.push_back(make_pair(extents[i].blockStart, extents[i].blockEnd));
+
+	vector<pair<size_t, size_t> > locks;
+	LockExtents(spans, locks, false);
+
+	for(size_t r = 0; r < count; ++r)
+		TouchChunks(ranges[r].offset, ranges[r].offset + ranges[r].length);
+
+	// the blocks ranges only partly cover; a block another range fills in completely gets 
+	//  overwritten anyway, so a few are read for nothing, but never more than two per range
+	vector<size_t> partial;
+	for(size_t r = 0; r < count; ++r)
+	{
+		if(ranges[r].length == 0) continue;
+
+		size_t end = ranges[r].offset + ranges[r].length;
+		if(ranges[r].offset % blockSize != 0) partial.push_back(ranges[r].offset / blockSize);
+		if(end % blockSize != 0) partial.push_back(end / blockSize);
+	}
+	sort(partial.begin(), partial.end());
+	partial.erase(unique(partial.begin(), partial.end()), partial.end());
+
+	for(size_t i = 0; i < partial.size(); ++i)
+	{
+		Extent &extent = extents[FindExtent(extents, partial[i] * blockSize)];
+		size_t position = extent.scratch + (partial[i] - extent.blockStart) * blockSize;
+
+		Count(METRIC_RMW_BLOCKS, 1);
+		PrepareBlock(&scratch[position], partial[i], PReadCiphertext(partial[i], 1, &scratch[position]) == blockSize);
+	}
+
+	size_t end = 0;
+	for(size_t r = 0; r < count; ++r)
+	{
+		if(ranges[r].length == 0) continue;
+
+		Extent &extent = extents[FindExtent(extents, ranges[r].offset)];
+		memcpy(&scratch[extent.scratch + ranges[r].offset - extent.blockStart * blockSize], ranges[r].buffer, 
+			ranges[r].length);
+
+		if(ranges[r].offset + ranges[r].length > end) end = ranges[r].offset + ranges[r].length;
+	}
+
+	bool ok = true;
+	for(size_t i = 0; i < extents.size() && ok; ++i)
+	{
+		size_t blocks = extents[i].blockEnd - extents[i].blockStart;
+		EncryptBlocks(scratch, extents[i].scratch, blocks, extents[i].blockStart);
+		TagCiphertext(extents[i].blockStart, blocks * blockSize, &scratch[extents[i].scratch]);
+
+		ok = PWriteCiphertext(extents[i].blockStart, blocks, &scratch[extents[i].scratch]);
+	}
+
+	UnlockExtents(locks, false);
+
+	if(!ok) return 0;
+
+	size_t total = 0;
+	{
+		lock_guard<mutex> guard(metaMutex);
+
+		// update the file size if we wrote past the end
+		if(end >= GetDataLength()) fileSize = end + 1;
+
+		for(size_t r = 0; r < count; ++r)
+		{
+			InvalidateChunks(ranges[r].offset, ranges[r].offset + ranges[r].length);
+			ranges[r].done = ranges[r].length;
+			total += ranges[r].length;
+		}
+	}
+
+	return total;
+}
+
+/* Set the file size to zero, create a random nonce.  New files get a binary header. */
+void CryptKeeper::InitFileHeader()
+{
+	// set size to zero
+	fileSize = 0;
+
+	// create the nonce  
+	nonce = GenerateRandom(blockSize);
+
+	headerVersion = 2;
+	headerSize = HEADER_V2_SIZE;
+	headerWritten = false;
+	headerDataLength = 0;
+	compressed = false;
+
+	ResetChunkTags();
+	authenticated = true;
+	tagsChanged = true;
+
+	// any key will do for a new file
+	fileKCV.clear();
+	fileKeyCheck.clear();
+}
+
+static void PutLE(unsigned char *dest, uint64_t value, int bytes)
+{
+	for(int i = 0; i < bytes; ++i)
+		dest[i] = (unsigned char)(value >> (8 * i));
+}
+
+static uint64_t GetLE(const unsigned char *source, int bytes)
+{
+	uint64_t value = 0;
+	for(int i = bytes - 1; i >= 0; --i)
+		value = (value << 8) | source[i];
+	return value;
+}
+
+static const unsigned char headerMagic[8] = { 0x89, 'C', 'K', 'P', '\r', '\n', 0x1a, '\n' };
+
+// read enough for either kind of header in one go, then parse whichever it is
+bool CryptKeeper::ReadFileHeader()
+{
+	MetricsTimer timer(metrics, METRIC_HEADER_NS);
+	if(fp == NULL) return false;
+
+	int maxHeader = textHeaderSize > HEADER_V2_SIZE ? textHeaderSize : HEADER_V2_SIZE;
+	unsigned char buffer[maxHeader + 1];
+	memset(buffer, 0, maxHeader + 1);
+
+	int bytes = pread(fileno(fp), buffer, maxHeader, 0);
+
+	if(bytes >= HEADER_V2_SIZE && memcmp(buffer, headerMagic, sizeof(headerMagic)) == 0)
+		return ReadBinaryHeader(buffer);
+
+	// if there is no header, create one
+	if(bytes < textHeaderSize)
+	{
+		InitFileHeader();
+		return true;
+	}
+
+	buffer[textHeaderSize] = 0;
+	return ReadTextHeader((char *)buffer);
+}
+
+bool CryptKeeper::ReadBinaryHeader(unsigned char *buffer)
+{
+	ResetChunkTags();
+
+	headerVersion = GetLE(buffer + HEADER_VERSION, 2);
+	headerSize = GetLE(buffer + HEADER_SIZE, 2);
+	headerDataLength = GetLE(buffer + HEADER_DATA_LENGTH, 8);
+	headerWritten = true;
+
+	fileSize = headerDataLength + 1;
+
+	// PBKDF2 parameters come from the file, so they can change without breaking old files; 
+	//  nothing from a file opened before carries over
+	unsigned short cipher = GetLE(buffer + HEADER_CIPHER, 2);
+	unsigned short kdf = GetLE(buffer + HEADER_KDF, 2);
+	masterSalt.clear();
+	if(kdf == KDF_NONE)
+	{
+		kdfId = KDF_NONE;
+	}
+	else
+	{
+		kdfId = kdf;
+		kdfKeyLength = GetLE(buffer + HEADER_KDF_KEY_LENGTH, 2);
+		kdfIterations = GetLE(buffer + HEADER_KDF_ITERATIONS, 4);
+	}
+
+	if(kdf == KDF_KEYRING)
+	{
+		// the salt has its own 32 bytes; any longer would run into the key check
+		size_t saltLength = GetLE(buffer + HEADER_SALT_LENGTH, 2);
+		if(saltLength > HEADER_KEY_CHECK - HEADER_MASTER_SALT) return false;
+		masterSalt.assign(buffer + HEADER_MASTER_SALT, buffer + HEADER_MASTER_SALT + saltLength);
+	}
+
+	size_t nonceLength = GetLE(buffer + HEADER_NONCE_LENGTH, 2);
+	if(nonceLength != blockSize || nonceLength > HEADER_V2_SIZE / 4) return false;
+	nonce.assign(buffer + HEADER_NONCE, buffer + HEADER_NONCE + nonceLength);
+
+	if(headerVersion != 2) return false;
+	if(cipher != cipherId) return false;
+	if(headerSize < HEADER_V2_SIZE) return false;
+
+	// a stream has its tags inline, and isn't something Open can use
+	bool tagsLoaded = true;
+	unsigned int flags = GetLE(buffer + HEADER_FLAGS, 4);
+	compressed = (flags & FLAG_COMPRESSED) != 0;
+	if((flags & FLAG_STREAM) != 0)
+	{
+		streamFormat = true;
+		authenticated = true;
+		macChunkSize = GetLE(buffer + HEADER_CHUNK_SIZE, 4);
+	}
+	else if((flags & FLAG_CHUNK_MAC) != 0)
+	{
+		tagsLoaded = LoadChunkTags(buffer);
+	}
+	else
+	{
+		// every binary header file is written with tags; clearing the flag mustn't turn them off
+		return false;
+	}
+
+	// the password classes don't have their key yet, so CheckKey looks at these once it's made
+	char kcv[16];
+	sprintf(kcv, "%06x", (int)GetLE(buffer + HEADER_KCV, 4));
+	fileKCV = kcv;
+	fileKeyCheck.clear();
+	if((flags & FLAG_KEY_CHECK) != 0)
+		fileKeyCheck.assign(buffer + HEADER_KEY_CHECK, buffer + HEADER_KEY_CHECK + RekeyJournal::CHECK_SIZE);
+
+	return tagsLoaded;
+}
+
+// CryptKeeper 1.0 length KCVKCV noncenoncenoncen\n\0...
+bool CryptKeeper::ReadTextHeader(char *buffer)
+{
+	headerVersion = 1;
+	headerSize = textHeaderSize;
+	compressed = false;
+	ResetChunkTags();
+
+	// validate header; a file that isn't one can run out of fields
+	const char *fields[5];
+	fields[0] = strtok(buffer, " ");
+	fields[1] = strtok(NULL, " ");
+	fields[2] = strtok(NULL, " ");
+	fields[3] = strtok(NULL, " ");
+	fields[4] = strtok(NULL, "\n");
+	for(int i = 0; i < 5; ++i)
+		if(fields[i] == NULL) return false;
+
+	string name = fields[0];
+	string version = fields[1];
+	fileSize = strtoll(fields[2], NULL, 10);
+	string kcv = fields[3];
+	fileKCV = kcv;
+	fileKeyCheck.clear();
+	string hexNonce = fields[4];
+
+	int len = blockSize;
+	nonce.resize(blockSize);
+	Hex2Bin(hexNonce.c_str(), &nonce[0], len);
+
+	if(name != "CryptKeeper") return false;
+	if(version != fileVersion) return false;
+
+	return true;
+}
+
+// CryptKeeper 1.0 length KCVKCV noncenoncenoncen\n\0...
+string CryptKeeper::BuildTextHeader()
+{
+	string hexNonce;
+	Bin2Hex(&nonce[0], blockSize, hexNonce);
+
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), "CryptKeeper %s %lli %s %s\n", fileVersion.c_str(),
+		(long long)fileSize, GetKCV().c_str(), hexNonce.c_str());
+
+	return buffer;
+}
+
+void CryptKeeper::WriteTextHeader()
+{
+	MetricsTimer timer(metrics, METRIC_HEADER_NS);
+	fseeko(fp, 0, SEEK_SET);
+
+	fputs(BuildTextHeader().c_str(), fp);
+}
+
+// The first time through this writes the whole header; after that the data length is the 
+//  only field that changes, so it's a single 8 byte aligned pwrite, and nothing at all if 
+//  the length hasn't changed.
+bool CryptKeeper::WriteBinaryHeader()
+{
+	MetricsTimer timer(metrics, METRIC_HEADER_NS);
+	int64_t dataLength = GetDataLength();
+
+	// anything stdio is holding has to go out before we write around it
+	fflush(fp);
+	int fd = fileno(fp);
+
+	if(headerWritten)
+	{
+		if(rootChanged)
+		{
+			if(pwrite(fd, rootTag, sizeof(rootTag), HEADER_ROOT_TAG) != sizeof(rootTag)) return false;
+			rootChanged = false;
+		}
+
+		if(dataLength == headerDataLength) return true;
+
+		unsigned char field[8];
+		PutLE(field, dataLength, 8);
+		if(pwrite(fd, field, 8, HEADER_DATA_LENGTH) != 8) return false;
+
+		headerDataLength = dataLength;
+		return true;
+	}
+
+	unsigned char buffer[HEADER_V2_SIZE];
+	BuildBinaryHeader(buffer, dataLength);
+
+	if(pwrite(fd, buffer, HEADER_V2_SIZE, 0) != HEADER_V2_SIZE) return false;
+
+	headerWritten = true;
+	headerDataLength = dataLength;
+	rootChanged = false;
+
+	return true;
+}
+
+void CryptKeeper::BuildBinaryHeader(unsigned char *buffer, int64_t dataLength)
+{
+	memset(buffer, 0, HEADER_V2_SIZE);
+
+	memcpy(buffer + HEADER_MAGIC, headerMagic, sizeof(headerMagic));
+	PutLE(buffer + HEADER_VERSION, 2, 2);
+	PutLE(buffer + HEADER_CIPHER, cipherId, 2);
+	PutLE(buffer + HEADER_SIZE, headerSize, 2);
+	PutLE(buffer + HEADER_NONCE_LENGTH, nonce.size(), 2);
+	PutLE(buffer + HEADER_DATA_LENGTH, dataLength, 8);
+	PutLE(buffer + HEADER_KDF, kdfId, 2);
+	PutLE(buffer + HEADER_KDF_KEY_LENGTH, kdfKeyLength, 2);
+	PutLE(buffer + HEADER_KDF_ITERATIONS, kdfIterations, 4);
+	PutLE(buffer + HEADER_KCV, strtol(GetKCV().c_str(), NULL, 16), 4);
+	memcpy(buffer + HEADER_NONCE, &nonce[0], nonce.size());
+
+	if(kdfId == KDF_KEYRING && masterSalt.size() <= HEADER_KEY_CHECK - HEADER_MASTER_SALT)
+	{
+		PutLE(buffer + HEADER_SALT_LENGTH, masterSalt.size(), 2);
+		if(!masterSalt.empty()) memcpy(buffer + HEADER_MASTER_SALT, &masterSalt[0], masterSalt.size());
+	}
+
+	// the MAC key comes from the key, so this needs the key to be in
+	PrepareMAC();
+	vector<unsigned char> check;
+	KeyCheck(check);
+	memcpy(buffer + HEADER_KEY_CHECK, &check[0], check.size());
+
+	PutLE(buffer + HEADER_FLAGS, FLAG_KEY_CHECK | (authenticated ? FLAG_CHUNK_MAC : 0) | 
+		(compressed ? FLAG_COMPRESSED : 0), 4);
+
+	if(authenticated)
+	{
+		PutLE(buffer + HEADER_CHUNK_SIZE, macChunkSize, 4);
+		memcpy(buffer + HEADER_ROOT_TAG, rootTag, sizeof(rootTag));
+	}
+}
+
+// forget any chunk tags; the file is unauthenticated until a header says otherwise
+void CryptKeeper::ResetChunkTags()
+{
+	streamFormat = false;
+	authenticated = false;
+	macChunkSize = 65536;
+	macReady = false;
+	rootPending = false;
+	rootValid = true;
+	rootChanged = false;
+	tagsChanged = false;
+	integrityFailed = false;
+	memset(rootTag, 0, sizeof(rootTag));
+	chunkTags.clear();
+	chunkStates.clear();
+	taggedLength = 0;
+	touchedEnd = 0;
+}
+
+// Read the tag table from the end of the ciphertext.  The root tag can't be checked until 
+//  the key is known, which for the password classes is after the header is read, so that 
+//  waits for the first chunk check.
+bool CryptKeeper::LoadChunkTags(unsigned char *buffer)
+{
+	// the root tag is only left to check once the table is all here; without it, nothing passes
+	authenticated = true;
+	rootPending = false;
+	taggedLength = GetDataLength();
+	touchedEnd = taggedLength;
+	memcpy(rootTag, buffer + HEADER_ROOT_TAG, sizeof(rootTag));
+
+	macChunkSize = GetLE(buffer + HEADER_CHUNK_SIZE, 4);
+	if(macChunkSize == 0 || macChunkSize % blockSize != 0 || macChunkSize > 64 * 1024 * 1024)
+	{
+		macChunkSize = 65536;
+		rootValid = false;
+		integrityFailed = true;
+		return false;
+	}
+
+	size_t count = (taggedLength + macChunkSize - 1) / macChunkSize;
+	int64_t tableOffset = headerSize + (taggedLength + blockSize - 1) / blockSize * blockSize;
+
+	// a table that isn't all there fails everything, rather than allocating for a bogus length
+	struct stat st;
+	if(fstat(fileno(fp), &st) != 0 || st.st_size < tableOffset + (int64_t)(count * ChunkMAC::TAG_SIZE))
+	{
+		rootValid = false;
+		integrityFailed = true;
+		return false;
+	}
+
+	chunkTags.resize(count * ChunkMAC::TAG_SIZE);
+	chunkStates.assign(count, CHUNK_UNCHECKED);
+
+	if(count > 0 && pread(fileno(fp), &chunkTags[0], chunkTags.size(), tableOffset) != (ssize_t)chunkTags.size())
+	{
+		rootValid = false;
+		integrityFailed = true;
+		return false;
+	}
+
+	rootPending = true;
+	return true;
+}
+
+// Recompute the tags of dirty chunks, write the table after the last ciphertext block, and 
+//  update the root tag.  A file whose root tag didn't check out is left alone, so it keeps 
+//  failing rather than being signed off.
+bool CryptKeeper::WriteChunkTags()
+{
+	MetricsTimer timer(metrics, METRIC_HEADER_NS);
+	if(!authenticated || readOnly) return true;
+
+	size_t dataLength = GetDataLength();
+	if(!tagsChanged && (int64_t)dataLength == taggedLength) return true;
+
+	PrepareMAC();
+	if(!rootValid) return false;
+
+	fflush(fp);
+	int fd = fileno(fp);
+
+	size_t count = (dataLength + macChunkSize - 1) / macChunkSize;
+	chunkStates.resize(count, CHUNK_DIRTY);
+	chunkTags.resize(count * ChunkMAC::TAG_SIZE);
+
+	vector<unsigned char> buffer;
+	for(size_t i = 0; i < count; ++i)
+	{
+		if(chunkStates[i] != CHUNK_DIRTY) continue;
+
+		size_t length = ChunkExtent(i, dataLength);
+		buffer.assign(length, 0);
+		PReadCiphertext(i * macChunkSize / blockSize, length / blockSize, &buffer[0]);
+
+		mac.Tag(i, &buffer[0], length, &chunkTags[i * ChunkMAC::TAG_SIZE]);
+		chunkStates[i] = CHUNK_VERIFIED;
+	}
+
+	if(!ComputeRootTag(dataLength, rootTag)) return false;
+
+	int64_t tableOffset = headerSize + (dataLength + blockSize - 1) / blockSize * blockSize;
+	if(count > 0 && pwrite(fd, &chunkTags[0], chunkTags.size(), tableOffset) != (ssize_t)chunkTags.size())
+		return false;
+	if(ftruncate(fd, tableOffset + chunkTags.size()) != 0) return false;
+
+	taggedLength = dataLength;
+	touchedEnd = dataLength;
+	tagsChanged = false;
+	rootChanged = true;
+
+	return true;
+}
+
+// Key the MAC from the cipher key and the nonce, and check the root tag of a file we just 
+//  opened.  Called with metaMutex held, or from the single threaded calls.
+void CryptKeeper::PrepareMAC()
+{
+	if(macReady) return;
+
+	static const char label[] = "CryptKeeper chunk MAC";
+	vector<unsigned char> info(label, label + sizeof(label) - 1);
+	info.insert(info.end(), nonce.begin(), nonce.end());
+
+	unsigned char macKey[ChunkMAC::TAG_SIZE];
+	ChunkMAC derive;
+	derive.SetKey(key.empty() ? NULL : &key[0], key.size());
+	derive.Tag(0, &info[0], info.size(), macKey);
+	mac.SetKey(macKey, sizeof(macKey));
+
+	macReady = true;
+
+	if(rootPending)
+	{
+		unsigned char expected[ChunkMAC::TAG_SIZE];
+		rootValid = ComputeRootTag(taggedLength, expected) && memcmp(expected, rootTag, sizeof(expected)) == 0;
+		if(!rootValid) integrityFailed = true;
+		rootPending = false;
+	}
+}
+
+// the root tag covers the tag table, the data length, and the chunk size
+// false, with a zero tag, if there aren't tags for all of dataLength
+bool CryptKeeper::ComputeRootTag(size_t dataLength, unsigned char *tag)
+{
+	size_t count = (dataLength + macChunkSize - 1) / macChunkSize;
+	if(count * ChunkMAC::TAG_SIZE > chunkTags.size())
+	{
+		memset(tag, 0, ChunkMAC::TAG_SIZE);
+		integrityFailed = true;
+		return false;
+	}
+
+	vector<unsigned char> table(chunkTags.begin(), chunkTags.begin() + count * ChunkMAC::TAG_SIZE);
+	table.resize(table.size() + 12);
+	PutLE(&table[table.size() - 12], dataLength, 8);
+	PutLE(&table[table.size() - 4], macChunkSize, 4);
+
+	mac.Tag(UINT64_MAX, &table[0], table.size(), tag);
+	return true;
+}
+
+// the ciphertext bytes in a chunk, for a file of the given data length
+size_t CryptKeeper::ChunkExtent(size_t index, size_t dataLength)
+{
+	size_t end = (dataLength + blockSize - 1) / blockSize * blockSize;
+	size_t start = index * macChunkSize;
+	if(start >= end) return 0;
+
+	return end - start < macChunkSize ? end - start : macChunkSize;
+}
+
+// widen a block range out to whole chunks, for locking
+void CryptKeeper::ChunkBlockRange(size_t &blockStart, size_t &blockEnd)
+{
+	if(!authenticated) return;
+
+	size_t chunkBlocks = macChunkSize / blockSize;
+	blockStart = blockStart / chunkBlocks * chunkBlocks;
+	blockEnd = (blockEnd + chunkBlocks - 1) / chunkBlocks * chunkBlocks;
+}
+
+// read in the whole of a chunk's ciphertext
+bool CryptKeeper::ReadChunkTagged(size_t index, size_t length, vector<unsigned char> &buffer)
+{
+	buffer.resize(length);
+	return length > 0 && PReadCiphertext(index * macChunkSize / blockSize, length / blockSize, &buffer[0]) == length;
+}
+
+// Check the tags of the chunks under a run of ciphertext that was just read, and return 
+//  how many of its bytes can be trusted.  A chunk the run covers completely is checked from
+//  the run itself, otherwise the whole chunk is read in for it.
+size_t CryptKeeper::CheckCiphertext(size_t blockStart, size_t bytes, const unsigned char *ciphertext)
+{
+	if(!authenticated || bytes == 0) return bytes;
+
+	size_t start = blockStart * blockSize;
+	size_t end = start + bytes;
+	vector<unsigned char> buffer;
+
+	for(size_t i = start / macChunkSize; i <= (end - 1) / macChunkSize; ++i)
+	{
+		size_t chunkStart = i * macChunkSize;
+		size_t length;
+		unsigned char expected[ChunkMAC::TAG_SIZE];
+		bool ok = true;
+
+		{
+			lock_guard<mutex> guard(metaMutex);
+			PrepareMAC();
+
+			// anything past the tagged data was written since the file was opened
+			if(chunkStart >= (size_t)taggedLength) continue;
+
+			if(!rootValid || i >= chunkStates.size() || chunkStates[i] == CHUNK_BAD) 
+				ok = false;
+			else if(chunkStates[i] != CHUNK_UNCHECKED) 
+				continue;
+
+			length = ChunkExtent(i, taggedLength);
+			if(ok) memcpy(expected, &chunkTags[i * ChunkMAC::TAG_SIZE], sizeof(expected));
+		}
+
+		if(ok)
+		{
+			const unsigned char *data = ciphertext + (chunkStart - start);
+			if(chunkStart < start || chunkStart + length > end)
+			{
+				ok = ReadChunkTagged(i, length, buffer);
+				data = buffer.empty() ? NULL : &buffer[0];
+			}
+
+			unsigned char tag[ChunkMAC::TAG_SIZE];
+			if(ok) mac.Tag(i, data, length, tag);
+			ok = ok && memcmp(tag, expected, sizeof(tag)) == 0;
+
+			lock_guard<mutex> guard(metaMutex);
+			if(i < chunkStates.size() && chunkStates[i] == CHUNK_UNCHECKED) 
+				chunkStates[i] = ok ? CHUNK_VERIFIED : CHUNK_BAD;
+			if(!ok) integrityFailed = true;
+		}
+
+		if(!ok) return chunkStart > start ? chunkStart - start : 0;
+	}
+
+	return bytes;
 }
 
-// CryptKeeper 1.0 length KCVKCV noncenoncenoncen\n\0...
-bool CryptKeeper::ReadFileHeader()
+// Mark the chunks under a write of plaintext [start, end) dirty before it goes out.  A 
+//  write past everything written so far also dirties the chunks back to there, since the 
+//  old last chunk grows and any gap needs tags too.
+void CryptKeeper::TouchChunks(size_t start, size_t end)
 {
-	fseek(fp, 0, SEEK_SET);
+	if(!authenticated || start >= end) return;
 
-	char buffer[headerSize + 1];
-	memset(buffer, 0, headerSize + 1);
+	lock_guard<mutex> guard(metaMutex);
+	PrepareMAC();
 
-	int bytes = fread(buffer, 1, headerSize, fp);
+	size_t first = (start < touchedEnd ? start : touchedEnd) / macChunkSize;
+	size_t last = (end - 1) / macChunkSize;
+	if(chunkStates.size() < last + 1) chunkStates.resize(last + 1, CHUNK_DIRTY);
 
-	// if there is no header, create one
-	if(bytes != headerSize)
+	vector<unsigned char> buffer;
+	for(size_t i = first; i <= last; ++i)
 	{
-		InitFileHeader();
-		return true;
+		if(chunkStates[i] == CHUNK_DIRTY) continue;
+
+		bool covered = (i * macChunkSize >= start && (i + 1) * macChunkSize <= end);
+
+		// the rest of a partly overwritten chunk has to be good before we tag over it
+		if(!covered && chunkStates[i] == CHUNK_UNCHECKED)
+		{
+			size_t length = ChunkExtent(i, taggedLength);
+			unsigned char tag[ChunkMAC::TAG_SIZE];
+
+			bool ok = rootValid && ReadChunkTagged(i, length, buffer);
+			if(ok) mac.Tag(i, &buffer[0], length, tag);
+			ok = ok && memcmp(tag, &chunkTags[i * ChunkMAC::TAG_SIZE], sizeof(tag)) == 0;
+
+			chunkStates[i] = ok ? CHUNK_VERIFIED : CHUNK_BAD;
+			if(!ok) integrityFailed = true;
+		}
+
+		if(chunkStates[i] == CHUNK_BAD && !covered) continue;
+
+		chunkStates[i] = CHUNK_DIRTY;
 	}
 
-	// validate header
-	string name = strtok(buffer, " ");
-	string version = strtok(NULL, " ");
-	fileSize = atoi(strtok(NULL, " "));
-	string kcv;
+	if(end > touchedEnd) touchedEnd = end;
+	tagsChanged = true;
+}
+
+// tag any whole chunks in a run of freshly encrypted ciphertext, so Close doesn't have to 
+//  read them back
+void CryptKeeper::TagCiphertext(size_t blockStart, size_t bytes, const unsigned char *ciphertext)
+{
+	if(!authenticated) return;
 
-	kcv = strtok(NULL, " ");
-	string hexNonce = strtok(NULL, "\n");
+	size_t start = blockStart * blockSize;
+	size_t end = start + bytes;
 
-	int len = blockSize;
-	nonce.resize(blockSize);
-	Hex2Bin(hexNonce.c_str(), &nonce[0], len);
+	for(size_t i = (start + macChunkSize - 1) / macChunkSize; (i + 1) * macChunkSize <= end; ++i)
+	{
+		unsigned char tag[ChunkMAC::TAG_SIZE];
+		{
+			lock_guard<mutex> guard(metaMutex);
+			PrepareMAC();
+			if(i >= chunkStates.size() || chunkStates[i] != CHUNK_DIRTY) continue;
+		}
 
-	if(name != "CryptKeeper") return false;
-	if(version != fileVersion) return false;
-	if(kcv != GetKCV()) return false;
+		mac.Tag(i, ciphertext + (i * macChunkSize - start), macChunkSize, tag);
 
-	return false;
+		lock_guard<mutex> guard(metaMutex);
+		if(chunkTags.size() < (i + 1) * ChunkMAC::TAG_SIZE) chunkTags.resize((i + 1) * ChunkMAC::TAG_SIZE);
+		memcpy(&chunkTags[i * ChunkMAC::TAG_SIZE], tag, sizeof(tag));
+		chunkStates[i] = CHUNK_VERIFIED;
+	}
 }
 
 /* Open the file, using a subset of fopen modes.  We'll really open the file in
@@ -213,20 +2218,30 @@ bool CryptKeeper::ReadFileHeader()
  */
 bool CryptKeeper::Open(const char *filename, const char *mode)
 {
+	OperationTimer timer(metrics, traceHook, traceContext, OP_OPEN, 0, 0);
+	WaitKey();
 	fp = NULL;
+	writeFailed = false;
 
 	readOnly = false;
 
 	// any write or append opens need to be able to seek to the beginning and
 	// update the file header, so open in "w+" or "r+" mode
 	// read-only "r" open will open the file in "r" mode
+	bool headerRead = true;
 	if(strcmp(mode, "r") == 0)
 	{
 		fp = fopen(filename, "r");
-		ReadFileHeader();
+		headerRead = ReadFileHeader();
 		fileOffset = 0;
 		readOnly = true;
 	}
+	else if(strcmp(mode, "rm") == 0)
+	{
+		if(!OpenMapped(filename)) return false;
+
+		return StartKey();
+	}
 	else if(strcmp(mode, "w") == 0)
 	{
 		fp = fopen(filename, "w+");
@@ -247,14 +2262,14 @@ bool CryptKeeper::Open(const char *filename, const char *mode)
 		}
 		else
 		{
-			ReadFileHeader();
-			fileOffset = fileSize - 1;
+			headerRead = ReadFileHeader();
+			fileOffset = GetDataLength();
 		}
 	}
 	else if(strcmp(mode, "r+") == 0)
 	{
 		fp = fopen(filename, "r+");
-		ReadFileHeader();
+		headerRead = ReadFileHeader();
 		fileOffset = 0;
 	}
 	else if(strcmp(mode, "w+") == 0)
@@ -266,38 +2281,81 @@ bool CryptKeeper::Open(const char *filename, const char *mode)
 	else if(strcmp(mode, "a+") == 0)
 	{
 		fp = fopen(filename, "r+");
-		ReadFileHeader();
-		fileOffset = fileSize;
+		headerRead = ReadFileHeader();
+		fileOffset = GetDataLength();
+	}
+
+	// a header that doesn't parse, or whose tag table isn't all there, has nothing to check 
+	//  the key against, and nothing worth reading
+	if(fp != NULL && !headerRead) return AbandonOpen();
+
+	// streams can only be read back with DecryptStream
+	if(fp != NULL && streamFormat)
+	{
+		fclose(fp);
+		fp = NULL;
 	}
 
-	return (fp != NULL);
+	if(fp == NULL) return false;
+
+	// everything up to the data length has been written under this nonce already
+	keystreamUsed.clear();
+	if(GetDataLength() > 0) keystreamUsed[0] = GetDataLength();
+
+	// the header is read or created, so the nonce is there for a password based key
+	return StartKey();
 }
 
-// CryptKeeper 1.0 length KCVKCV noncenoncenoncen\n\0...
-void CryptKeeper::Close()
+bool CryptKeeper::Close()
 {
-	if(!readOnly)
-	{
-		// update header
-		string hexNonce;
-		Bin2Hex(&nonce[0], blockSize, hexNonce);
+	// nothing to do if the open failed
+	if(fp == NULL) return true;
+	OperationTimer timer(metrics, traceHook, traceContext, OP_CLOSE, 0, 0);
 
-		fseek(fp, 0, SEEK_SET);
+	// the header needs the key check value; with the wrong key nothing was written, and the 
+	//  header stays as it was
+	bool keyGood = WaitKey();
 
-		fprintf(fp, "CryptKeeper %s %i %s %s\n", fileVersion.c_str(),
-			fileSize, GetKCV().c_str(), hexNonce.c_str());
+	if(keyGood) FlushPending();
+
+	// update header; old text header files keep the format they were opened with
+	if(!readOnly && keyGood)
+	{
+		if(headerVersion == 1)
+		{
+			WriteTextHeader();
+		}
+		else
+		{
+			if(!WriteChunkTags()) writeFailed = true;
+			if(!WriteBinaryHeader()) writeFailed = true;
+		}
 	}
 	
-	fclose(fp);
+	if(mapBase != NULL)
+	{
+		munmap(mapBase, mapLength);
+		mapBase = NULL;
+		mapLength = 0;
+	}
+
+	ClearCache();
+
+	if(fclose(fp) != 0 && !readOnly) writeFailed = true;
+	fp = NULL;
+
+	return !writeFailed;
 }
 
 // set file offset to appropriate spot
-void CryptKeeper::Seek(size_t offset, int origin)
+void CryptKeeper::Seek(int64_t offset, int origin)
 {
+	FlushPending();
+
 	if(origin == SEEK_SET)
 		fileOffset = offset;
 	else if(origin == SEEK_END)
-		fileOffset = fileSize + offset;
+		fileOffset = GetDataLength() + offset;
 	else if(origin == SEEK_CUR)
 		fileOffset += offset;
 	else
@@ -306,15 +2364,602 @@ void CryptKeeper::Seek(size_t offset, int origin)
 	// offset should not go negative
 	assert(fileOffset >= 0);
 	// read-only should not seek past end of file
-	assert(!readOnly || fileOffset <= fileSize);
+	assert(!readOnly || fileOffset <= (int64_t)GetDataLength());
 
 	if(fileOffset < 0) fileOffset = 0;
-	if(readOnly && fileOffset > fileSize) fileOffset = fileSize;
+	if(readOnly && fileOffset > (int64_t)GetDataLength()) fileOffset = GetDataLength();
 }
 
 // return current spot in file
-size_t CryptKeeper::Tell()
+int64_t CryptKeeper::Tell()
 {
 	return fileOffset;
 }
 
+
+// Preallocate disk space for the data without changing the file's apparent size, so reads 
+//  past the end of the data still come back short.
+bool CryptKeeper::Reserve(int64_t bytes)
+{
+	if(fp == NULL || readOnly) return false;
+
+	int64_t blocks = (bytes + blockSize - 1) / blockSize;
+	return fallocate(fileno(fp), FALLOC_FL_KEEP_SIZE, 0, headerSize + blocks * blockSize) == 0;
+}
+
+bool CryptKeeper::IsAuthenticated()
+{
+	return authenticated;
+}
+
+bool CryptKeeper::IsCompressed()
+{
+	return compressed;
+}
+
+// the flag goes in the first full header write, so it has to be set before that happens
+bool CryptKeeper::SetCompressed()
+{
+	if(fp == NULL || readOnly || headerVersion != 2 || streamFormat || GetDataLength() != 0) return false;
+
+	FlushPending();
+	compressed = true;
+	headerWritten = false;
+
+	return true;
+}
+
+// Chunks are independent, so the threads just take the next unchecked chunk until they run 
+//  out.  Chunks written since the file was opened have nothing on disk to check yet.
+bool CryptKeeper::Verify(unsigned threads)
+{
+	if(!WaitKey() || !authenticated || fp == NULL) return false;
+
+	size_t count;
+	{
+		lock_guard<mutex> guard(metaMutex);
+		PrepareMAC();
+		if(!rootValid) return false;
+
+		count = (taggedLength + macChunkSize - 1) / macChunkSize;
+	}
+
+	if(threads == 0) threads = thread::hardware_concurrency();
+	if(threads == 0) threads = 1;
+	if(threads > count) threads = count > 0 ? count : 1;
+
+	atomic<size_t> next(0);
+	vector<thread> workers;
+
+	for(unsigned t = 0; t < threads; ++t)
+	{
+		workers.push_back(thread([this, &next, count]()
+		{
+			vector<unsigned char> buffer;
+			for(size_t i = next++; i < count; i = next++)
+			{
+				size_t length;
+				unsigned char expected[ChunkMAC::TAG_SIZE];
+				{
+					lock_guard<mutex> guard(metaMutex);
+					if(chunkStates[i] != CHUNK_UNCHECKED) continue;
+
+					length = ChunkExtent(i, taggedLength);
+					memcpy(expected, &chunkTags[i * ChunkMAC::TAG_SIZE], sizeof(expected));
+				}
+
+				unsigned char tag[ChunkMAC::TAG_SIZE];
+				bool ok = ReadChunkTagged(i, length, buffer);
+				if(ok) mac.Tag(i, &buffer[0], length, tag);
+				ok = ok && memcmp(tag, expected, sizeof(tag)) == 0;
+
+				lock_guard<mutex> guard(metaMutex);
+				if(chunkStates[i] == CHUNK_UNCHECKED) chunkStates[i] = ok ? CHUNK_VERIFIED : CHUNK_BAD;
+				if(!ok) integrityFailed = true;
+			}
+		}));
+	}
+
+	for(size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+
+	return !integrityFailed;
+}
+
+bool CryptKeeper::IntegrityFailed()
+{
+	return integrityFailed;
+}
+
+// pipes default to 64K, which means a context switch per chunk; ask for more, but it's fine 
+//  if we can't have it
+static void GrowPipe(int fd)
+{
+	struct stat st;
+	if(fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+		fcntl(fd, F_SETPIPE_SZ, 1024 * 1024);
+}
+
+// read until count bytes or end of file; false on an error
+static bool ReadFully(int fd, unsigned char *buffer, size_t count, size_t &bytes)
+{
+	bytes = 0;
+	while(bytes < count)
+	{
+		ssize_t result = read(fd, buffer + bytes, count - bytes);
+		if(result == 0) break;
+		if(result < 0)
+		{
+			if(errno == EINTR) continue;
+			return false;
+		}
+		bytes += result;
+	}
+
+	return true;
+}
+
+static bool WriteFully(int fd, const unsigned char *buffer, size_t count)
+{
+	size_t bytes = 0;
+	while(bytes < count)
+	{
+		ssize_t result = write(fd, buffer + bytes, count - bytes);
+		if(result < 0 && errno == EINTR) continue;
+		if(result <= 0) return false;
+		bytes += result;
+	}
+
+	return true;
+}
+
+static const unsigned char streamEndMagic[8] = { 0x89, 'C', 'K', 'P', 'E', 'N', 'D', '\n' };
+
+// the footer tag covers the data length and chunk size, so a stream cut off at a chunk 
+//  boundary doesn't pass
+void CryptKeeper::ComputeStreamTag(uint64_t dataLength, unsigned char *tag)
+{
+	unsigned char trailer[12];
+	PutLE(trailer, dataLength, 8);
+	PutLE(trailer + 8, macChunkSize, 4);
+
+	mac.Tag(UINT64_MAX, trailer, sizeof(trailer), tag);
+}
+
+// Read chunks straight into their place in the output buffer, encrypt them there, and put 
+//  each tag after its chunk; the whole batch then goes out in one write.
+bool CryptKeeper::EncryptStream(int in, int out)
+{
+	InitFileHeader();
+	DeriveKey();
+	if(!WaitKey()) return false;
+	PrepareMAC();
+
+	GrowPipe(in);
+	GrowPipe(out);
+
+	unsigned char header[HEADER_V2_SIZE];
+	BuildBinaryHeader(header, 0);
+	PutLE(header + HEADER_FLAGS, FLAG_CHUNK_MAC | FLAG_STREAM | FLAG_KEY_CHECK, 4);
+	if(!WriteFully(out, header, sizeof(header))) return false;
+
+	size_t record = macChunkSize + ChunkMAC::TAG_SIZE;
+	vector<unsigned char> buffer(streamChunks * record);
+	uint64_t total = 0;
+	size_t index = 0;
+	bool done = false;
+
+	while(!done)
+	{
+		size_t used = 0;
+		for(size_t i = 0; i < streamChunks && !done; ++i)
+		{
+			size_t bytes;
+			if(!ReadFully(in, &buffer[used], macChunkSize, bytes)) return false;
+			if(bytes < macChunkSize) done = true;
+			if(bytes == 0) break;
+
+			size_t padded = (bytes + blockSize - 1) / blockSize * blockSize;
+			memset(&buffer[used + bytes], 0, padded - bytes);
+
+			EncryptBlocks(buffer, used, padded / blockSize, total / blockSize);
+			if(keystreamCipher) memset(&buffer[used + bytes], 0, padded - bytes);
+			mac.Tag(index++, &buffer[used], padded, &buffer[used + padded]);
+
+			used += padded + ChunkMAC::TAG_SIZE;
+			total += bytes;
+		}
+
+		if(!WriteFully(out, &buffer[0], used)) return false;
+	}
+
+	unsigned char footer[STREAM_FOOTER_SIZE];
+	PutLE(footer, total, 8);
+	ComputeStreamTag(total, footer + 8);
+	memcpy(footer + 8 + ChunkMAC::TAG_SIZE, streamEndMagic, sizeof(streamEndMagic));
+
+	return WriteFully(out, footer, sizeof(footer));
+}
+
+// Only the footer says where the chunks end, so a footer's worth of input is always held 
+//  back; any record with more than that after it is a whole chunk.  Each chunk is checked 
+//  before its plaintext goes out, and the plaintext is packed down to the front of the 
+//  buffer so a batch is still one write.  Returns false for a wrong key or any damage.
+bool CryptKeeper::DecryptStream(int in, int out)
+{
+	GrowPipe(in);
+	GrowPipe(out);
+
+	unsigned char header[HEADER_V2_SIZE];
+	size_t bytes;
+	if(!ReadFully(in, header, sizeof(header), bytes) || bytes < sizeof(header)) return false;
+	if(memcmp(header, headerMagic, sizeof(headerMagic)) != 0) return false;
+
+	if(!ReadBinaryHeader(header) || !streamFormat) return false;
+	if(macChunkSize == 0 || macChunkSize % blockSize != 0 || macChunkSize > 64 * 1024 * 1024) return false;
+
+	// skip anything a later version added to the header
+	for(size_t skip = headerSize - HEADER_V2_SIZE; skip > 0; skip -= bytes)
+	{
+		unsigned char scratch[HEADER_V2_SIZE];
+		if(!ReadFully(in, scratch, skip < sizeof(scratch) ? skip : sizeof(scratch), bytes) || bytes == 0) 
+			return false;
+	}
+
+	// with the key in hand, the key check tells us about a wrong password up front
+	DeriveKey();
+	WaitKey();
+	if(!CheckKey()) return false;
+
+	PrepareMAC();
+
+	size_t record = macChunkSize + ChunkMAC::TAG_SIZE;
+	vector<unsigned char> buffer(streamChunks * record + STREAM_FOOTER_SIZE);
+	size_t have = 0;
+	uint64_t total = 0;
+	size_t index = 0;
+	bool eof = false;
+
+	for(;;)
+	{
+		if(!ReadFully(in, &buffer[have], buffer.size() - have, bytes)) return false;
+		have += bytes;
+		eof = (have < buffer.size());
+
+		size_t position = 0;
+		size_t used = 0;
+
+		while(have - position >= record + STREAM_FOOTER_SIZE || (eof && have - position > STREAM_FOOTER_SIZE))
+		{
+			size_t length = have - position - STREAM_FOOTER_SIZE;
+			if(length > record) length = record;
+
+			// a short record is the last one, and has to be whole blocks
+			if(length <= ChunkMAC::TAG_SIZE) return false;
+			length -= ChunkMAC::TAG_SIZE;
+			if(length % blockSize != 0) return false;
+
+			unsigned char tag[ChunkMAC::TAG_SIZE];
+			mac.Tag(index++, &buffer[position], length, tag);
+			if(memcmp(tag, &buffer[position + length], sizeof(tag)) != 0)
+			{
+				integrityFailed = true;
+				return false;
+			}
+
+			DecryptBlocks(buffer, position, length / blockSize, total / blockSize);
+			memmove(&buffer[used], &buffer[position], length);
+
+			used += length;
+			total += length;
+			position += length + ChunkMAC::TAG_SIZE;
+
+			if(length < macChunkSize) break;
+		}
+
+		if(!eof)
+		{
+			if(!WriteFully(out, &buffer[0], used)) return false;
+			memmove(&buffer[0], &buffer[position], have - position);
+			have -= position;
+			continue;
+		}
+
+		// what's left has to be exactly the footer
+		if(have - position != STREAM_FOOTER_SIZE) return false;
+
+		const unsigned char *footer = &buffer[position];
+		uint64_t dataLength = GetLE(footer, 8);
+		unsigned char tag[ChunkMAC::TAG_SIZE];
+		ComputeStreamTag(dataLength, tag);
+
+		bool ok = memcmp(footer + 8 + ChunkMAC::TAG_SIZE, streamEndMagic, sizeof(streamEndMagic)) == 0 &&
+			memcmp(footer + 8, tag, sizeof(tag)) == 0 &&
+			dataLength <= total && total - dataLength < blockSize;
+		if(!ok)
+		{
+			integrityFailed = true;
+			return false;
+		}
+
+		// the last chunk was padded out to a whole block
+		used -= total - dataLength;
+
+		return WriteFully(out, &buffer[0], used);
+	}
+}
+
+// run work over chunks [first, last) on a few threads, each with its own buffer; false if 
+//  any of them failed
+bool CryptKeeper::RekeyChunks(size_t first, size_t last, unsigned threads, 
+	function<bool(size_t, vector<unsigned char> &)> work)
+{
+	if(first >= last) return true;
+
+	if(threads == 0) threads = thread::hardware_concurrency();
+	if(threads == 0) threads = 1;
+	if(threads > last - first) threads = last - first;
+
+	atomic<size_t> next(first);
+	atomic<bool> ok(true);
+	vector<thread> workers;
+
+	for(unsigned t = 0; t < threads; ++t)
+	{
+		workers.push_back(thread([&next, &ok, &work, last]()
+		{
+			vector<unsigned char> buffer;
+			for(size_t i = next++; i < last && ok.load(); i = next++)
+			{
+				if(!work(i, buffer)) ok.store(false);
+			}
+		}));
+	}
+
+	for(size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+
+	return ok.load();
+}
+
+// a MAC under the key, for the header's key check, and so a resumed rekey can tell it's been 
+//  given the same password
+void CryptKeeper::KeyCheck(vector<unsigned char> &check)
+{
+	unsigned char tag[ChunkMAC::TAG_SIZE];
+	mac.Tag(UINT64_MAX - 1, &nonce[0], nonce.size(), tag);
+
+	check.assign(tag, tag + RekeyJournal::CHECK_SIZE);
+}
+
+/* Re-encrypt a file in place under the key of fresh, a keeper of the same class that isn't
+ * open, with a new nonce.  Each window of ciphertext is read, checked against its tags, 
+ * decrypted with our key and encrypted with the new one in the same buffer, on several
+ * threads a chunk each, and written back where it came from; the plaintext is never on 
+ * disk.  The tags and header go last, so until then the file still opens with the old 
+ * key as far as the header is concerned.
+ *
+ * filename.rekey is the journal (see RekeyJournal.h).  If the rekey is interrupted, 
+ * calling it again with the same two keys picks up where it stopped.
+ */
+bool CryptKeeper::Rekey(const char *filename, CryptKeeper &fresh, unsigned threads)
+{
+	if(fp != NULL || fresh.fp != NULL || fresh.cipherId != cipherId) return false;
+
+	fp = fopen(filename, "r+");
+	if(fp == NULL) return false;
+	readOnly = false;
+
+	bool ok = RekeyFile(filename, fresh, threads);
+
+	ClearCache();
+	fclose(fp);
+	fp = NULL;
+
+	return ok;
+}
+
+bool CryptKeeper::RekeyFile(const char *filename, CryptKeeper &fresh, unsigned threads)
+{
+	// whether the old key is right is checked below, once the key is made
+	if(!ReadFileHeader()) return false;
+	if((headerVersion == 2 && !headerWritten) || streamFormat) return false;
+
+	string journalName = string(filename) + ".rekey";
+	RekeyJournal journal;
+	bool resuming = journal.Load(journalName.c_str());
+
+	if(resuming)
+	{
+		// the header goes out last, so if it's there, all that was left was the journal
+		if(nonce == journal.GetKeys().newNonce) return journal.Remove();
+
+		// a journal left by something else
+		if(nonce != journal.GetKeys().oldNonce) return false;
+	}
+
+	fresh.ResetChunkTags();
+	fresh.headerVersion = headerVersion;
+	fresh.headerSize = headerSize;
+	fresh.fileSize = fileSize;
+	fresh.authenticated = authenticated;
+	fresh.macChunkSize = macChunkSize;
+	fresh.compressed = compressed;
+
+	if(resuming)
+	{
+		const RekeyJournal::Keys &keys = journal.GetKeys();
+		fresh.nonce = keys.newNonce;
+		fresh.kdfId = keys.kdfId;
+		fresh.kdfKeyLength = keys.kdfKeyLength;
+		fresh.kdfIterations = keys.kdfIterations;
+		fresh.masterSalt = keys.masterSalt;
+		fresh.headerWritten = true;
+	}
+	else
+	{
+		fresh.nonce = GenerateRandom(blockSize);
+		fresh.headerWritten = false;
+	}
+
+	fresh.DeriveKey();
+	if(!fresh.WaitKey()) return false;
+	fresh.PrepareMAC();
+
+	vector<unsigned char> check;
+	fresh.KeyCheck(check);
+	if(resuming && check != journal.GetKeys().keyCheck) return false;
+
+	size_t dataLength = GetDataLength();
+	size_t end = (dataLength + blockSize - 1) / blockSize * blockSize;
+	size_t chunkBlocks = macChunkSize / blockSize;
+	size_t count = (dataLength + macChunkSize - 1) / macChunkSize;
+
+	size_t window = resuming ? journal.GetWindow() : RekeyJournal::WINDOW_SIZE / macChunkSize * macChunkSize;
+	if(window == 0) window = macChunkSize;
+	if(window % macChunkSize != 0) return false;
+
+	size_t start = (resuming && journal.GetStart() >= 0) ? journal.GetStart() : 0;
+	if(start % window != 0 && start < end) return false;
+
+	// nothing more to read once the data's done, so the old key isn't needed; otherwise it
+	//  has to be right, or we'd be turning the file into noise
+	if(start < end)
+	{
+		DeriveKey();
+		WaitKey();
+		if(!CheckKey()) return false;
+
+		PrepareMAC();
+		if(!rootValid) return false;
+	}
+
+	if(!resuming)
+	{
+		RekeyJournal::Keys keys;
+		keys.oldNonce = nonce;
+		keys.newNonce = fresh.nonce;
+		keys.masterSalt = fresh.masterSalt;
+		keys.keyCheck = check;
+		keys.kdfId = fresh.kdfId;
+		keys.kdfKeyLength = fresh.kdfKeyLength;
+		keys.kdfIterations = fresh.kdfIterations;
+
+		if(!journal.Create(journalName.c_str(), keys, window)) return false;
+	}
+
+	int fd = fileno(fp);
+	fresh.chunkTags.assign(count * ChunkMAC::TAG_SIZE, 0);
+
+	// chunks before the window we stopped in are done, but their new tags weren't kept
+	if(authenticated && !RekeyChunks(0, start < end ? start / macChunkSize : count, threads, 
+		[this, &fresh, dataLength](size_t i, vector<unsigned char> &buffer)
+		{
+			size_t length = ChunkExtent(i, dataLength);
+			if(!ReadChunkTagged(i, length, buffer)) return false;
+
+			fresh.mac.Tag(i, &buffer[0], length, &fresh.chunkTags[i * ChunkMAC::TAG_SIZE]);
+			return true;
+		}))
+	{
+		return false;
+	}
+
+	vector<unsigned char> buffer(window < end ? window : end);
+	vector<unsigned char> hashes;
+	bool ok = true;
+	// until something has been written over, a failure can just drop the journal
+	bool started = resuming;
+
+	for(size_t position = start; ok && position < end; position += window)
+	{
+		size_t length = end - position < window ? end - position : window;
+		int64_t filePosition = headerSize + position;
+
+		ok = PReadCiphertext(position / blockSize, length / blockSize, &buffer[0]) == length;
+		if(!ok) break;
+
+		// sectors of the window we stopped in that already went out with the new key are put 
+		//  back to the old ciphertext, so the whole window checks against the old tags
+		if(resuming && (int64_t)position == journal.GetStart())
+		{
+			if(journal.GetLength() != length) return false;
+
+			for(size_t u = 0; u < RekeyJournal::UnitCount(filePosition, length); ++u)
+			{
+				if(!RekeyJournal::UnitMatches(filePosition, &buffer[0], length, u, journal.GetHashes())) continue;
+
+				size_t unitStart, unitEnd;
+				RekeyJournal::UnitRange(filePosition, length, u, unitStart, unitEnd);
+
+				size_t blocks = (unitEnd - unitStart) / blockSize;
+				size_t counter = (position + unitStart) / blockSize;
+				fresh.DecryptBlocks(buffer, unitStart, blocks, counter);
+				EncryptBlocks(buffer, unitStart, blocks, counter);
+			}
+		}
+
+		ok = RekeyChunks(position / macChunkSize, (position + length + macChunkSize - 1) / macChunkSize, threads,
+			[this, &fresh, &buffer, position, dataLength, chunkBlocks](size_t i, vector<unsigned char> &)
+			{
+				size_t offset = i * macChunkSize - position;
+				size_t length = ChunkExtent(i, dataLength);
+				size_t blockStart = i * chunkBlocks;
+
+				if(CheckCiphertext(blockStart, length, &buffer[offset]) != length) return false;
+
+				DecryptBlocks(buffer, offset, length / blockSize, blockStart);
+				fresh.EncryptBlocks(buffer, offset, length / blockSize, blockStart);
+
+				if(authenticated) fresh.mac.Tag(i, &buffer[offset], length, &fresh.chunkTags[i * ChunkMAC::TAG_SIZE]);
+				return true;
+			});
+		if(!ok) break;
+
+		RekeyJournal::HashUnits(filePosition, &buffer[0], length, hashes);
+		ok = journal.Begin(position, length, hashes);
+		if(!ok) break;
+
+		started = true;
+		ok = PWriteCiphertext(position / blockSize, length / blockSize, &buffer[0]) && fdatasync(fd) == 0;
+	}
+
+	if(!ok)
+	{
+		if(!started) journal.Remove();
+		return false;
+	}
+
+	// the data is all done, so a crash from here on doesn't need the old key
+	if(start < end || end == 0)
+	{
+		hashes.clear();
+		if(!journal.Begin(end, 0, hashes)) return false;
+	}
+
+	if(authenticated)
+	{
+		if(!fresh.ComputeRootTag(dataLength, fresh.rootTag)) return false;
+
+		int64_t tableOffset = headerSize + end;
+		if(count > 0 && pwrite(fd, &fresh.chunkTags[0], fresh.chunkTags.size(), tableOffset) != 
+			(ssize_t)fresh.chunkTags.size())
+			return false;
+		if(fdatasync(fd) != 0) return false;
+	}
+
+	if(headerVersion == 1)
+	{
+		string header = fresh.BuildTextHeader();
+		if(pwrite(fd, header.c_str(), header.length(), 0) != (ssize_t)header.length()) return false;
+	}
+	else
+	{
+		unsigned char header[HEADER_V2_SIZE];
+		fresh.BuildBinaryHeader(header, dataLength);
+		if(pwrite(fd, header, HEADER_V2_SIZE, 0) != HEADER_V2_SIZE) return false;
+	}
+	if(fdatasync(fd) != 0) return false;
+
+	return journal.Remove();
+}
@@ -6,10 +6,21 @@
 #include <string.h>
 #include <memory.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <vector>
 #include <string>
+#include <list>
+#include <map>
+#include <functional>
+#include <future>
+#include <atomic>
 using namespace std;
 
+#include "AsyncIO.h"
+#include "RangeLock.h"
+#include "ChunkMAC.h"
+#include "IOMetrics.h"
+
 /* Example of a file header:
 
 0000000: 4372 7970 744b 6565 7065 7220 312e 3020  CryptKeeper 1.0 
@@ -19,45 +30,446 @@ using namespace std;
 
 */
 
+/* Version 2 files have a fixed width binary header instead, little endian, with
+ * each field at a fixed offset so it can be read in one go and updated in place:
+
+   0  magic "\x89CKP\r\n\x1a\n"      32  key check value (3 bytes used)
+   8  version (2)                      36  flags
+  10  cipher id                        40  MAC chunk size
+  12  header size                      44  master salt length
+  14  nonce length                     46  reserved for extensions
+  16  data length (64 bit)             64  nonce, up to 64 bytes
+  24  KDF id                          128  root tag (HMAC-SHA256)
+  26  KDF key length                  160  master salt, up to 32 bytes
+  28  KDF iterations                  192  key check MAC (16 bytes)
+                                      208  reserved for extensions
+
+ * With FLAG_CHUNK_MAC set, the ciphertext is authenticated in chunks.  Each chunk has an 
+ * HMAC-SHA256 tag over its chunk number and ciphertext, and the table of tags follows the 
+ * last ciphertext block.  The root tag covers the tag table, the data length, and the chunk 
+ * size, so chunks can't be dropped, reordered, or truncated without it showing.  Reads only
+ * need the tags of the chunks they touch, so random access stays cheap.  Every file with a
+ * binary header is written with it, and one without it is refused.
+
+ * With FLAG_KEY_CHECK set, the key check MAC is a tag under the MAC key over the nonce, so
+ * Open can tell a wrong key as soon as it's made, without reading any data.  Files without
+ * it fall back on the 3 byte key check value, which lets one wrong key in 16 million by.
+
+*/
+
+enum HeaderField
+{
+	HEADER_MAGIC = 0,
+	HEADER_VERSION = 8,
+	HEADER_CIPHER = 10,
+	HEADER_SIZE = 12,
+	HEADER_NONCE_LENGTH = 14,
+	HEADER_DATA_LENGTH = 16,
+	HEADER_KDF = 24,
+	HEADER_KDF_KEY_LENGTH = 26,
+	HEADER_KDF_ITERATIONS = 28,
+	HEADER_KCV = 32,
+	HEADER_FLAGS = 36,
+	HEADER_CHUNK_SIZE = 40,
+	HEADER_SALT_LENGTH = 44,
+	HEADER_NONCE = 64,
+	HEADER_ROOT_TAG = 128,
+	HEADER_MASTER_SALT = 160,
+	HEADER_KEY_CHECK = 192,
+	HEADER_V2_SIZE = 256
+};
+
+enum HeaderFlags
+{
+	FLAG_CHUNK_MAC = 1,
+	FLAG_STREAM = 2,
+	// the data is a compressed container (see CryptKeeperZlib.h), not the file's plaintext
+	FLAG_COMPRESSED = 4,
+	FLAG_KEY_CHECK = 8
+};
+
+/* A stream (FLAG_STREAM) is written front to back with nothing to come back and fill in, 
+ * so it can go down a pipe.  The header's data length is zero and there's no root tag; 
+ * instead each chunk of ciphertext is followed by its tag, and the stream ends with a 
+ * footer of the data length, a tag over it, and the end magic "\x89CKPEND\n".
+
+   header | chunk 0 | tag 0 | chunk 1 | tag 1 | ... | last chunk | tag | footer
+
+*/
+
+enum { STREAM_FOOTER_SIZE = 8 + ChunkMAC::TAG_SIZE + 8 };
+
+enum CipherId
+{
+	CIPHER_3DES = 1,
+	CIPHER_AES_CTR = 2
+};
+
+enum KDFId
+{
+	KDF_NONE = 0,
+	KDF_PBKDF2_SHA1 = 1,
+	// PBKDF2 master key from the master salt, then HKDF-SHA1 over the nonce for the file key
+	KDF_KEYRING = 2
+};
+
+// hit and miss counts for the decrypted chunk cache, split by whether the read that caused 
+//  them carried on from where the previous read stopped
+struct CacheStats
+{
+	size_t sequentialHits;
+	size_t sequentialMisses;
+	size_t randomHits;
+	size_t randomMisses;
+	// chunks decrypted ahead of need, and how many of those were later used
+	size_t readaheadChunks;
+	size_t readaheadHits;
+};
+
+// one range of a scatter/gather call: length bytes of data at offset, to or from buffer; 
+//  done is set to how many of them were read or written
+struct IORange
+{
+	size_t offset;
+	void *buffer;
+	size_t length;
+	size_t done;
+};
+
 class CryptKeeper
 {
 protected:
-	// 64 bytes is plenty for an 8 byte nonce, but we might need to bump it up 
-	//  if we go to a 16 byte nonce.  
+	// bytes in front of the ciphertext: the text header's size for version 1 files, and for
+	//  version 2 whatever the header says, at least HEADER_V2_SIZE
 	int headerSize;
-	// 8 byte block size for triple DES
+	// size of the version 1 text header for this cipher; headerSize is set when a file is 
+	//  opened, depending on which header it has
+	int textHeaderSize;
+	// the cipher's block size, which is also the nonce length: 8 for DES, 16 for AES
 	size_t blockSize;
 	string fileVersion;
 
+	// version 2 header fields; headerVersion is 1 for the old text header
+	int headerVersion;
+	unsigned short cipherId;
+	unsigned short kdfId;
+	unsigned short kdfKeyLength;
+	unsigned int kdfIterations;
+	vector<unsigned char> masterSalt;
+	// whether the binary header has been written yet, and the data length it holds
+	bool headerWritten;
+	int64_t headerDataLength;
+	// the key check value and key check MAC the header had, for checking a password key once 
+	//  it's made; both are empty for a new file
+	string fileKCV;
+	vector<unsigned char> fileKeyCheck;
+	// FLAG_COMPRESSED; the keeper itself doesn't care, it just keeps the flag
+	bool compressed;
+
+	// A keystream cipher (CTR) encrypts the same place in the file the same way every time,
+	//  so two different writes there give away their XOR.  Data that's already in the file
+	//  can't be written over; keystreamUsed holds the ranges written under this nonce, from
+	//  the data length at Open and every write since.  Padding and gaps in a block go out as
+	//  zero ciphertext, rather than as keystream, so they can still be appended to.
+	bool keystreamCipher;
+	map<size_t, size_t> keystreamUsed;
+
 	FILE *fp;
 	vector<unsigned char> blockBuffer;
 	vector<unsigned char> nonce;
 	vector<unsigned char> key;
 
 	bool readOnly;
-	int fileSize;
-	int fileOffset;
+	// 64 bit so files can go past 2G; fileSize is one more than the length of the data
+	int64_t fileSize;
+	int64_t fileOffset;
+
+	// memory mapped mode ("rm"); the ciphertext is mapped read-only, and decrypted lazily 
+	//  into the chunk cache.  mapBase stays NULL for a file with no data to map.
+	unsigned char *mapBase;
+	size_t mapLength;
+
+	// LRU cache of decrypted chunks, most recently used at the front; cacheIndex maps a chunk 
+	//  number to its place in the list
+	struct CacheChunk
+	{
+		size_t index;
+		size_t length;
+		bool readahead;
+		vector<unsigned char> data;
+	};
+	list<CacheChunk> cache;
+	map<size_t, list<CacheChunk>::iterator> cacheIndex;
+	size_t cacheChunkSize;
+	size_t cacheChunks;
+	size_t readaheadChunks;
+	size_t lastReadEnd;
+	CacheStats cacheStats;
+
+	// write-behind buffer; consecutive writes collect here as plaintext starting at pendingStart,
+	//  and go out as one extent once there's pendingLimit bytes of it.  pendingStart is always
+	//  block aligned, with the old plaintext in front of the first write, so the blocks can be
+	//  encrypted where they are.  Bulk reads go through at most pendingLimit bytes at a time
+	//  too, so neither takes memory in proportion to the request.
+	vector<unsigned char> pending;
+	size_t pendingStart;
+	size_t pendingLimit;
+	// a buffered write, or the tags or header, failed to go out; Flush and Close report it
+	bool writeFailed;
+
+	// chunks per read or write in the stream functions
+	size_t streamChunks;
+
+	// optional io_uring backend; large reads and writes are split into extents of aioExtent 
+	//  bytes with several in flight, and each is decrypted or encrypted as the I/O completes
+	AsyncIO *aio;
+	size_t aioExtent;
+
+	// ReadAt/WriteAt lock the blocks they touch, and take metaMutex to update the file size
+	//  or drop stale cache chunks
+	RangeLock blockLocks;
+	mutex metaMutex;
+
+	// ReadV reads ranges up to this many bytes apart in one preadv, throwing the gap away
+	size_t gatherGap;
+
+	// DeriveKeyInBackground; a key that's still being made is in keyFuture until the first 
+	//  call that needs it takes it, under keyMutex
+	bool backgroundKey;
+	future<vector<unsigned char> > keyFuture;
+	atomic<bool> keyPending;
+	mutex keyMutex;
+	// the key didn't match the file's key check; everything but Close fails until the next Open
+	bool keyRejected;
+	// the last SetKey took; CheckKey fails without it
+	bool keyUsable;
+
+	// EnableMetrics and SetTraceHook; all the hot paths test is whether metrics is NULL
+	IOMetrics *metrics;
+	TraceHook traceHook;
+	void *traceContext;
+
+	// chunk authentication, for binary header files with FLAG_CHUNK_MAC.  Chunks are checked 
+	//  the first time they're read and remembered as good; chunks we write are marked dirty 
+	//  and their tags recomputed by Close, unless a whole chunk went out in one write and 
+	//  could be tagged from the buffer.  A chunk that's only partly overwritten is checked 
+	//  first, so new tags never vouch for data that was already bad.  The tag table and 
+	//  chunk states are guarded by metaMutex.
+	enum ChunkState { CHUNK_UNCHECKED, CHUNK_VERIFIED, CHUNK_DIRTY, CHUNK_BAD };
+	bool authenticated;
+	bool streamFormat;
+	size_t macChunkSize;
+	ChunkMAC mac;
+	bool macReady;
+	bool rootPending;
+	bool rootValid;
+	bool rootChanged;
+	bool tagsChanged;
+	bool integrityFailed;
+	vector<unsigned char> chunkTags;
+	vector<unsigned char> chunkStates;
+	unsigned char rootTag[ChunkMAC::TAG_SIZE];
+	// data length the tags on disk cover, and the furthest any write has reached
+	int64_t taggedLength;
+	size_t touchedEnd;
 
 	// we want these virtual so that derived classes will call the right encryption function
-	virtual void DecryptBlock(vector<unsigned char> &data, int offset, int counter) = 0;
-	virtual void EncryptBlock(vector<unsigned char> &data, int offset, int counter) = 0;
+	virtual void DecryptBlock(vector<unsigned char> &data, size_t offset, size_t counter) = 0;
+	virtual void EncryptBlock(vector<unsigned char> &data, size_t offset, size_t counter) = 0;
+	// process a run of consecutive blocks in place, starting at the given counter; the default 
+	//  calls the single block functions a block at a time, but ciphers that can pipeline several
+	//  blocks should override.  Runs can be anywhere, including straight in a caller's buffer.
+	virtual void DecryptRun(unsigned char *blocks, size_t count, size_t counter);
+	virtual void EncryptRun(unsigned char *blocks, size_t count, size_t counter);
+	// everything goes to the Run functions through these, which keep the cipher metrics
+	void DecryptBlocks(unsigned char *blocks, size_t count, size_t counter);
+	void EncryptBlocks(unsigned char *blocks, size_t count, size_t counter);
+	void DecryptBlocks(vector<unsigned char> &data, size_t offset, size_t count, size_t counter);
+	void EncryptBlocks(vector<unsigned char> &data, size_t offset, size_t count, size_t counter);
 	// this will grab the first 6 hex digits resulting from encrypting a block of 0s (no nonce or counter)
 	virtual string GetKCV() = 0;
+	// replace the key; derived classes can override to rebuild any cached key schedule, and 
+	//  return false for a key the cipher can't use, which no file will then open with
+	virtual bool SetKey(const vector<unsigned char> &newKey);
+	// called once the header is read or created, for classes that make the key from the nonce
+	virtual void DeriveKey();
+	// DeriveKey hands this the work of making the key, which it does now, or on another 
+	//  thread with DeriveKeyInBackground; WaitKey sets the key once it's ready, and returns 
+	//  false if it was rejected
+	void MakeKey(function<vector<unsigned char>()> make);
+	bool WaitKey();
+	void PrefetchHead();
+	bool CheckKey();
+	bool StartKey();
+	bool AbandonOpen();
+	void PrepareBlock(unsigned char *block, size_t index, bool whole);
+	bool ClaimKeystream(size_t start, size_t end);
+
+	// the clock for the metrics' times, only read when they're on; Count adds to the process too
+	inline uint64_t MetricsClock()
+	{
+		return metrics != NULL ? IOMetrics::Now() : 0;
+	}
+	inline void Count(MetricsCounter counter, uint64_t value)
+	{
+		if(metrics == NULL) return;
+		metrics->Add(counter, value);
+		IOMetrics::Process().Add(counter, value);
+	}
+	void CountIO(bool write, size_t bytes, size_t calls, uint64_t started);
 
 	void InitFileHeader();
 	bool ReadFileHeader();
+	bool ReadTextHeader(char *buffer);
+	bool ReadBinaryHeader(unsigned char *buffer);
+	string BuildTextHeader();
+	void WriteTextHeader();
+	bool WriteBinaryHeader();
+	void BuildBinaryHeader(unsigned char *buffer, int64_t dataLength);
+	void ComputeStreamTag(uint64_t dataLength, unsigned char *tag);
 	void ModifyNonce(size_t counter, vector<unsigned char> &modifiedNonce);
+	size_t ReadCiphertext(size_t blockStart, size_t blockCount, unsigned char *dest);
+	size_t ReadDecrypt(size_t blockStart, size_t blockCount, unsigned char *dest);
+	bool EncryptWrite(size_t blockStart, size_t blockCount, vector<unsigned char> &data);
+	bool UseAsyncIO(size_t bytes);
+	bool FinishAsyncWrite(int fd, vector<unsigned char> &data, size_t total, size_t position, bool &ok);
+	size_t PReadCiphertext(size_t blockStart, size_t blockCount, unsigned char *dest);
+	bool PWriteCiphertext(size_t blockStart, size_t blockCount, unsigned char *source);
+	bool OpenMapped(const char *filename);
+	const unsigned char *NextSpan(size_t count, size_t &length);
+	CacheChunk *GetChunk(size_t index, bool sequential);
+	CacheChunk *AllocateChunk(size_t index);
+	CacheChunk *LoadChunk(size_t index);
+	void Readahead(size_t index);
+	void InvalidateChunks(size_t start, size_t end);
+	void ClearCache();
+	bool FlushPending();
+	void ResetChunkTags();
+	bool LoadChunkTags(unsigned char *buffer);
+	bool WriteChunkTags();
+	void PrepareMAC();
+	bool ComputeRootTag(size_t dataLength, unsigned char *tag);
+	size_t ChunkExtent(size_t index, size_t dataLength);
+	void ChunkBlockRange(size_t &blockStart, size_t &blockEnd);
+	bool ReadChunkTagged(size_t index, size_t length, vector<unsigned char> &buffer);
+	size_t CheckCiphertext(size_t blockStart, size_t bytes, const unsigned char *ciphertext);
+	void TouchChunks(size_t start, size_t end);
+	void TagCiphertext(size_t blockStart, size_t bytes, const unsigned char *ciphertext);
+	struct Extent
+	{
+		size_t blockStart;
+		size_t blockEnd;
+		// where it starts in the scratch buffer, and how many bytes of it checked out
+		size_t scratch;
+		size_t bytes;
+	};
+	size_t MergeExtents(IORange *ranges, size_t count, size_t dataLength, vector<Extent> &extents);
+	size_t FindExtent(const vector<Extent> &extents, size_t offset);
+	void LockExtents(const vector<pair<size_t, size_t> > &spans, vector<pair<size_t, size_t> > &locks, bool shared);
+	void UnlockExtents(const vector<pair<size_t, size_t> > &locks, bool shared);
+	bool Rekey(const char *filename, CryptKeeper &fresh, unsigned threads);
+	bool RekeyFile(const char *filename, CryptKeeper &fresh, unsigned threads);
+	bool RekeyChunks(size_t first, size_t last, unsigned threads, function<bool(size_t, vector<unsigned char> &)> work);
+	void KeyCheck(vector<unsigned char> &check);
 
 public:
 	CryptKeeper(const char *key);
-	~CryptKeeper();
+	// virtual, since the keepers are made and deleted through CryptKeeper pointers
+	virtual ~CryptKeeper();
 
 	size_t Read(void *buffer, size_t count);
 	size_t Write(void *buffer, size_t count);
 	bool Open(const char *filename, const char *mode);
-	void Close();
-	void Seek(size_t offset, int origin);
-	size_t Tell();
+	// false if anything written since Open, or the header, didn't make it to the file
+	bool Close();
+	void Seek(int64_t offset, int origin);
+	int64_t Tell();
+
+	// preallocate room for this many bytes of data when the final size is known up front, 
+	//  so a growing file isn't extended one write at a time
+	bool Reserve(int64_t bytes);
+
+	// returns a pointer to up to count bytes of decrypted data at the current offset, valid until
+	//  the next call, and advances the offset by the length returned; with a memory mapped open
+	//  ("rm") this costs no syscalls and no copies once the page has been decrypted
+	const unsigned char *ReadSpan(size_t count, size_t &length);
+
+	// chunk size should be a multiple of the page size; the cache must hold more chunks than
+	//  are read ahead
+	void SetCache(size_t chunkSize, size_t chunks, size_t readahead);
+	CacheStats GetCacheStats();
+
+	// Positional chunk interface for pipelines.  The cipher calls don't touch any shared state,
+	//  so EncryptChunk and DecryptChunk can run on several threads at once.  The offset is the
+	//  plaintext offset of the chunk and must be block aligned; chunks get padded out to whole 
+	//  blocks.  ReadChunk and WriteChunk do the raw ciphertext I/O and are not thread safe; 
+	//  ReadChunk returns the number of data bytes in the chunk, and WriteChunk extends the file
+	//  size to cover length bytes of data.  The cipher calls fail without a usable key.
+	bool EncryptChunk(vector<unsigned char> &chunk, size_t offset);
+	bool DecryptChunk(vector<unsigned char> &chunk, size_t offset);
+	size_t ReadChunk(vector<unsigned char> &chunk, size_t offset, size_t length);
+	bool WriteChunk(vector<unsigned char> &chunk, size_t offset, size_t length);
+	size_t GetBlockSize();
+	size_t GetDataLength();
+	// false for a keystream cipher, whose writes have to land past any data already written
+	bool CanOverwrite();
+
+	// For the password classes: Open starts making the key on another thread and returns as 
+	//  soon as the header is read, and the kernel starts reading in the first chunks meanwhile.
+	//  The first call that needs the key waits for it, and checks it against the header; with
+	//  a wrong password that and every call after it fails.  VerifyKey waits and checks up 
+	//  front.  Without a background key, Open does the check and fails on a wrong password.
+	void DeriveKeyInBackground(bool enable);
+	bool VerifyKey();
+
+	// Counters and latency histograms for this keeper, also added into IOMetrics::Process(); 
+	//  off to start with, unless IOMetrics::EnableProcess was called.  GetMetrics is NULL 
+	//  while they're off.  The trace hook is called at the end of every Open, Read, Write and
+	//  Close, and their positional and scatter/gather versions.  Don't change either while 
+	//  other threads are using the keeper.
+	void EnableMetrics(bool enable);
+	IOMetrics *GetMetrics();
+	void SetTraceHook(TraceHook hook, void *context);
+
+	// switch large reads and writes over to io_uring with up to depth requests of extent bytes
+	//  in flight; returns false and stays on blocking stdio if io_uring isn't available
+	bool EnableAsyncIO(unsigned depth, size_t extent);
+
+	// Positional reads and writes that can be called from many threads at once on one open 
+	//  file.  They don't use the file offset, the shared block buffer, or the write-behind 
+	//  buffer, and go straight to pread/pwrite.  Writers lock only the blocks they touch.  
+	//  Don't mix them with Read/Write on other threads; call Flush first so they see 
+	//  anything written with Write.
+	size_t ReadAt(size_t offset, void *buffer, size_t count);
+	size_t WriteAt(size_t offset, const void *buffer, size_t count);
+	// false if a buffered write has failed since Open
+	bool Flush();
+
+	// Scatter/gather versions of ReadAt and WriteAt, for many discontiguous ranges in one 
+	//  call.  Ranges that share or touch blocks are merged, so each block goes through the 
+	//  cipher once per call, and reads of ranges close together go out as a single preadv.
+	//  WriteV applies the ranges in order, so where they overlap the later one wins.  Both 
+	//  return the total bytes read or written.
+	size_t ReadV(IORange *ranges, size_t count);
+	size_t WriteV(IORange *ranges, size_t count);
+
+	// Check every chunk tag of an authenticated file, spread over this many threads (0 for 
+	//  one per core).  Reads check the chunks they touch anyway, and stop short at a chunk 
+	//  that fails; IntegrityFailed says whether that has happened.
+	bool IsAuthenticated();
+	bool Verify(unsigned threads);
+
+	// Whether the data is a compressed container.  SetCompressed marks a file opened for
+	//  writing as one, and only works while it has no data and a binary header.
+	bool IsCompressed();
+	bool SetCompressed();
+	bool IntegrityFailed();
+
+	// Encrypt everything from one descriptor to another in a single pass, in the stream 
+	//  format, using a fixed size buffer; either end can be a pipe or socket.  Don't use 
+	//  these with Open.
+	bool EncryptStream(int in, int out);
+	bool DecryptStream(int in, int out);
 };
 
 #endif
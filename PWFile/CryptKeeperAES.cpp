@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory.h>
+#include <unistd.h>
+
+#include <vector>
+#include <atomic>
+#include <new>
+using namespace std;
+
+#include "CryptKeeperAES.h"
+#include "misc.h"
+
+// a thread's copy of the expanded key, and the serial of the key it was copied from
+struct ThreadContext
+{
+	EVP_CIPHER_CTX *ctx;
+	uint64_t serial;
+
+	ThreadContext() : ctx(NULL), serial(0) {}
+	~ThreadContext() { EVP_CIPHER_CTX_free(ctx); }
+};
+
+// every key any keeper sets gets its own serial, so a thread can't take one for another
+static atomic<uint64_t> nextSerial(1);
+
+// accepts the file encryption key in the clear; it's the caller's responsibility to 
+//  handle providing the key from secure storage
+CryptKeeperAES::CryptKeeperAES(const char *enckey) : CryptKeeper(enckey)
+{
+	// for AES; the header needs room for a 16 byte nonce
+	blockSize = 16;
+	headerSize = 128;
+	textHeaderSize = 128;
+	cipherId = CIPHER_AES_CTR;
+	fileVersion = "AES-1.0";
+	keystreamCipher = true;
+
+	// without a context, SetKey fails and so does every Open
+	ctx = EVP_CIPHER_CTX_new();
+	keySerial = 0;
+	SetKey(key);
+}
+
+CryptKeeperAES::~CryptKeeperAES()
+{
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+// pick AES-128, AES-192 or AES-256 from the key length, and do the key expansion once; any
+//  other length is refused
+bool CryptKeeperAES::SetKey(const vector<unsigned char> &newKey)
+{
+	CryptKeeper::SetKey(newKey);
+	keySerial = 0;
+
+	const EVP_CIPHER *cipher = NULL;
+	switch(key.size())
+	{
+		case 16: cipher = EVP_aes_128_ctr(); break;
+		case 24: cipher = EVP_aes_192_ctr(); break;
+		case 32: cipher = EVP_aes_256_ctr(); break;
+	}
+
+	if(ctx == NULL || cipher == NULL || EVP_EncryptInit_ex(ctx, cipher, NULL, &key[0], NULL) != 1)
+	{
+		keyUsable = false;
+		return false;
+	}
+
+	keySerial = nextSerial++;
+	return true;
+}
+
+// ctx only holds the expanded key; each thread keeps its own copy, so several threads can 
+//  encrypt chunks at once, and only copies it again when the key changes
+void CryptKeeperAES::CryptBlocks(unsigned char *data, size_t count, vector<unsigned char> &counterBlock)
+{
+	static thread_local ThreadContext local;
+
+	// a key that didn't take has nothing to encrypt with; zeros, rather than the plaintext
+	if(keySerial == 0)
+	{
+		memset(data, 0, count * blockSize);
+		return;
+	}
+
+	if(local.serial != keySerial)
+	{
+		// out of memory, the same as a vector that can't grow
+		if(local.ctx == NULL) local.ctx = EVP_CIPHER_CTX_new();
+		if(local.ctx == NULL || EVP_CIPHER_CTX_copy(local.ctx, ctx) != 1) throw bad_alloc();
+		local.serial = keySerial;
+	}
+
+	// reset the counter only; the key schedule is kept from SetKey
+	EVP_EncryptInit_ex(local.ctx, NULL, NULL, NULL, &counterBlock[0]);
+
+	int outlen = 0;
+	EVP_EncryptUpdate(local.ctx, data, &outlen, data, count * blockSize);
+}
+
+void CryptKeeperAES::EncryptRun(unsigned char *blocks, size_t count, size_t counter)
+{
+	if(count <= 0) return;
+
+	vector<unsigned char> counterBlock;
+	ModifyNonce(counter, counterBlock);
+	CryptBlocks(blocks, count, counterBlock);
+}
+
+void CryptKeeperAES::DecryptRun(unsigned char *blocks, size_t count, size_t counter)
+{
+	EncryptRun(blocks, count, counter);
+}
+
+void CryptKeeperAES::EncryptBlock(vector<unsigned char> &data, size_t offset, size_t counter)
+{
+	EncryptBlocks(data, offset, 1, counter);
+}
+
+void CryptKeeperAES::DecryptBlock(vector<unsigned char> &data, size_t offset, size_t counter)
+{
+	EncryptBlocks(data, offset, 1, counter);
+}
+
+// CTR with an all zero counter block over a block of zeros gives the raw encryption of 0s
+string CryptKeeperAES::GetKCV()
+{
+	vector<unsigned char> zeros(blockSize, 0);
+	vector<unsigned char> counterBlock(blockSize, 0);
+
+	CryptBlocks(&zeros[0], 1, counterBlock);
+
+	char kcv[16];
+	sprintf(kcv, "%06x", (int)zeros[0] << 16 | (int)zeros[1] << 8 | (int)zeros[2]);
+
+	return string(kcv);
+}
@@ -0,0 +1,57 @@
+#ifndef CryptKeeperAES_h_included
+#define CryptKeeperAES_h_included
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <openssl/evp.h>
+using namespace std;
+
+#include <CryptKeeper.h>
+
+/* Example of a file header:
+
+0000000: 4372 7970 744b 6565 7065 7220 4145 532d  CryptKeeper AES-
+0000010: 312e 3020 3230 3031 3820 3065 3966 3261  1.0 20018 0e9f2a
+0000020: 2031 4338 4634 3337 3945 3030 3241 3543   1C8F4379E002A5C
+0000030: 3639 4333 3444 4237 3546 4538 3234 4137  69C34DB75FE824A7
+0000040: 350a 0000 0000 0000 0000 0000 0000 0000  5...............
+0000050: 0000 0000 0000 0000 0000 0000 0000 0000  ................
+0000060: 0000 0000 0000 0000 0000 0000 0000 0000  ................
+0000070: 0000 0000 0000 0000 0000 0000 0000 0000  ................
+
+*/
+
+// AES in CTR mode with a 16 byte block and nonce; the key may be 16, 24 or 32 bytes for 
+//  AES-128, AES-192 or AES-256, and any other length fails Open.  The block counter goes 
+//  into the low 8 bytes of the nonce, so a run of blocks is one contiguous CTR stream, and 
+//  OpenSSL will use AES-NI and interleave several blocks at a time where the CPU supports 
+//  it.  Being a keystream cipher, data already in the file can't be written over.
+class CryptKeeperAES : public CryptKeeper
+{
+protected:
+	// the expanded key; each thread encrypts with its own copy, made again when keySerial 
+	//  changes
+	EVP_CIPHER_CTX *ctx;
+	uint64_t keySerial;
+
+	virtual void DecryptBlock(vector<unsigned char> &data, size_t offset, size_t counter);
+	virtual void EncryptBlock(vector<unsigned char> &data, size_t offset, size_t counter);
+	virtual void DecryptRun(unsigned char *blocks, size_t count, size_t counter);
+	virtual void EncryptRun(unsigned char *blocks, size_t count, size_t counter);
+	virtual string GetKCV();
+	virtual bool SetKey(const vector<unsigned char> &newKey);
+
+	// CTR mode encrypts and decrypts the same way
+	void CryptBlocks(unsigned char *data, size_t count, vector<unsigned char> &counterBlock);
+
+public:
+	CryptKeeperAES(const char *key);
+	virtual ~CryptKeeperAES();
+};
+
+#endif
@@ -0,0 +1,20 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory.h>
+#include <unistd.h>
+
+#include <vector>
+using namespace std;
+
+#include "CryptKeeperAESPW.h"
+
+// the 128 bit nonce is the salt size NIST recommends, and we take a 32 byte key from it for
+//  AES-256
+CryptKeeperAESPW::CryptKeeperAESPW(const char *pw) : PasswordCryptKeeper<CryptKeeperAES, CryptKeeperAESPW, 32>(pw)
+{
+}
+
+CryptKeeperAESPW::~CryptKeeperAESPW()
+{
+}
@@ -0,0 +1,23 @@
+#ifndef CryptKeeperAESPW_h_included
+#define CryptKeeperAESPW_h_included
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+using namespace std;
+#include "CryptKeeperAES.h"
+#include "PasswordCryptKeeper.h"
+
+// AES-256 with a key stretched from a password; see PasswordCryptKeeper.h
+class CryptKeeperAESPW : public PasswordCryptKeeper<CryptKeeperAES, CryptKeeperAESPW, 32>
+{
+public:
+	CryptKeeperAESPW(const char *key);
+	virtual ~CryptKeeperAESPW();
+};
+
+#endif
@@ -11,6 +11,8 @@
 using namespace std;
 
 #include <CryptKeeper.h>
+#include "BasicCryptKeeper.h"
+#include "DES.h"
 
 /* Example of a file header:
 
@@ -21,17 +23,85 @@ using namespace std;
 
 */
 
-class CryptKeeperDES : public CryptKeeper
+// triple DES as a BasicCryptKeeper policy; key schedules are built once per key rather than
+//  once per block.  kernel is the DES kernel the next SetKey uses, GetDESKernel() to start.
+struct DESCipher
 {
-protected:
-	// we want these virtual so that derived classes will call the right encryption function
-	virtual void DecryptBlock(vector<unsigned char> &data, int offset, int counter);
-	virtual void EncryptBlock(vector<unsigned char> &data, int offset, int counter);
-	virtual string GetKCV();
+	enum { BLOCK_SIZE = 8 };
 
+	int kernel;
+	DESContext encryptContext;
+	DESContext decryptContext;
+	// set when the key was made for the OpenSSL kernel
+	EVP_CIPHER_CTX *encryptEVP;
+	EVP_CIPHER_CTX *decryptEVP;
+
+	DESCipher()
+	{
+		kernel = GetDESKernel();
+		encryptEVP = NULL;
+		decryptEVP = NULL;
+	}
+
+	~DESCipher()
+	{
+		FreeEVP();
+	}
+
+	void FreeEVP()
+	{
+		EVP_CIPHER_CTX_free(encryptEVP);
+		EVP_CIPHER_CTX_free(decryptEVP);
+		encryptEVP = NULL;
+		decryptEVP = NULL;
+	}
+
+	// the portable schedules are always there, for when OpenSSL can't take the key
+	void SetKey(const unsigned char *key, size_t length)
+	{
+		initECB(encryptContext, (unsigned char *)key, length, true);
+		initECB(decryptContext, (unsigned char *)key, length, false);
+
+		FreeEVP();
+		if(kernel == DES_KERNEL_OPENSSL && key != NULL)
+		{
+			encryptEVP = initEVP((unsigned char *)key, length, true);
+			decryptEVP = initEVP((unsigned char *)key, length, false);
+			if(encryptEVP == NULL || decryptEVP == NULL) FreeEVP();
+		}
+	}
+
+	// cryptECB takes an int length, so very long runs go in pieces
+	enum { MAX_RUN = 1 << 20 };
+
+	void Crypt(DESContext &context, EVP_CIPHER_CTX *evp, unsigned char *blocks, size_t count)
+	{
+		for(size_t done = 0; done < count; done += MAX_RUN)
+		{
+			size_t run = count - done < MAX_RUN ? count - done : (size_t)MAX_RUN;
+			unsigned char *data = blocks + done * BLOCK_SIZE;
+
+			if(evp == NULL || !cryptEVP(evp, data, run * BLOCK_SIZE, data))
+				cryptECB(context, data, run * BLOCK_SIZE, data);
+		}
+	}
+
+	void Encrypt(unsigned char *blocks, size_t count)
+	{
+		Crypt(encryptContext, encryptEVP, blocks, count);
+	}
+
+	void Decrypt(unsigned char *blocks, size_t count)
+	{
+		Crypt(decryptContext, decryptEVP, blocks, count);
+	}
+};
+
+class CryptKeeperDES : public BasicCryptKeeper<DESCipher>
+{
 public:
 	CryptKeeperDES(const char *key);
-	~CryptKeeperDES();
+	virtual ~CryptKeeperDES();
 };
 
 #endif
@@ -10,23 +10,14 @@
 #include <string>
 using namespace std;
 #include "CryptKeeperDES.h"
+#include "PasswordCryptKeeper.h"
 
-class CryptKeeperPW : public CryptKeeperDES
+// triple DES with a key stretched from a password; see PasswordCryptKeeper.h
+class CryptKeeperPW : public PasswordCryptKeeper<CryptKeeperDES, CryptKeeperPW, 24>
 {
-protected:
-	string password;
-
-	vector<unsigned char> SHA1(vector<unsigned char> input);
-	vector<unsigned char> HMAC_SHA1(vector<unsigned char> key, vector<unsigned char> message);
-	vector<unsigned char> StretchKey(unsigned int length, unsigned int passes, string password, 
-		vector<unsigned char> salt);
-	
 public:
 	CryptKeeperPW(const char *key);
-	~CryptKeeperPW();
-
-	// nonce is created here, so here is where we generate the key
-	bool Open(const char *filename, const char *mode);
+	virtual ~CryptKeeperPW();
 };
 
 #endif
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+using namespace std;
+
+#include "CryptKeeperStream.h"
+
+// the buffer is rounded to whole blocks, so full buffers never leave the keeper a partial
+//  block to read back
+CryptKeeperStreambuf::CryptKeeperStreambuf(CryptKeeper *ck, ios_base::openmode which, size_t bufferSize)
+{
+	keeper = ck;
+	mode = which;
+
+	size_t blockSize = keeper->GetBlockSize();
+	if(bufferSize < blockSize) bufferSize = blockSize;
+	buffer.resize(bufferSize - bufferSize % blockSize);
+
+	setg(NULL, NULL, NULL);
+	setp(NULL, NULL);
+}
+
+CryptKeeperStreambuf::~CryptKeeperStreambuf()
+{
+	sync();
+}
+
+// the offset of the next character in or out; the keeper is at the end of the get area, or
+//  at the start of the put area
+int64_t CryptKeeperStreambuf::Position()
+{
+	if(gptr() != NULL) return keeper->Tell() - (egptr() - gptr());
+
+	return keeper->Tell() + (pptr() - pbase());
+}
+
+bool CryptKeeperStreambuf::FlushPut()
+{
+	size_t count = pptr() - pbase();
+	setp(NULL, NULL);
+
+	return count == 0 || keeper->Write(&buffer[0], count) == count;
+}
+
+// put the keeper back where the reader is, before writing or seeking past the cache span
+void CryptKeeperStreambuf::DropGet()
+{
+	if(gptr() == NULL) return;
+
+	keeper->Seek(Position(), SEEK_SET);
+	setg(NULL, NULL, NULL);
+}
+
+// the next span of the chunk cache becomes the get area; it's only valid until the next
+//  keeper call, and everything that calls the keeper drops it first or refills it
+CryptKeeperStreambuf::int_type CryptKeeperStreambuf::underflow()
+{
+	if(gptr() != NULL && gptr() < egptr()) return traits_type::to_int_type(*gptr());
+	if(!FlushPut()) return traits_type::eof();
+
+	size_t length = 0;
+	const unsigned char *span = keeper->ReadSpan(buffer.size(), length);
+	if(span == NULL || length == 0)
+	{
+		setg(NULL, NULL, NULL);
+		return traits_type::eof();
+	}
+
+	char *start = (char *)span;
+	setg(start, start, start + length);
+
+	return traits_type::to_int_type(*gptr());
+}
+
+CryptKeeperStreambuf::int_type CryptKeeperStreambuf::overflow(int_type c)
+{
+	if(!FlushPut()) return traits_type::eof();
+	DropGet();
+
+	setp(&buffer[0], &buffer[0] + buffer.size());
+
+	if(!traits_type::eq_int_type(c, traits_type::eof()))
+	{
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+
+	return traits_type::not_eof(c);
+}
+
+int CryptKeeperStreambuf::sync()
+{
+	if(!FlushPut()) return -1;
+	keeper->Flush();
+
+	return 0;
+}
+
+streamsize CryptKeeperStreambuf::xsgetn(char *s, streamsize count)
+{
+	streamsize total = 0;
+
+	while(total < count)
+	{
+		streamsize available = (gptr() != NULL) ? egptr() - gptr() : 0;
+		if(available > 0)
+		{
+			streamsize length = count - total < available ? count - total : available;
+			memcpy(s + total, gptr(), length);
+			gbump(length);
+			total += length;
+			continue;
+		}
+
+		// big reads go straight to the keeper, which decrypts them into place in one go
+		if(count - total >= (streamsize)buffer.size())
+		{
+			if(!FlushPut()) break;
+			DropGet();
+
+			size_t length = keeper->Read(s + total, count - total);
+			total += length;
+			break;
+		}
+
+		if(traits_type::eq_int_type(underflow(), traits_type::eof())) break;
+	}
+
+	return total;
+}
+
+streamsize CryptKeeperStreambuf::xsputn(const char *s, streamsize count)
+{
+	streamsize total = 0;
+
+	while(total < count)
+	{
+		streamsize room = (pptr() != NULL) ? epptr() - pptr() : 0;
+		if(room > 0)
+		{
+			streamsize length = count - total < room ? count - total : room;
+			memcpy(pptr(), s + total, length);
+			pbump(length);
+			total += length;
+			continue;
+		}
+
+		// big writes skip the copy, and go straight into the keeper's write-behind buffer
+		if(count - total >= (streamsize)buffer.size())
+		{
+			if(!FlushPut()) break;
+			DropGet();
+
+			total += keeper->Write((void *)(s + total), count - total);
+			break;
+		}
+
+		if(traits_type::eq_int_type(overflow(traits_type::eof()), traits_type::eof())) break;
+	}
+
+	return total;
+}
+
+CryptKeeperStreambuf::pos_type CryptKeeperStreambuf::seekoff(off_type offset, ios_base::seekdir dir,
+	ios_base::openmode)
+{
+	// tellg and tellp land here, and shouldn't cost anything
+	if(dir == ios_base::cur && offset == 0) return pos_type(Position());
+
+	// anything still in the put area counts towards the length
+	if(!FlushPut()) return pos_type(off_type(-1));
+
+	int64_t target;
+	if(dir == ios_base::beg) target = offset;
+	else if(dir == ios_base::cur) target = Position() + offset;
+	else target = (int64_t)keeper->GetDataLength() + offset;
+
+	// the keeper can't seek before the start, or past the end of a file that's only read
+	if(target < 0) return pos_type(off_type(-1));
+	if((mode & ios_base::out) == 0 && target > (int64_t)keeper->GetDataLength()) return pos_type(off_type(-1));
+
+	// still inside the span we have, so no need to go back to the keeper
+	if(gptr() != NULL && target >= keeper->Tell() - (egptr() - eback()) && target <= keeper->Tell())
+	{
+		setg(eback(), egptr() - (keeper->Tell() - target), egptr());
+		return pos_type(target);
+	}
+
+	setg(NULL, NULL, NULL);
+	keeper->Seek(target, SEEK_SET);
+
+	return pos_type(target);
+}
+
+CryptKeeperStreambuf::pos_type CryptKeeperStreambuf::seekpos(pos_type position, ios_base::openmode which)
+{
+	return seekoff(off_type(position), ios_base::beg, which);
+}
+
+icryptstream::icryptstream(CryptKeeper &ck) : istream(NULL), streamBuffer(&ck, ios_base::in)
+{
+	init(&streamBuffer);
+}
+
+ocryptstream::ocryptstream(CryptKeeper &ck) : ostream(NULL), streamBuffer(&ck, ios_base::out)
+{
+	init(&streamBuffer);
+}
@@ -0,0 +1,62 @@
+#ifndef CryptKeeperStream_h_included
+#define CryptKeeperStream_h_included
+
+#include <streambuf>
+#include <istream>
+#include <ostream>
+#include <vector>
+using namespace std;
+
+#include "CryptKeeper.h"
+
+// iostreams over an open CryptKeeper.  Reads are served straight out of the keeper's
+//  decrypted chunk cache (see ReadSpan), so getting a character or a formatted field costs
+//  a pointer bump, not a Read; writes collect in a block aligned buffer and go to Write a
+//  buffer at a time.  Reads and writes bigger than the buffer skip it.  Seeks within what's
+//  been read don't touch the keeper at all.  The keeper must stay open while the stream is
+//  in use, and shouldn't be used directly in the meantime; the destructor flushes, but
+//  doesn't close it.  std::endl flushes the keeper too, so use '\n' between lines.
+class CryptKeeperStreambuf : public streambuf
+{
+protected:
+	CryptKeeper *keeper;
+	ios_base::openmode mode;
+	// the put area; the get area points into the keeper's cache
+	vector<char> buffer;
+
+	bool FlushPut();
+	void DropGet();
+	int64_t Position();
+
+	virtual int_type underflow();
+	virtual int_type overflow(int_type c);
+	virtual int sync();
+	virtual streamsize xsgetn(char *s, streamsize count);
+	virtual streamsize xsputn(const char *s, streamsize count);
+	virtual pos_type seekoff(off_type offset, ios_base::seekdir dir, ios_base::openmode which);
+	virtual pos_type seekpos(pos_type position, ios_base::openmode which);
+
+public:
+	CryptKeeperStreambuf(CryptKeeper *ck, ios_base::openmode which, size_t bufferSize = 65536);
+	~CryptKeeperStreambuf();
+};
+
+class icryptstream : public istream
+{
+protected:
+	CryptKeeperStreambuf streamBuffer;
+
+public:
+	icryptstream(CryptKeeper &ck);
+};
+
+class ocryptstream : public ostream
+{
+protected:
+	CryptKeeperStreambuf streamBuffer;
+
+public:
+	ocryptstream(CryptKeeper &ck);
+};
+
+#endif
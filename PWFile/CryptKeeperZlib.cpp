@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+using namespace std;
+
+#include "CryptKeeperZlib.h"
+
+static const unsigned char indexMagic[8] = { 0x89, 'C', 'K', 'P', 'Z', 'I', 'X', '\n' };
+
+static void PutLE(unsigned char *dest, uint64_t value, int bytes)
+{
+	for(int i = 0; i < bytes; ++i)
+		dest[i] = (unsigned char)(value >> (8 * i));
+}
+
+static uint64_t GetLE(const unsigned char *source, int bytes)
+{
+	uint64_t value = 0;
+	for(int i = bytes - 1; i >= 0; --i)
+		value = (value << 8) | source[i];
+	return value;
+}
+
+CryptKeeperZlib::CryptKeeperZlib(CryptKeeper &ck, int compressionLevel, size_t chunkBytes)
+{
+	keeper = &ck;
+	level = compressionLevel;
+	chunkSize = chunkBytes;
+
+	active = false;
+	changed = false;
+	dataLength = 0;
+	recordEnd = 0;
+	offset = 0;
+	current = (size_t)-1;
+	dirty = false;
+}
+
+CryptKeeperZlib::~CryptKeeperZlib()
+{
+	Close();
+}
+
+bool CryptKeeperZlib::Open(bool compressNew)
+{
+	chunks.clear();
+	dataLength = 0;
+	recordEnd = 0;
+	offset = 0;
+	current = (size_t)-1;
+	dirty = false;
+	changed = false;
+
+	active = keeper->IsCompressed();
+	if(active) return LoadIndex();
+
+	if(compressNew && keeper->GetDataLength() == 0 && keeper->SetCompressed())
+	{
+		active = true;
+		changed = true;
+	}
+
+	return true;
+}
+
+bool CryptKeeperZlib::Close()
+{
+	if(!active) return true;
+
+	bool ok = StoreChunk();
+	if(ok && changed) ok = WriteIndex();
+
+	changed = false;
+	current = (size_t)-1;
+	plain.clear();
+
+	return ok;
+}
+
+// the trailer is at the very end, and says where the index is
+bool CryptKeeperZlib::LoadIndex()
+{
+	uint64_t length = keeper->GetDataLength();
+
+	// marked compressed, but closed before anything was written
+	if(length == 0) return true;
+	if(length < TRAILER_SIZE) return false;
+
+	unsigned char trailer[TRAILER_SIZE];
+	keeper->Seek(length - TRAILER_SIZE, SEEK_SET);
+	if(keeper->Read(trailer, TRAILER_SIZE) != TRAILER_SIZE) return false;
+	if(memcmp(trailer, indexMagic, sizeof(indexMagic)) != 0) return false;
+
+	size_t size = GetLE(trailer + 8, 4);
+	size_t count = GetLE(trailer + 12, 4);
+	uint64_t plainLength = GetLE(trailer + 16, 8);
+	uint64_t indexOffset = GetLE(trailer + 24, 8);
+
+	if(size == 0 || indexOffset + (uint64_t)count * ENTRY_SIZE + TRAILER_SIZE != length) return false;
+	if(plainLength > (uint64_t)count * size || (count > 0 && plainLength <= (uint64_t)(count - 1) * size))
+		return false;
+
+	vector<unsigned char> table(count * ENTRY_SIZE);
+	keeper->Seek(indexOffset, SEEK_SET);
+	if(count > 0 && keeper->Read(&table[0], table.size()) != table.size()) return false;
+
+	chunks.resize(count);
+	for(size_t i = 0; i < count; ++i)
+	{
+		const unsigned char *field = &table[i * ENTRY_SIZE];
+		ChunkEntry &entry = chunks[i];
+
+		entry.offset = GetLE(field, 8);
+		entry.capacity = GetLE(field + 8, 4);
+		entry.stored = GetLE(field + 12, 4);
+		entry.length = GetLE(field + 16, 4);
+
+		// every chunk but the last is full, and none can run into the index
+		size_t expected = i + 1 < count ? size : plainLength - (uint64_t)i * size;
+		if(entry.length != expected || entry.stored > entry.length || entry.stored > entry.capacity ||
+			entry.offset + entry.capacity > indexOffset)
+			return false;
+	}
+
+	chunkSize = size;
+	dataLength = plainLength;
+	recordEnd = indexOffset;
+
+	return true;
+}
+
+bool CryptKeeperZlib::WriteIndex()
+{
+	vector<unsigned char> table(chunks.size() * ENTRY_SIZE + TRAILER_SIZE, 0);
+
+	for(size_t i = 0; i < chunks.size(); ++i)
+	{
+		unsigned char *field = &table[i * ENTRY_SIZE];
+		PutLE(field, chunks[i].offset, 8);
+		PutLE(field + 8, chunks[i].capacity, 4);
+		PutLE(field + 12, chunks[i].stored, 4);
+		PutLE(field + 16, chunks[i].length, 4);
+	}
+
+	unsigned char *trailer = &table[chunks.size() * ENTRY_SIZE];
+	memcpy(trailer, indexMagic, sizeof(indexMagic));
+	PutLE(trailer + 8, chunkSize, 4);
+	PutLE(trailer + 12, chunks.size(), 4);
+	PutLE(trailer + 16, dataLength, 8);
+	PutLE(trailer + 24, recordEnd, 8);
+
+	keeper->Seek(recordEnd, SEEK_SET);
+	return keeper->Write(&table[0], table.size()) == table.size();
+}
+
+// make index the current chunk, writing out the one before if it changed; a chunk past the
+//  last one starts out empty
+bool CryptKeeperZlib::LoadChunk(size_t index)
+{
+	if(index == current) return true;
+	if(!StoreChunk()) return false;
+
+	current = (size_t)-1;
+	plain.clear();
+
+	if(index < chunks.size())
+	{
+		const ChunkEntry &entry = chunks[index];
+
+		packed.resize(entry.stored);
+		keeper->Seek(entry.offset, SEEK_SET);
+		if(entry.stored > 0 && keeper->Read(&packed[0], entry.stored) != entry.stored) return false;
+
+		if(entry.stored == entry.length)
+		{
+			plain.swap(packed);
+		}
+		else
+		{
+			plain.resize(entry.length);
+			uLongf length = entry.length;
+			if(uncompress(&plain[0], &length, &packed[0], entry.stored) != Z_OK || length != entry.length)
+			{
+				plain.clear();
+				return false;
+			}
+		}
+	}
+
+	current = index;
+	dirty = false;
+
+	return true;
+}
+
+bool CryptKeeperZlib::StoreChunk()
+{
+	if(current == (size_t)-1 || !dirty || plain.empty()) return true;
+
+	// stored as is unless compressing saves something
+	const unsigned char *record = &plain[0];
+	size_t stored = plain.size();
+
+	uLongf length = compressBound(plain.size());
+	packed.resize(length);
+	if(compress2(&packed[0], &length, &plain[0], plain.size(), level) == Z_OK && length < plain.size())
+	{
+		record = &packed[0];
+		stored = length;
+	}
+
+	ChunkEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	if(current < chunks.size()) entry = chunks[current];
+
+	// back where it was if it fits, or on the end
+	if(current >= chunks.size() || stored > entry.capacity)
+	{
+		entry.offset = recordEnd;
+		entry.capacity = stored;
+		recordEnd += stored;
+	}
+
+	keeper->Seek(entry.offset, SEEK_SET);
+	if(keeper->Write((void *)record, stored) != stored) return false;
+
+	entry.stored = stored;
+	entry.length = plain.size();
+
+	if(current < chunks.size()) chunks[current] = entry;
+	else chunks.push_back(entry);
+
+	dirty = false;
+	changed = true;
+
+	return true;
+}
+
+// every chunk before index has to be whole, so a write past the end fills the gap with zeros
+bool CryptKeeperZlib::FillTo(size_t index)
+{
+	if(!StoreChunk()) return false;
+
+	size_t first = chunks.empty() ? 0 : chunks.size() - 1;
+	for(size_t i = first; i < index; ++i)
+	{
+		if(i < chunks.size() && chunks[i].length == chunkSize) continue;
+		if(!LoadChunk(i)) return false;
+
+		plain.resize(chunkSize, 0);
+		dirty = true;
+	}
+
+	if(dataLength < (uint64_t)index * chunkSize) dataLength = (uint64_t)index * chunkSize;
+
+	return true;
+}
+
+size_t CryptKeeperZlib::Read(void *buffer, size_t count)
+{
+	if(!active) return keeper->Read(buffer, count);
+
+	size_t total = 0;
+	while(total < count && (uint64_t)offset < dataLength)
+	{
+		// stops short if a chunk can't be read back, or fails its check in the keeper
+		if(!LoadChunk(offset / chunkSize)) break;
+
+		size_t within = offset % chunkSize;
+		if(within >= plain.size()) break;
+
+		size_t length = plain.size() - within < count - total ? plain.size() - within : count - total;
+		memcpy((unsigned char *)buffer + total, &plain[within], length);
+
+		total += length;
+		offset += length;
+	}
+
+	return total;
+}
+
+size_t CryptKeeperZlib::Write(const void *buffer, size_t count)
+{
+	if(!active) return keeper->Write((void *)buffer, count);
+
+	size_t total = 0;
+	while(total < count)
+	{
+		// only the last chunk can be short, so it's only new chunks that might leave a gap
+		size_t index = offset / chunkSize;
+		if(index != current && index >= chunks.size() && !FillTo(index)) break;
+		if(!LoadChunk(index)) break;
+
+		size_t within = offset % chunkSize;
+		size_t length = chunkSize - within < count - total ? chunkSize - within : count - total;
+		if(plain.size() < within + length) plain.resize(within + length, 0);
+
+		memcpy(&plain[within], (const unsigned char *)buffer + total, length);
+		dirty = true;
+
+		total += length;
+		offset += length;
+		if((uint64_t)offset > dataLength) dataLength = offset;
+	}
+
+	return total;
+}
+
+void CryptKeeperZlib::Seek(int64_t position, int origin)
+{
+	if(!active)
+	{
+		keeper->Seek(position, origin);
+		return;
+	}
+
+	if(origin == SEEK_SET)
+		offset = position;
+	else if(origin == SEEK_END)
+		offset = dataLength + position;
+	else if(origin == SEEK_CUR)
+		offset += position;
+
+	if(offset < 0) offset = 0;
+}
+
+int64_t CryptKeeperZlib::Tell()
+{
+	return active ? offset : keeper->Tell();
+}
+
+size_t CryptKeeperZlib::GetDataLength()
+{
+	return active ? dataLength : keeper->GetDataLength();
+}
+
+bool CryptKeeperZlib::IsCompressed()
+{
+	return active;
+}
@@ -0,0 +1,93 @@
+#ifndef CryptKeeperZlib_h_included
+#define CryptKeeperZlib_h_included
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <vector>
+using namespace std;
+
+#include "CryptKeeper.h"
+
+/* Compress then encrypt.  The plaintext is cut into fixed size chunks, each chunk is
+ * deflated on its own, and the compressed chunks are what the keeper encrypts, so the
+ * cipher and the disk only see the compressed bytes.  A chunk that doesn't get smaller is
+ * stored as it is.  After the last chunk comes an index of where each one went, and a
+ * trailer, so a seek goes straight to the one chunk it needs:
+
+   chunk 0 | chunk 1 | ... | index | trailer
+
+   index entry (24 bytes)              trailer (32 bytes)
+   0  offset in the keeper's data       0  magic "\x89CKPZIX\n"
+   8  room set aside for it             8  chunk size
+  12  stored length                    12  chunk count
+  16  plaintext length                 16  plaintext length (64 bit)
+  20  reserved                         24  index offset (64 bit)
+
+ * A chunk that's rewritten goes back in its place if it still fits, or on the end if it
+ * doesn't; the space it leaves isn't reused.  New records go where the index was, and the
+ * index is written again after them by Close.  The header's FLAG_COMPRESSED says a file is
+ * one of these; files without it are passed straight through, so the same code reads both.
+ * The keeper does the chunk authentication as usual, over the compressed data.
+*/
+
+class CryptKeeperZlib
+{
+protected:
+	enum { ENTRY_SIZE = 24, TRAILER_SIZE = 32 };
+
+	struct ChunkEntry
+	{
+		uint64_t offset;
+		uint32_t capacity;
+		uint32_t stored;
+		uint32_t length;
+	};
+
+	CryptKeeper *keeper;
+	int level;
+	size_t chunkSize;
+
+	// false for a file that isn't compressed, when everything goes to the keeper as is
+	bool active;
+	// whether the index on disk is out of date
+	bool changed;
+	vector<ChunkEntry> chunks;
+	uint64_t dataLength;
+	// where the next new record goes, which is where the index starts
+	uint64_t recordEnd;
+	int64_t offset;
+
+	// the chunk being read or written, decompressed; current is -1 when there isn't one
+	size_t current;
+	bool dirty;
+	vector<unsigned char> plain;
+	vector<unsigned char> packed;
+
+	bool LoadIndex();
+	bool WriteIndex();
+	bool LoadChunk(size_t index);
+	bool StoreChunk();
+	bool FillTo(size_t index);
+
+public:
+	// level is a zlib compression level, Z_DEFAULT_COMPRESSION or 1 to 9
+	CryptKeeperZlib(CryptKeeper &ck, int compressionLevel = Z_DEFAULT_COMPRESSION, size_t chunkBytes = 65536);
+	~CryptKeeperZlib();
+
+	// Start on a keeper that's just been opened.  A compressed file has its index read; with
+	//  compressNew, a new empty file becomes a compressed one.  Anything else is passed through
+	//  to the keeper.  Returns false if the index is bad.
+	bool Open(bool compressNew);
+	// writes out the last chunk and the index, but leaves the keeper open
+	bool Close();
+
+	size_t Read(void *buffer, size_t count);
+	size_t Write(const void *buffer, size_t count);
+	void Seek(int64_t position, int origin);
+	int64_t Tell();
+	size_t GetDataLength();
+	bool IsCompressed();
+};
+
+#endif
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "DES.h"
+
 /******************************************
 ** DES-Implementation
 ** Author: B-Con (b-con@b-con.us)
@@ -179,7 +181,7 @@ void InvIP(uint state[], uchar in[])
 
 uint f(uint state, uchar key[])
 {
-   uchar lrgstate[6], i;
+   uchar lrgstate[6];
    uint t1, t2;
 
    // Expantion Permutation
@@ -281,15 +283,9 @@ void three_des_crypt(uchar in[], uchar out[], uchar key[][16][6])
 /************************************/
 
 
-bool encryptECB(unsigned char *key, int keyLength, 
-		unsigned char *data, int dataLength, unsigned char *output)
+// set up 24 byte key, repeating first 8 bytes as needed to fill
+static bool expand_key(unsigned char *key, int keyLength, unsigned char fullKey[24])
 {
-	if(dataLength % 8 != 0) return false;
-
-	unsigned char fullKey[24];
-	unsigned char schedule[3][16][6] = {0};
-
-	// set up 24 byte key, repeating first 8 bytes as needed to fill
 	switch(keyLength)
 	{
 		case 8:
@@ -308,47 +304,120 @@ bool encryptECB(unsigned char *key, int keyLength,
 			return(false);
 	}
 
-	three_des_key_schedule(fullKey, schedule, ENCRYPT);
+	return true;
+}
+
+// Build the key schedule once, and check for a degenerate key.  If K1 == K2 or K2 == K3 
+//  the E-D-E (or D-E-D) sequence cancels out to a single DES pass with the remaining key.
+bool initECB(DESContext &ctx, unsigned char *key, int keyLength, bool encrypt)
+{
+	unsigned char fullKey[24];
+	if(!expand_key(key, keyLength, fullKey)) return false;
+
+	memset(ctx.schedule, 0, sizeof(ctx.schedule));
+	three_des_key_schedule(fullKey, ctx.schedule, encrypt ? ENCRYPT : DECRYPT);
+
+	bool k1k2 = memcmp(fullKey, fullKey + 8, 8) == 0;
+	bool k2k3 = memcmp(fullKey + 8, fullKey + 16, 8) == 0;
+
+	// encrypt schedule is E(K1) D(K2) E(K3), decrypt schedule is D(K3) E(K2) D(K1)
+	if(k1k2)
+		ctx.singlePass = encrypt ? 2 : 0;
+	else if(k2k3)
+		ctx.singlePass = encrypt ? 0 : 2;
+	else
+		ctx.singlePass = -1;
+
+	return true;
+}
+
+static void context_crypt(DESContext &ctx, uchar in[], uchar out[])
+{
+	if(ctx.singlePass >= 0)
+		des_crypt(in, out, ctx.schedule[ctx.singlePass]);
+	else
+		three_des_crypt(in, out, ctx.schedule);
+}
+
+bool cryptECB(DESContext &ctx, unsigned char *data, int dataLength, unsigned char *output)
+{
+	if(dataLength % 8 != 0) return false;
 
 	for(int i = 0; i < dataLength; i += 8)
 	{
-		three_des_crypt(data + i, output + i, schedule);
+		context_crypt(ctx, data + i, output + i);
 	}
 
 	return true;
 }
 
-bool encryptCBC(unsigned char *key, int keyLength, 
-		unsigned char *data, int dataLength, unsigned char *output)
+// a degenerate key works out the same in OpenSSL, since E(K) D(K) cancel there too
+EVP_CIPHER_CTX *initEVP(unsigned char *key, int keyLength, bool encrypt)
 {
-	if(dataLength % 8 != 0) return false;
-
 	unsigned char fullKey[24];
-	unsigned char schedule[3][16][6] = {0};
+	if(!expand_key(key, keyLength, fullKey)) return NULL;
 
-	// set up 24 byte key, repeating first 8 bytes as needed to fill
-	switch(keyLength)
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(ctx == NULL) return NULL;
+
+	if(EVP_CipherInit_ex(ctx, EVP_des_ede3_ecb(), NULL, fullKey, NULL, encrypt ? 1 : 0) != 1)
 	{
-		case 8:
-			memcpy(fullKey, key, 8);
-			memcpy(fullKey + 8, key, 8);
-			memcpy(fullKey + 16, key, 8);
-			break;
-		case 16:
-			memcpy(fullKey, key, 16);
-			memcpy(fullKey + 16, key, 8);
-			break;
-		case 24:
-			memcpy(fullKey, key, 24);
-			break;
-		default:
-			return(false);
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
 	}
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+	return ctx;
+}
+
+bool cryptEVP(EVP_CIPHER_CTX *ctx, unsigned char *data, int dataLength, unsigned char *output)
+{
+	if(dataLength % 8 != 0) return false;
+
+	EVP_CIPHER_CTX *work = EVP_CIPHER_CTX_new();
+	if(work == NULL) return false;
+
+	int length = 0;
+	bool ok = EVP_CIPHER_CTX_copy(work, ctx) == 1 &&
+		EVP_CipherUpdate(work, output, &length, data, dataLength) == 1 && length == dataLength;
+
+	EVP_CIPHER_CTX_free(work);
+	return ok;
+}
+
+static int desKernel = DES_KERNEL_PORTABLE;
+
+void SetDESKernel(int kernel)
+{
+	if(kernel >= 0 && kernel < DES_KERNELS) desKernel = kernel;
+}
+
+int GetDESKernel()
+{
+	return desKernel;
+}
+
+bool encryptECB(unsigned char *key, int keyLength, 
+		unsigned char *data, int dataLength, unsigned char *output)
+{
+	if(dataLength % 8 != 0) return false;
 
-	three_des_key_schedule(fullKey, schedule, ENCRYPT);
+	DESContext ctx;
+	if(!initECB(ctx, key, keyLength, true)) return false;
+
+	return cryptECB(ctx, data, dataLength, output);
+}
+
+bool encryptCBC(unsigned char *key, int keyLength, 
+		unsigned char *data, int dataLength, unsigned char *output)
+{
+	if(dataLength % 8 != 0) return false;
+
+	DESContext ctx;
+	if(!initECB(ctx, key, keyLength, true)) return false;
 
 	// do fist 8 bytes normally (this assumes an IV of 0s)
-	three_des_crypt(data, output, schedule);
+	context_crypt(ctx, data, output);
 
 	// for the next eight bytes, XOR the previous 8 bytes
 	//  of output, then compress
@@ -358,7 +427,7 @@ bool encryptCBC(unsigned char *key, int keyLength,
 		for(int y = 0; y < 8; ++y)
 			xored[y] = output[i + y - 8] ^ data[i + y];
 
-		three_des_crypt(xored, output + i, schedule);
+		context_crypt(ctx, xored, output + i);
 	}
 
 	return true;
@@ -369,36 +438,10 @@ bool decryptECB(unsigned char *key, int keyLength,
 {
 	if(dataLength % 8 != 0) return false;
 
-	unsigned char fullKey[24];
-	unsigned char schedule[3][16][6] = {0};
+	DESContext ctx;
+	if(!initECB(ctx, key, keyLength, false)) return false;
 
-	// set up 24 byte key, repeating first 8 bytes as needed to fill
-	switch(keyLength)
-	{
-		case 8:
-			memcpy(fullKey, key, 8);
-			memcpy(fullKey + 8, key, 8);
-			memcpy(fullKey + 16, key, 8);
-			break;
-		case 16:
-			memcpy(fullKey, key, 16);
-			memcpy(fullKey + 16, key, 8);
-			break;
-		case 24:
-			memcpy(fullKey, key, 24);
-			break;
-		default:
-			return(false);
-	}
-
-	three_des_key_schedule(fullKey, schedule, DECRYPT);
-
-	for(int i = 0; i < dataLength; i += 8)
-	{
-		three_des_crypt(data + i, output + i, schedule);
-	}
-
-	return true;
+	return cryptECB(ctx, data, dataLength, output);
 }
 
 bool decryptCBC(unsigned char *key, int keyLength, 
@@ -406,39 +449,18 @@ bool decryptCBC(unsigned char *key, int keyLength,
 {
 	if(dataLength % 8 != 0) return false;
 
-	unsigned char fullKey[24];
-	unsigned char schedule[3][16][6] = {0};
-
-	// set up 24 byte key, repeating first 8 bytes as needed to fill
-	switch(keyLength)
-	{
-		case 8:
-			memcpy(fullKey, key, 8);
-			memcpy(fullKey + 8, key, 8);
-			memcpy(fullKey + 16, key, 8);
-			break;
-		case 16:
-			memcpy(fullKey, key, 16);
-			memcpy(fullKey + 16, key, 8);
-			break;
-		case 24:
-			memcpy(fullKey, key, 24);
-			break;
-		default:
-			return(false);
-	}
-
-	three_des_key_schedule(fullKey, schedule, DECRYPT);
+	DESContext ctx;
+	if(!initECB(ctx, key, keyLength, false)) return false;
 
 	// do fist 8 bytes normally (this assumes an IV of 0s)
-	three_des_crypt(data, output, schedule);
+	context_crypt(ctx, data, output);
 
 	// for the next eight bytes, decompress, then XOR the 
 	//  previous 8 bytes of input
 	unsigned char xored[8];
 	for(int i = 8; i < dataLength; i += 8)
 	{
-		three_des_crypt(data + i, xored, schedule);
+		context_crypt(ctx, data + i, xored);
 
 		for(int y = 0; y < 8; ++y)
 			output[i + y] = data[i + y - 8] ^ xored[y];
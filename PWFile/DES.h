@@ -1,6 +1,35 @@
+#ifndef DES_h_included
+#define DES_h_included
+
+#include <openssl/evp.h>
+
+/* Key schedule for triple DES, expanded once so it can be reused for every block.  
+ * singlePass is the index of the one schedule to use when the key degenerates to 
+ * single DES (K1 == K2 or K2 == K3), or -1 for a full triple DES pass. */
+struct DESContext
+{
+	unsigned char schedule[3][16][6];
+	int singlePass;
+};
+
+/* Key must be 8, 16, or 24 bytes, data must be padded to 8 byte boundary */
+bool initECB(DESContext &ctx, unsigned char *key, int keyLength, bool encrypt);
+bool cryptECB(DESContext &ctx, unsigned char *data, int dataLength, unsigned char *output);
+
+/* The same cipher from OpenSSL, for the same keys; NULL if this OpenSSL doesn't have 3DES.
+ * cryptEVP works on a copy of the context, so one context can be used by several threads. */
+EVP_CIPHER_CTX *initEVP(unsigned char *key, int keyLength, bool encrypt);
+bool cryptEVP(EVP_CIPHER_CTX *ctx, unsigned char *data, int dataLength, unsigned char *output);
+
+/* Which of the two new keys get, picked by the autotuner; the portable code until then. */
+enum { DES_KERNEL_PORTABLE = 0, DES_KERNEL_OPENSSL = 1, DES_KERNELS = 2 };
+void SetDESKernel(int kernel);
+int GetDESKernel();
+
 /* Output must be same length as input, key must be 8, 16, or 24 bits, input data must be padded to 8 byte boundary */
 bool encryptECB(unsigned char *key, int keyLength, unsigned char *data, int dataLength, unsigned char *output);
 bool decryptECB(unsigned char *key, int keyLength, unsigned char *data, int dataLength, unsigned char *output);
 bool encryptCBC(unsigned char *key, int keyLength, unsigned char *data, int dataLength, unsigned char *output);
 bool decryptCBC(unsigned char *key, int keyLength, unsigned char *data, int dataLength, unsigned char *output);
 
+#endif
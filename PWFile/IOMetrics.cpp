@@ -0,0 +1,99 @@
+#include "IOMetrics.h"
+
+static const char *counterNames[METRIC_COUNTERS] = {
+	"bytes_encrypted", "bytes_decrypted", "blocks_encrypted", "blocks_decrypted", "bytes_read",
+	"bytes_written", "read_calls", "write_calls", "rmw_blocks", "cache_hits", "cache_misses",
+	"header_ns", "cipher_ns", "io_ns"
+};
+
+static const char *operationNames[OP_COUNT] = { "open", "read", "write", "close" };
+
+atomic<bool> IOMetrics::processEnabled(false);
+
+IOMetrics::IOMetrics()
+{
+	Reset();
+}
+
+// bucket i holds latencies below 2^(i + 1) ns
+void IOMetrics::Record(MetricsOperation operation, uint64_t nanoseconds)
+{
+	int bucket = nanoseconds == 0 ? 0 : 63 - __builtin_clzll(nanoseconds);
+	if(bucket >= BUCKETS) bucket = BUCKETS - 1;
+
+	histograms[operation][bucket].fetch_add(1, memory_order_relaxed);
+}
+
+void IOMetrics::Reset()
+{
+	for(int i = 0; i < METRIC_COUNTERS; ++i)
+		counters[i].store(0, memory_order_relaxed);
+
+	for(int i = 0; i < OP_COUNT; ++i)
+		for(int j = 0; j < BUCKETS; ++j)
+			histograms[i][j].store(0, memory_order_relaxed);
+}
+
+uint64_t IOMetrics::Get(MetricsCounter counter)
+{
+	return counters[counter].load(memory_order_relaxed);
+}
+
+uint64_t IOMetrics::Count(MetricsOperation operation)
+{
+	uint64_t total = 0;
+	for(int i = 0; i < BUCKETS; ++i)
+		total += histograms[operation][i].load(memory_order_relaxed);
+
+	return total;
+}
+
+uint64_t IOMetrics::Percentile(MetricsOperation operation, double fraction)
+{
+	uint64_t total = Count(operation);
+	if(total == 0) return 0;
+
+	// the rank of the sample wanted, counting from 1
+	uint64_t rank = (uint64_t)(fraction * total + 0.5);
+	if(rank < 1) rank = 1;
+	if(rank > total) rank = total;
+
+	uint64_t seen = 0;
+	for(int i = 0; i < BUCKETS; ++i)
+	{
+		seen += histograms[operation][i].load(memory_order_relaxed);
+		if(seen >= rank) return 2ull << i;
+	}
+
+	return 2ull << (BUCKETS - 1);
+}
+
+void IOMetrics::Print(FILE *out)
+{
+	for(int i = 0; i < METRIC_COUNTERS; ++i)
+		fprintf(out, "%-18s %llu\n", counterNames[i], (unsigned long long)Get((MetricsCounter)i));
+
+	for(int i = 0; i < OP_COUNT; ++i)
+	{
+		MetricsOperation operation = (MetricsOperation)i;
+		fprintf(out, "%-18s count %llu  p50 < %lluns  p99 < %lluns  max < %lluns\n", operationNames[i],
+			(unsigned long long)Count(operation), (unsigned long long)Percentile(operation, 0.5),
+			(unsigned long long)Percentile(operation, 0.99), (unsigned long long)Percentile(operation, 1.0));
+	}
+}
+
+IOMetrics &IOMetrics::Process()
+{
+	static IOMetrics process;
+	return process;
+}
+
+void IOMetrics::EnableProcess(bool enable)
+{
+	processEnabled.store(enable);
+}
+
+bool IOMetrics::ProcessEnabled()
+{
+	return processEnabled.load();
+}
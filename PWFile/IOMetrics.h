@@ -0,0 +1,178 @@
+#ifndef IOMetrics_h_included
+#define IOMetrics_h_included
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+using namespace std;
+
+/* Counters and latency histograms for CryptKeeper.  Each keeper with metrics on has its own,
+ * and adds the same numbers into the process wide one too.  Everything is a relaxed atomic,
+ * so ReadAt and WriteAt on several threads can count at once; with metrics off the keeper
+ * only tests a NULL pointer, and never reads the clock.
+ *
+ * The latency histograms have a bucket for each power of two nanoseconds, so a percentile
+ * is only good to within a factor of two, which is enough to tell a page cache hit from a
+ * disk read.  Time is split between the header, the cipher, and the I/O syscalls; what's
+ * left of an operation is the cache, the MAC and copying.
+*/
+
+enum MetricsCounter
+{
+	// plaintext through the cipher, and the blocks it was in
+	METRIC_BYTES_ENCRYPTED,
+	METRIC_BYTES_DECRYPTED,
+	METRIC_BLOCKS_ENCRYPTED,
+	METRIC_BLOCKS_DECRYPTED,
+	// ciphertext to and from the file, and the calls that moved it: stdio, pread and pwrite 
+	//  calls, or io_uring extents.  Reads from a mapping count bytes but no calls.
+	METRIC_BYTES_READ,
+	METRIC_BYTES_WRITTEN,
+	METRIC_READ_CALLS,
+	METRIC_WRITE_CALLS,
+	// partial blocks that had to be read and decrypted before they could be written
+	METRIC_RMW_BLOCKS,
+	METRIC_CACHE_HITS,
+	METRIC_CACHE_MISSES,
+	METRIC_HEADER_NS,
+	METRIC_CIPHER_NS,
+	METRIC_IO_NS,
+	METRIC_COUNTERS
+};
+
+enum MetricsOperation
+{
+	// ReadAt, ReadV and ReadSpan count as reads, and WriteAt and WriteV as writes
+	OP_OPEN,
+	OP_READ,
+	OP_WRITE,
+	OP_CLOSE,
+	OP_COUNT
+};
+
+// given to the trace hook at the end of each operation; bytes is what was asked for
+struct TraceEvent
+{
+	MetricsOperation operation;
+	int64_t offset;
+	size_t bytes;
+	uint64_t nanoseconds;
+};
+
+typedef void (*TraceHook)(void *context, const TraceEvent &event);
+
+class IOMetrics
+{
+public:
+	enum { BUCKETS = 48 };
+
+protected:
+	atomic<uint64_t> counters[METRIC_COUNTERS];
+	atomic<uint64_t> histograms[OP_COUNT][BUCKETS];
+
+	static atomic<bool> processEnabled;
+
+public:
+	IOMetrics();
+
+	inline void Add(MetricsCounter counter, uint64_t value)
+	{
+		counters[counter].fetch_add(value, memory_order_relaxed);
+	}
+
+	void Record(MetricsOperation operation, uint64_t nanoseconds);
+	void Reset();
+
+	uint64_t Get(MetricsCounter counter);
+	uint64_t Count(MetricsOperation operation);
+	// upper bound of the bucket the fraction'th latency falls in, 0.5 for the median
+	uint64_t Percentile(MetricsOperation operation, double fraction);
+
+	// counters and p50/p99/max for each operation, one per line
+	void Print(FILE *out);
+
+	static inline uint64_t Now()
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+	}
+
+	// the sum over every keeper that had metrics on; with EnableProcess, keepers made from
+	//  then on start with their metrics on
+	static IOMetrics &Process();
+	static void EnableProcess(bool enable);
+	static bool ProcessEnabled();
+};
+
+// Adds the time from construction until it goes out of scope to one of the time counters,
+//  the keeper's and the process's.  Does nothing with no metrics.
+class MetricsTimer
+{
+protected:
+	IOMetrics *metrics;
+	MetricsCounter counter;
+	uint64_t start;
+
+public:
+	MetricsTimer(IOMetrics *keeperMetrics, MetricsCounter timeCounter)
+	{
+		metrics = keeperMetrics;
+		if(metrics == NULL) return;
+
+		counter = timeCounter;
+		start = IOMetrics::Now();
+	}
+
+	~MetricsTimer()
+	{
+		if(metrics == NULL) return;
+
+		uint64_t elapsed = IOMetrics::Now() - start;
+		metrics->Add(counter, elapsed);
+		IOMetrics::Process().Add(counter, elapsed);
+	}
+};
+
+// Times one operation into the histograms and the trace hook, from construction until it
+//  goes out of scope.  Does nothing when both are off.
+class OperationTimer
+{
+protected:
+	IOMetrics *metrics;
+	TraceHook hook;
+	void *context;
+	TraceEvent event;
+	uint64_t start;
+
+public:
+	OperationTimer(IOMetrics *keeperMetrics, TraceHook traceHook, void *traceContext, MetricsOperation operation,
+		int64_t offset, size_t bytes)
+	{
+		metrics = keeperMetrics;
+		hook = traceHook;
+		if(metrics == NULL && hook == NULL) return;
+
+		context = traceContext;
+		event.operation = operation;
+		event.offset = offset;
+		event.bytes = bytes;
+		start = IOMetrics::Now();
+	}
+
+	~OperationTimer()
+	{
+		if(metrics == NULL && hook == NULL) return;
+
+		event.nanoseconds = IOMetrics::Now() - start;
+		if(metrics != NULL)
+		{
+			metrics->Record(event.operation, event.nanoseconds);
+			IOMetrics::Process().Record(event.operation, event.nanoseconds);
+		}
+		if(hook != NULL) hook(context, event);
+	}
+};
+
+#endif
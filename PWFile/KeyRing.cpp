@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+#include <string>
+using namespace std;
+
+#include "KeyRing.h"
+#include "PBKDF2.h"
+#include "misc.h"
+
+KeyRing::KeyRing(const char *pw, unsigned int passes)
+{
+	password = pw;
+	iterations = passes;
+}
+
+KeyRing::~KeyRing()
+{
+}
+
+// made on first use, so a ring that only ever reads files doesn't need the random source
+vector<unsigned char> KeyRing::GetSalt()
+{
+	lock_guard<mutex> guard(lock);
+
+	if(salt.empty()) salt = GenerateRandom(SALT_LENGTH);
+
+	return salt;
+}
+
+unsigned int KeyRing::GetIterations()
+{
+	return iterations;
+}
+
+// the lock is held while stretching, so threads that want the same key wait for it rather
+//  than all making it
+vector<unsigned char> KeyRing::MasterKey(const vector<unsigned char> &masterSalt, unsigned int passes)
+{
+	lock_guard<mutex> guard(lock);
+
+	pair<vector<unsigned char>, unsigned int> id(masterSalt, passes);
+	map<pair<vector<unsigned char>, unsigned int>, vector<unsigned char> >::iterator it = masterKeys.find(id);
+	if(it != masterKeys.end()) return it->second;
+
+	vector<unsigned char> master = StretchKey(MASTER_KEY_LENGTH, passes, password, masterSalt);
+	masterKeys[id] = master;
+
+	return master;
+}
+
+vector<unsigned char> KeyRing::FileKey(const vector<unsigned char> &masterSalt, unsigned int passes,
+	const vector<unsigned char> &nonce, unsigned int length)
+{
+	static const char label[] = "CryptKeeper file key";
+	vector<unsigned char> info(label, label + sizeof(label) - 1);
+	info.insert(info.end(), nonce.begin(), nonce.end());
+
+	return ExpandKey(length, MasterKey(masterSalt, passes), info);
+}
@@ -0,0 +1,42 @@
+#ifndef KeyRing_h_included
+#define KeyRing_h_included
+
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+using namespace std;
+
+// Password keys for a whole session of files.  The password is stretched with PBKDF2 once
+//  per master salt, and each file's key is expanded from that master key and the file's
+//  nonce with a single HKDF, so encrypting many small files isn't bound by the KDF.  New
+//  files all share the session's random master salt; files from other sessions have their
+//  own salt in the header, and that master key is kept too once it's been made.  Safe to
+//  share between threads.
+class KeyRing
+{
+protected:
+	string password;
+	unsigned int iterations;
+	vector<unsigned char> salt;
+
+	// master keys by salt and iteration count
+	map<pair<vector<unsigned char>, unsigned int>, vector<unsigned char> > masterKeys;
+	mutex lock;
+
+public:
+	enum { MASTER_KEY_LENGTH = 32, SALT_LENGTH = 16 };
+
+	KeyRing(const char *pw, unsigned int passes);
+	~KeyRing();
+
+	// the salt and iteration count new files should record
+	vector<unsigned char> GetSalt();
+	unsigned int GetIterations();
+
+	vector<unsigned char> MasterKey(const vector<unsigned char> &masterSalt, unsigned int passes);
+	vector<unsigned char> FileKey(const vector<unsigned char> &masterSalt, unsigned int passes,
+		const vector<unsigned char> &nonce, unsigned int length);
+};
+
+#endif
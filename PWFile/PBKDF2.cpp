@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <vector>
+#include <string>
+using namespace std;
+
+#include "PBKDF2.h"
+
+static int kdfKernel = KDF_KERNEL_PORTABLE;
+
+void SetKDFKernel(int kernel)
+{
+	if(kernel >= 0 && kernel < KDF_KERNELS) kdfKernel = kernel;
+}
+
+int GetKDFKernel()
+{
+	return kdfKernel;
+}
+
+// performs a SHA1 hash on a vector of unsigned chars, using OpenSSL SHA1 function
+vector<unsigned char> SHA1(vector<unsigned char> input)
+{
+	vector<unsigned char> output;
+	output.resize(20);
+
+	::SHA1(&input[0], input.size(), &output[0]);
+
+	return output;
+}
+
+// HMAC function using SHA1.  
+// Test vector: HMAC_SHA1("", "") = fbdb1d1b18aa6c08324b7d64b71fb76370690e1d
+vector<unsigned char> HMAC_SHA1(vector<unsigned char> key, vector<unsigned char> message)
+{
+	if(kdfKernel == KDF_KERNEL_OPENSSL)
+	{
+		vector<unsigned char> digest(20);
+		unsigned int length = 0;
+		static const unsigned char empty = 0;
+
+		if(HMAC(EVP_sha1(), key.empty() ? &empty : &key[0], key.size(), 
+				message.empty() ? &empty : &message[0], message.size(), &digest[0], &length) != NULL && 
+				length == digest.size())
+			return digest;
+	}
+
+	// trim keys longer than SHA1 block size (64 bytes) by hashing
+	if(key.size() > 64) key = SHA1(key);
+	
+	// pad key up to SHA1 block size by adding zeros to the right
+	key.resize(64, 0);
+	
+	// create inner and outer keys by XORing
+	vector<unsigned char> outer;
+	vector<unsigned char> inner;
+	for(unsigned int i = 0; i < key.size(); ++i)
+	{
+		outer.push_back(0x5c ^ key[i]);
+		inner.push_back(0x36 ^ key[i]);
+	}
+
+	// concatenate inner key with message and hash
+	inner.insert(inner.end(), message.begin(), message.end());
+	message = SHA1(inner);
+
+	// concatenate outer key with previous step output and hash
+	outer.insert(outer.end(), message.begin(), message.end());
+	message = SHA1(outer);
+
+	// result is the 20 byte HMAC
+	return message;
+}
+
+// Key stretching function; takes a password and optional (but highly recommended) salt (128 bits 
+// recommended by NIST), plus an iteration count (recommended 4096) and generates a key of the given
+// length, which can then be used for a symmetric encryption algorithm such as 3DES or AES. 
+vector<unsigned char> StretchKey(unsigned int length, unsigned int passes, string password, 
+		vector<unsigned char> salt)
+{
+	if(kdfKernel == KDF_KERNEL_OPENSSL)
+	{
+		vector<unsigned char> key(length);
+		static const unsigned char empty = 0;
+
+		if(length == 0 || PKCS5_PBKDF2_HMAC_SHA1(password.c_str(), password.length(), 
+				salt.empty() ? &empty : &salt[0], salt.size(), passes, length, &key[0]) == 1)
+			return key;
+	}
+
+	// buffer to hold the hash input (and output), and the binary version of the password
+	vector<unsigned char> input;
+	vector<unsigned char> pwd;
+
+	// vector to hold generated key
+	vector<unsigned char> key;
+
+	// convert password into unsigned chars
+	for(unsigned int i = 0; i < password.length(); ++i)
+		pwd.push_back((unsigned char)password[i]);
+	
+	int blockIndex = 1;
+	while(key.size() < length)
+	{
+		// fill up input buffer with password + salt + block index
+		input.resize(0);
+	
+		// put salt in hash input, converted to binary
+		for(unsigned int i = 0; i < salt.size(); ++i)
+			input.push_back(salt[i]);
+		
+		// add four bytes of block index, most significant bit first
+		input.push_back((unsigned char)(blockIndex >> 24));
+		input.push_back((unsigned char)(blockIndex >> 16 & 0xFF));
+		input.push_back((unsigned char)(blockIndex >> 8 & 0xFF));
+		input.push_back((unsigned char)(blockIndex & 0xFF));
+
+		// zero out block accumulator
+		vector<unsigned char> output;
+		output.resize(20, 0);
+
+		// now repeat hashing operation the desired number of times
+		for(unsigned int i = passes; i > 0; --i)
+		{
+			// each pass will use the previous pass's output
+			input = HMAC_SHA1(pwd, input);
+
+			// XOR each step of the HMAC into output
+			for(unsigned int j = 0; j < input.size(); ++j)
+				output[j] ^= input[j];
+		}
+
+		// concatenate output onto key until we have enough bytes
+		key.insert(key.end(), output.begin(), output.end());
+
+		// increment the block index for the next block
+		++blockIndex;
+	}
+
+	// trim key to desired length
+	key.resize(length);
+
+	return key;
+}
+
+// HKDF-Expand (RFC 5869) with HMAC_SHA1; cheap, so good for making many keys from one key 
+// that's already been stretched.  The key should be uniformly random, like a PBKDF2 output, 
+// and info makes each derived key distinct.
+vector<unsigned char> ExpandKey(unsigned int length, vector<unsigned char> key, 
+		vector<unsigned char> info)
+{
+	vector<unsigned char> output;
+	vector<unsigned char> block;
+
+	for(unsigned char counter = 1; output.size() < length; ++counter)
+	{
+		// T(i) = HMAC(key, T(i - 1) | info | i)
+		block.insert(block.end(), info.begin(), info.end());
+		block.push_back(counter);
+		block = HMAC_SHA1(key, block);
+
+		output.insert(output.end(), block.begin(), block.end());
+	}
+
+	output.resize(length);
+
+	return output;
+}
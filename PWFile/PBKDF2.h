@@ -0,0 +1,23 @@
+#ifndef PBKDF2_h_included
+#define PBKDF2_h_included
+
+#include <vector>
+#include <string>
+using namespace std;
+
+// SHA1, HMAC_SHA1, PBKDF2 key stretching, and HKDF key expansion, shared by the password 
+//  based CryptKeepers
+vector<unsigned char> SHA1(vector<unsigned char> input);
+vector<unsigned char> HMAC_SHA1(vector<unsigned char> key, vector<unsigned char> message);
+vector<unsigned char> StretchKey(unsigned int length, unsigned int passes, string password, 
+	vector<unsigned char> salt);
+vector<unsigned char> ExpandKey(unsigned int length, vector<unsigned char> key, 
+	vector<unsigned char> info);
+
+// HMAC_SHA1 and StretchKey either use the portable code here, or OpenSSL's HMAC and PBKDF2; 
+//  the same keys either way.  The autotuner picks one at startup.
+enum { KDF_KERNEL_PORTABLE = 0, KDF_KERNEL_OPENSSL = 1, KDF_KERNELS = 2 };
+void SetKDFKernel(int kernel);
+int GetKDFKernel();
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef PasswordCryptKeeper_h_included
+#define PasswordCryptKeeper_h_included
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+using namespace std;
+
+#include "CryptKeeper.h"
+#include "KeyRing.h"
+#include "PBKDF2.h"
+
+/* A password on top of any keeper.  We can't create a key until we have a nonce to use as a
+ * salt, so the cipher starts out with a blank key, and DeriveKey stretches the password once
+ * the header is read or created.
+ *
+ * Cipher is the keeper the key is for, Self the class built on this one, so ChangePassword
+ * can make another, and KEY_LENGTH the length of key the cipher takes.  Files with a binary
+ * header carry their own KDF parameters; a key length other than KEY_LENGTH, an iteration
+ * count out of range, or a KDF we don't know leaves the keeper without a usable key, so Open
+ * fails rather than stretch with whatever a damaged or hostile header asks for.
+ */
+
+template <class Cipher, class Self, unsigned short KEY_LENGTH>
+class PasswordCryptKeeper : public Cipher
+{
+protected:
+	enum
+	{
+		DEFAULT_ITERATIONS = 4096,
+		MIN_ITERATIONS = 1000,
+		MAX_ITERATIONS = 10000000
+	};
+
+	string password;
+	KeyRing *keyRing;
+
+	// what new files and text header files use
+	void DefaultKDF()
+	{
+		this->kdfId = KDF_PBKDF2_SHA1;
+		this->kdfKeyLength = KEY_LENGTH;
+		this->kdfIterations = DEFAULT_ITERATIONS;
+		this->masterSalt.clear();
+	}
+
+	bool KDFUsable()
+	{
+		if(this->kdfId != KDF_PBKDF2_SHA1 && this->kdfId != KDF_KEYRING) return false;
+		if(this->kdfKeyLength != KEY_LENGTH) return false;
+
+		return this->kdfIterations >= MIN_ITERATIONS && this->kdfIterations <= MAX_ITERATIONS;
+	}
+
+public:
+	PasswordCryptKeeper(const char *pw) : Cipher(string(2 * KEY_LENGTH, '0').c_str())
+	{
+		password = pw;
+		keyRing = NULL;
+		DefaultKDF();
+	}
+
+	virtual ~PasswordCryptKeeper()
+	{
+	}
+
+	// the nonce is there once the header is read or created, so here is where we generate the key
+	virtual void DeriveKey()
+	{
+		// a new file (header not written yet) made with a keyring gets the session master salt;
+		//  nothing from a file this keeper opened before carries over
+		bool newFile = this->headerVersion == 2 && !this->headerWritten;
+		if(newFile || this->headerVersion == 1) DefaultKDF();
+		if(keyRing != NULL && newFile)
+		{
+			this->kdfId = KDF_KEYRING;
+			this->kdfIterations = keyRing->GetIterations();
+			this->masterSalt = keyRing->GetSalt();
+		}
+
+		if(!KDFUsable())
+		{
+			this->keyUsable = false;
+			return;
+		}
+
+		// everything the key is made from is copied, so it can be made on another thread
+		KeyRing *ring = keyRing;
+		string pw = password;
+		vector<unsigned char> salt = this->masterSalt;
+		vector<unsigned char> fileNonce = this->nonce;
+		unsigned short kdf = this->kdfId;
+		unsigned short length = this->kdfKeyLength;
+		unsigned int passes = this->kdfIterations;
+
+		this->MakeKey([=]() -> vector<unsigned char>
+		{
+			// the keyring files need the master key; without a ring that's one PBKDF2 just for this
+			if(kdf == KDF_KEYRING)
+			{
+				if(ring != NULL) return ring->FileKey(salt, passes, fileNonce, length);
+
+				KeyRing own(pw.c_str(), passes);
+				return own.FileKey(salt, passes, fileNonce, length);
+			}
+
+			return StretchKey(length, passes, pw, fileNonce);
+		});
+	}
+
+	// opt in to the keyring: new files get their key from the ring's master key, and files
+	//  that were made that way are opened without stretching the password again
+	void UseKeyRing(KeyRing *ring)
+	{
+		keyRing = ring;
+	}
+
+	// change the password of a file in place, on this many threads (0 for one per core),
+	//  without writing the plaintext anywhere; the file must not be open.  Files made after
+	//  UseKeyRing on newRing get keyring keys.  An interrupted change is finished by calling
+	//  this again with the same passwords.
+	bool ChangePassword(const char *filename, const char *newPassword, KeyRing *newRing, unsigned threads)
+	{
+		Self fresh(newPassword);
+		fresh.UseKeyRing(newRing);
+
+		return this->Rekey(filename, fresh, threads);
+	}
+};
+
+#endif
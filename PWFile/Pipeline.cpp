@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+using namespace std;
+
+#include "Pipeline.h"
+#include "BoundedQueue.h"
+
+struct PipelineChunk
+{
+	size_t sequence;
+	size_t offset;
+	size_t length;
+	vector<unsigned char> data;
+};
+
+// shared state for one run of the pipeline
+struct Pipeline
+{
+	CryptKeeper *ck;
+	FILE *fp;
+	bool encrypt;
+	size_t chunkSize;
+
+	// empty buffers, chunks waiting for a worker, and finished chunks waiting for the writer; 
+	//  a NULL on the work queue tells the workers to stop, and one on the done queue tells 
+	//  the writer that totalChunks is set
+	BoundedQueue<PipelineChunk *> freeChunks;
+	BoundedQueue<PipelineChunk *> work;
+	BoundedQueue<PipelineChunk *> done;
+
+	// set by the reader once it knows how many chunks there are
+	atomic<size_t> totalChunks;
+	atomic<bool> failed;
+
+	Pipeline(size_t capacity) : freeChunks(capacity), work(capacity), done(capacity)
+	{
+		totalChunks.store((size_t)-1);
+		failed.store(false);
+	}
+};
+
+// round up to a power of two for the queues
+static size_t QueueCapacity(size_t count)
+{
+	size_t capacity = 1;
+	while(capacity < count) capacity <<= 1;
+	return capacity;
+}
+
+static void ReaderStage(Pipeline *p, int threads)
+{
+	size_t sequence = 0;
+	size_t offset = 0;
+
+	while(!p->failed.load())
+	{
+		PipelineChunk *chunk = p->freeChunks.Pop();
+
+		if(p->encrypt)
+		{
+			chunk->data.resize(p->chunkSize);
+			chunk->length = fread((void *)&chunk->data[0], 1, p->chunkSize, p->fp);
+			chunk->data.resize(chunk->length);
+		}
+		else
+		{
+			chunk->length = p->ck->ReadChunk(chunk->data, offset, p->chunkSize);
+		}
+
+		if(chunk->length == 0)
+		{
+			p->freeChunks.Push(chunk);
+			break;
+		}
+
+		chunk->sequence = sequence++;
+		chunk->offset = offset;
+		offset += chunk->length;
+
+		p->work.Push(chunk);
+
+		// a short chunk is the end of the data
+		if(chunk->length < p->chunkSize) break;
+	}
+
+	// a read error, or a chunk that failed its check, stops us short of the end
+	if(p->encrypt ? ferror(p->fp) != 0 : offset < p->ck->GetDataLength()) p->failed.store(true);
+
+	p->totalChunks.store(sequence);
+	p->done.Push(NULL);
+
+	for(int i = 0; i < threads; ++i)
+		p->work.Push(NULL);
+}
+
+static void WorkerStage(Pipeline *p)
+{
+	for(;;)
+	{
+		PipelineChunk *chunk = p->work.Pop();
+		if(chunk == NULL) return;
+
+		// the chunk still goes on to the writer, which drops it once anything has failed
+		bool ok;
+		if(p->encrypt)
+			ok = p->ck->EncryptChunk(chunk->data, chunk->offset);
+		else
+			ok = p->ck->DecryptChunk(chunk->data, chunk->offset);
+		if(!ok) p->failed.store(true);
+
+		p->done.Push(chunk);
+	}
+}
+
+// runs on the calling thread; chunks can finish out of order, so hold on to them until the
+//  next one in sequence shows up
+static void WriterStage(Pipeline *p)
+{
+	map<size_t, PipelineChunk *> waiting;
+	size_t next = 0;
+
+	while(next < p->totalChunks.load())
+	{
+		PipelineChunk *chunk = p->done.Pop();
+		if(chunk == NULL) continue;
+
+		waiting[chunk->sequence] = chunk;
+
+		map<size_t, PipelineChunk *>::iterator it;
+		while((it = waiting.find(next)) != waiting.end())
+		{
+			chunk = it->second;
+			waiting.erase(it);
+
+			// once anything has failed, the rest of the output is no use
+			bool ok = !p->failed.load();
+			if(ok && p->encrypt)
+				ok = p->ck->WriteChunk(chunk->data, chunk->offset, chunk->length);
+			else if(ok)
+				ok = fwrite((void *)&chunk->data[0], 1, chunk->length, p->fp) == chunk->length;
+
+			if(!ok) p->failed.store(true);
+
+			p->freeChunks.Push(chunk);
+			++next;
+		}
+	}
+}
+
+static bool RunPipeline(CryptKeeper &ck, FILE *fp, bool encrypt, int threads, size_t chunkSize)
+{
+	if(threads < 1) threads = 1;
+
+	// chunk size has to stay block aligned for the counters to line up
+	size_t blockSize = ck.GetBlockSize();
+	chunkSize -= chunkSize % blockSize;
+	if(chunkSize == 0) chunkSize = blockSize;
+
+	// enough buffers to keep every worker busy while the reader and writer are on others
+	size_t buffers = 2 * threads + 2;
+	Pipeline p(QueueCapacity(buffers + threads));
+	p.ck = &ck;
+	p.fp = fp;
+	p.encrypt = encrypt;
+	p.chunkSize = chunkSize;
+
+	vector<PipelineChunk> pool(buffers);
+	for(size_t i = 0; i < buffers; ++i)
+		p.freeChunks.Push(&pool[i]);
+
+	thread reader(ReaderStage, &p, threads);
+	vector<thread> workers;
+	for(int i = 0; i < threads; ++i)
+		workers.push_back(thread(WorkerStage, &p));
+
+	WriterStage(&p);
+
+	reader.join();
+	for(int i = 0; i < threads; ++i)
+		workers[i].join();
+
+	return !p.failed.load();
+}
+
+bool PipelineEncrypt(CryptKeeper &ck, FILE *in, int threads, size_t chunkSize)
+{
+	return RunPipeline(ck, in, true, threads, chunkSize);
+}
+
+bool PipelineDecrypt(CryptKeeper &ck, FILE *out, int threads, size_t chunkSize)
+{
+	return RunPipeline(ck, out, false, threads, chunkSize);
+}
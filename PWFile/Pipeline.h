@@ -0,0 +1,21 @@
+#ifndef Pipeline_h_included
+#define Pipeline_h_included
+
+#include <stdio.h>
+#include <vector>
+using namespace std;
+
+#include "CryptKeeper.h"
+
+// Multi-threaded encrypt/decrypt of a whole file.  A reader stage feeds chunks to a set of 
+//  cipher workers, and an ordered writer stage puts them back in sequence; the stages are 
+//  connected by lock-free bounded queues, and a fixed pool of chunk buffers bounds memory.
+//  Each chunk is keyed by its own block counter, so the workers are independent.
+//  The CryptKeeper must already be open (with its key available).
+
+// plaintext from in, ciphertext into the open CryptKeeper
+bool PipelineEncrypt(CryptKeeper &ck, FILE *in, int threads, size_t chunkSize);
+// ciphertext from the open CryptKeeper, plaintext into out
+bool PipelineDecrypt(CryptKeeper &ck, FILE *out, int threads, size_t chunkSize);
+
+#endif
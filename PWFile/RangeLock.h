@@ -0,0 +1,61 @@
+#ifndef RangeLock_h_included
+#define RangeLock_h_included
+
+#include <stddef.h>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+// Locks on ranges [start, end) of blocks rather than the whole file.  Shared holders (readers)
+//  only wait for exclusive holders (writers) that overlap them, so writers to different parts 
+//  of the file, and any number of readers, can go at once.
+class RangeLock
+{
+protected:
+	struct Range
+	{
+		size_t start;
+		size_t end;
+		bool shared;
+	};
+
+	mutex lock;
+	condition_variable released;
+	list<Range> held;
+
+	bool Conflicts(size_t start, size_t end, bool shared)
+	{
+		for(list<Range>::iterator it = held.begin(); it != held.end(); ++it)
+		{
+			if(it->start < end && start < it->end && !(shared && it->shared)) return true;
+		}
+		return false;
+	}
+
+public:
+	void Lock(size_t start, size_t end, bool shared)
+	{
+		unique_lock<mutex> guard(lock);
+		while(Conflicts(start, end, shared)) released.wait(guard);
+
+		Range range = { start, end, shared };
+		held.push_back(range);
+	}
+
+	void Unlock(size_t start, size_t end, bool shared)
+	{
+		unique_lock<mutex> guard(lock);
+		for(list<Range>::iterator it = held.begin(); it != held.end(); ++it)
+		{
+			if(it->start == start && it->end == end && it->shared == shared)
+			{
+				held.erase(it);
+				break;
+			}
+		}
+		released.notify_all();
+	}
+};
+
+#endif
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+
+#include <vector>
+#include <string>
+using namespace std;
+
+#include "RekeyJournal.h"
+
+static const unsigned char journalMagic[8] = { 0x89, 'C', 'K', 'P', 'R', 'K', 'Y', '\n' };
+
+static void PutLE(unsigned char *dest, uint64_t value, int bytes)
+{
+	for(int i = 0; i < bytes; ++i)
+		dest[i] = (unsigned char)(value >> (8 * i));
+}
+
+static uint64_t GetLE(const unsigned char *source, int bytes)
+{
+	uint64_t value = 0;
+	for(int i = bytes - 1; i >= 0; --i)
+		value = (value << 8) | source[i];
+	return value;
+}
+
+static void Digest(const unsigned char *data, size_t length, unsigned char *digest)
+{
+	unsigned int digestLength = 0;
+	EVP_Digest(data, length, digest, &digestLength, EVP_sha256(), NULL);
+}
+
+static bool WriteAll(int fd, const unsigned char *buffer, size_t count, off_t position)
+{
+	size_t bytes = 0;
+	while(bytes < count)
+	{
+		ssize_t result = pwrite(fd, buffer + bytes, count - bytes, position + bytes);
+		if(result <= 0) return false;
+		bytes += result;
+	}
+
+	return true;
+}
+
+static bool ReadAll(int fd, unsigned char *buffer, size_t count, off_t position)
+{
+	size_t bytes = 0;
+	while(bytes < count)
+	{
+		ssize_t result = pread(fd, buffer + bytes, count - bytes, position + bytes);
+		if(result <= 0) return false;
+		bytes += result;
+	}
+
+	return true;
+}
+
+RekeyJournal::RekeyJournal()
+{
+	fd = -1;
+	window = WINDOW_SIZE;
+	sequence = 0;
+	windowStart = -1;
+	windowLength = 0;
+	keys.kdfId = 0;
+	keys.kdfKeyLength = 0;
+	keys.kdfIterations = 0;
+}
+
+RekeyJournal::~RekeyJournal()
+{
+	if(fd >= 0) close(fd);
+}
+
+// room for the hashes of a whole window, plus a part sector at each end
+size_t RekeyJournal::SlotSize()
+{
+	return SLOT_HASHES + (window / UNIT_SIZE + 2) * HASH_SIZE;
+}
+
+bool RekeyJournal::Create(const char *filename, const Keys &newKeys, size_t windowSize)
+{
+	if(newKeys.oldNonce.size() > 64 || newKeys.newNonce.size() > 64 || newKeys.masterSalt.size() > 32 ||
+		newKeys.keyCheck.size() != CHECK_SIZE)
+		return false;
+
+	name = filename;
+	keys = newKeys;
+	window = windowSize;
+	sequence = 0;
+	windowStart = -1;
+	windowLength = 0;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0) return false;
+
+	unsigned char header[JOURNAL_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+
+	memcpy(header + JOURNAL_MAGIC, journalMagic, sizeof(journalMagic));
+	PutLE(header + JOURNAL_WINDOW, window, 4);
+	PutLE(header + JOURNAL_OLD_NONCE_LENGTH, keys.oldNonce.size(), 2);
+	PutLE(header + JOURNAL_NEW_NONCE_LENGTH, keys.newNonce.size(), 2);
+	PutLE(header + JOURNAL_KDF, keys.kdfId, 2);
+	PutLE(header + JOURNAL_KDF_KEY_LENGTH, keys.kdfKeyLength, 2);
+	PutLE(header + JOURNAL_KDF_ITERATIONS, keys.kdfIterations, 4);
+	PutLE(header + JOURNAL_SALT_LENGTH, keys.masterSalt.size(), 2);
+	if(!keys.oldNonce.empty()) memcpy(header + JOURNAL_OLD_NONCE, &keys.oldNonce[0], keys.oldNonce.size());
+	if(!keys.newNonce.empty()) memcpy(header + JOURNAL_NEW_NONCE, &keys.newNonce[0], keys.newNonce.size());
+	if(!keys.masterSalt.empty()) memcpy(header + JOURNAL_MASTER_SALT, &keys.masterSalt[0], keys.masterSalt.size());
+	memcpy(header + JOURNAL_KEY_CHECK, &keys.keyCheck[0], CHECK_SIZE);
+	Digest(header, JOURNAL_CHECKSUM, header + JOURNAL_CHECKSUM);
+
+	// the slots start out empty, and empty slots never pass their checksum
+	vector<unsigned char> slots(2 * SlotSize(), 0);
+
+	return WriteAll(fd, header, sizeof(header), 0) &&
+		WriteAll(fd, &slots[0], slots.size(), JOURNAL_HEADER_SIZE) && fdatasync(fd) == 0;
+}
+
+bool RekeyJournal::Load(const char *filename)
+{
+	name = filename;
+	fd = open(filename, O_RDWR);
+	if(fd < 0) return false;
+
+	unsigned char header[JOURNAL_HEADER_SIZE];
+	unsigned char digest[32];
+	if(!ReadAll(fd, header, sizeof(header), 0)) return false;
+	if(memcmp(header + JOURNAL_MAGIC, journalMagic, sizeof(journalMagic)) != 0) return false;
+
+	Digest(header, JOURNAL_CHECKSUM, digest);
+	if(memcmp(digest, header + JOURNAL_CHECKSUM, sizeof(digest)) != 0) return false;
+
+	window = GetLE(header + JOURNAL_WINDOW, 4);
+	size_t oldLength = GetLE(header + JOURNAL_OLD_NONCE_LENGTH, 2);
+	size_t newLength = GetLE(header + JOURNAL_NEW_NONCE_LENGTH, 2);
+	size_t saltLength = GetLE(header + JOURNAL_SALT_LENGTH, 2);
+	if(window == 0 || window > 1024 * 1024 * 1024 || oldLength > 64 || newLength > 64 || saltLength > 32)
+		return false;
+
+	keys.kdfId = GetLE(header + JOURNAL_KDF, 2);
+	keys.kdfKeyLength = GetLE(header + JOURNAL_KDF_KEY_LENGTH, 2);
+	keys.kdfIterations = GetLE(header + JOURNAL_KDF_ITERATIONS, 4);
+	keys.oldNonce.assign(header + JOURNAL_OLD_NONCE, header + JOURNAL_OLD_NONCE + oldLength);
+	keys.newNonce.assign(header + JOURNAL_NEW_NONCE, header + JOURNAL_NEW_NONCE + newLength);
+	keys.masterSalt.assign(header + JOURNAL_MASTER_SALT, header + JOURNAL_MASTER_SALT + saltLength);
+	keys.keyCheck.assign(header + JOURNAL_KEY_CHECK, header + JOURNAL_KEY_CHECK + CHECK_SIZE);
+
+	// the newest slot that's intact is the window to recover
+	sequence = 0;
+	windowStart = -1;
+	windowLength = 0;
+	windowHashes.clear();
+
+	vector<unsigned char> slot(SlotSize());
+	for(int i = 0; i < 2; ++i)
+	{
+		if(!ReadAll(fd, &slot[0], slot.size(), JOURNAL_HEADER_SIZE + i * slot.size())) continue;
+
+		uint64_t slotSequence = GetLE(&slot[SLOT_SEQUENCE], 8);
+		size_t units = GetLE(&slot[SLOT_UNITS], 4);
+		if(slotSequence <= sequence || SLOT_HASHES + units * HASH_SIZE > slot.size()) continue;
+
+		memcpy(digest, &slot[SLOT_CHECKSUM], sizeof(digest));
+		memset(&slot[SLOT_CHECKSUM], 0, sizeof(digest));
+		unsigned char expected[32];
+		Digest(&slot[0], SLOT_HASHES + units * HASH_SIZE, expected);
+		if(memcmp(digest, expected, sizeof(digest)) != 0) continue;
+
+		sequence = slotSequence;
+		windowStart = GetLE(&slot[SLOT_START], 8);
+		windowLength = GetLE(&slot[SLOT_LENGTH], 8);
+		windowHashes.assign(slot.begin() + SLOT_HASHES, slot.begin() + SLOT_HASHES + units * HASH_SIZE);
+	}
+
+	return true;
+}
+
+bool RekeyJournal::Begin(int64_t start, size_t length, const vector<unsigned char> &hashes)
+{
+	if(fd < 0 || SLOT_HASHES + hashes.size() > SlotSize()) return false;
+
+	++sequence;
+
+	vector<unsigned char> slot(SLOT_HASHES + hashes.size(), 0);
+	PutLE(&slot[SLOT_SEQUENCE], sequence, 8);
+	PutLE(&slot[SLOT_START], start, 8);
+	PutLE(&slot[SLOT_LENGTH], length, 8);
+	PutLE(&slot[SLOT_UNITS], hashes.size() / HASH_SIZE, 4);
+	if(!hashes.empty()) memcpy(&slot[SLOT_HASHES], &hashes[0], hashes.size());
+	Digest(&slot[0], slot.size(), &slot[SLOT_CHECKSUM]);
+
+	windowStart = start;
+	windowLength = length;
+	windowHashes = hashes;
+
+	return WriteAll(fd, &slot[0], slot.size(), JOURNAL_HEADER_SIZE + (sequence % 2) * SlotSize()) &&
+		fdatasync(fd) == 0;
+}
+
+bool RekeyJournal::Remove()
+{
+	if(fd >= 0) close(fd);
+	fd = -1;
+
+	return unlink(name.c_str()) == 0;
+}
+
+const RekeyJournal::Keys &RekeyJournal::GetKeys()
+{
+	return keys;
+}
+
+size_t RekeyJournal::GetWindow()
+{
+	return window;
+}
+
+int64_t RekeyJournal::GetStart()
+{
+	return windowStart;
+}
+
+size_t RekeyJournal::GetLength()
+{
+	return windowLength;
+}
+
+const vector<unsigned char> &RekeyJournal::GetHashes()
+{
+	return windowHashes;
+}
+
+size_t RekeyJournal::UnitCount(int64_t position, size_t length)
+{
+	if(length == 0) return 0;
+
+	return (position + length + UNIT_SIZE - 1) / UNIT_SIZE - position / UNIT_SIZE;
+}
+
+void RekeyJournal::UnitRange(int64_t position, size_t length, size_t index, size_t &start, size_t &end)
+{
+	int64_t unitStart = (position / UNIT_SIZE + index) * UNIT_SIZE;
+	int64_t unitEnd = unitStart + UNIT_SIZE;
+
+	start = unitStart > position ? unitStart - position : 0;
+	end = unitEnd < position + (int64_t)length ? unitEnd - position : length;
+}
+
+void RekeyJournal::HashUnits(int64_t position, const unsigned char *data, size_t length, vector<unsigned char> &hashes)
+{
+	size_t units = UnitCount(position, length);
+	hashes.resize(units * HASH_SIZE);
+
+	for(size_t i = 0; i < units; ++i)
+	{
+		size_t start, end;
+		UnitRange(position, length, i, start, end);
+
+		unsigned char digest[32];
+		Digest(data + start, end - start, digest);
+		memcpy(&hashes[i * HASH_SIZE], digest, HASH_SIZE);
+	}
+}
+
+bool RekeyJournal::UnitMatches(int64_t position, const unsigned char *data, size_t length, size_t index,
+	const vector<unsigned char> &hashes)
+{
+	if((index + 1) * HASH_SIZE > hashes.size()) return false;
+
+	size_t start, end;
+	UnitRange(position, length, index, start, end);
+
+	unsigned char digest[32];
+	Digest(data + start, end - start, digest);
+
+	return memcmp(digest, &hashes[index * HASH_SIZE], HASH_SIZE) == 0;
+}
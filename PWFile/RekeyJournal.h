@@ -0,0 +1,122 @@
+#ifndef RekeyJournal_h_included
+#define RekeyJournal_h_included
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+using namespace std;
+
+/* Crash recovery journal for rekeying a file in place.  The ciphertext is rewritten a
+ * window at a time; before a window goes out, its slot in the journal gets a hash of
+ * every 512 byte sector of the new ciphertext, and is synced.  After a crash, each sector
+ * of the window that was in flight either matches its hash and is new, or doesn't and is
+ * still old, so nothing but the hashes has to be written twice.  Everything before the
+ * window is new, everything after it old.  Two slots take turns, so a slot torn by the
+ * crash leaves the previous window, which is all on disk.
+
+   0  magic "\x89CKPRKY\n"          96  new nonce, up to 64 bytes
+   8  window size                   160  master salt, up to 32 bytes
+  12  old nonce length              192  new key check (16 bytes)
+  14  new nonce length              208  reserved
+  16  KDF id                        224  SHA-256 of the above
+  18  KDF key length                256  slot 0
+  20  KDF iterations                     slot 1
+  24  master salt length
+  32  old nonce, up to 64 bytes
+
+ * A slot is its sequence number, the plaintext offset and ciphertext length of the window,
+ * the sector count, a SHA-256 over the slot, then the sector hashes.  A window starting at
+ * the end of the data means the data is all done, and only the tags and header are left.
+
+*/
+
+class RekeyJournal
+{
+public:
+	enum { UNIT_SIZE = 512, HASH_SIZE = 16, CHECK_SIZE = 16, WINDOW_SIZE = 4 * 1024 * 1024 };
+
+	// what a resumed rekey needs to make the same new key again
+	struct Keys
+	{
+		vector<unsigned char> oldNonce;
+		vector<unsigned char> newNonce;
+		vector<unsigned char> masterSalt;
+		vector<unsigned char> keyCheck;
+		unsigned short kdfId;
+		unsigned short kdfKeyLength;
+		unsigned int kdfIterations;
+	};
+
+protected:
+	enum JournalField
+	{
+		JOURNAL_MAGIC = 0,
+		JOURNAL_WINDOW = 8,
+		JOURNAL_OLD_NONCE_LENGTH = 12,
+		JOURNAL_NEW_NONCE_LENGTH = 14,
+		JOURNAL_KDF = 16,
+		JOURNAL_KDF_KEY_LENGTH = 18,
+		JOURNAL_KDF_ITERATIONS = 20,
+		JOURNAL_SALT_LENGTH = 24,
+		JOURNAL_OLD_NONCE = 32,
+		JOURNAL_NEW_NONCE = 96,
+		JOURNAL_MASTER_SALT = 160,
+		JOURNAL_KEY_CHECK = 192,
+		JOURNAL_CHECKSUM = 224,
+		JOURNAL_HEADER_SIZE = 256
+	};
+
+	enum SlotField
+	{
+		SLOT_SEQUENCE = 0,
+		SLOT_START = 8,
+		SLOT_LENGTH = 16,
+		SLOT_UNITS = 24,
+		SLOT_CHECKSUM = 32,
+		SLOT_HASHES = 64
+	};
+
+	string name;
+	int fd;
+	Keys keys;
+	size_t window;
+
+	// the last window written, and its sector hashes
+	uint64_t sequence;
+	int64_t windowStart;
+	size_t windowLength;
+	vector<unsigned char> windowHashes;
+
+	size_t SlotSize();
+
+public:
+	RekeyJournal();
+	~RekeyJournal();
+
+	// start a new journal, synced before returning
+	bool Create(const char *filename, const Keys &newKeys, size_t windowSize);
+	// pick up the journal a rekey left behind; false if there isn't a usable one
+	bool Load(const char *filename);
+	// record the window about to be written over, and sync it
+	bool Begin(int64_t start, size_t length, const vector<unsigned char> &hashes);
+	// the rekey is finished
+	bool Remove();
+
+	const Keys &GetKeys();
+	size_t GetWindow();
+	// where to carry on from; -1 if no window was started
+	int64_t GetStart();
+	size_t GetLength();
+	const vector<unsigned char> &GetHashes();
+
+	// sectors are counted from the start of the file, so position is the file offset of the
+	//  data; UnitRange gives the bytes of data that fall in its index'th sector
+	static size_t UnitCount(int64_t position, size_t length);
+	static void UnitRange(int64_t position, size_t length, size_t index, size_t &start, size_t &end);
+	static void HashUnits(int64_t position, const unsigned char *data, size_t length, vector<unsigned char> &hashes);
+	static bool UnitMatches(int64_t position, const unsigned char *data, size_t length, size_t index,
+		const vector<unsigned char> &hashes);
+};
+
+#endif
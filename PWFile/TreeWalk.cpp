@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+using namespace std;
+
+#include "TreeWalk.h"
+#include "WorkPool.h"
+#include "CryptKeeperPW.h"
+#include "CryptKeeperZlib.h"
+#include "KeyRing.h"
+
+// shared state for one run over a tree
+struct TreeRun
+{
+	WorkPool *pool;
+	string password;
+	KeyRing *ring;
+	bool encrypt;
+	bool keyring;
+	size_t chunkSize;
+
+	atomic<size_t> filesFound;
+	atomic<size_t> filesDone;
+	atomic<size_t> filesFailed;
+	atomic<uint64_t> bytesDone;
+	mutex reportLock;
+};
+
+// one file in flight; the last of its chunks to finish closes it
+struct TreeFile
+{
+	TreeRun *run;
+	string source;
+	string target;
+	// output goes here first, and is only renamed over the target once it's all good
+	string temp;
+	CryptKeeperPW ck;
+	// the plaintext side: the file we read for encrypting, or write for decrypting
+	int fd;
+	uint64_t length;
+	// compressed files can't be split up, and decrypt as one task
+	bool compressed;
+	atomic<size_t> remaining;
+	atomic<bool> failed;
+	string error;
+	mutex errorLock;
+
+	TreeFile(TreeRun *r, const char *password) : run(r), ck(password), fd(-1), length(0), compressed(false)
+	{
+		remaining.store(0);
+		failed.store(false);
+	}
+};
+
+static bool EndsWith(const string &s, const char *suffix)
+{
+	size_t length = strlen(suffix);
+	return s.length() > length && s.compare(s.length() - length, length, suffix) == 0;
+}
+
+static void Fail(TreeFile *file, const string &error)
+{
+	lock_guard<mutex> guard(file->errorLock);
+	if(!file->failed.exchange(true)) file->error = error;
+}
+
+static void Report(TreeRun *run, const char *format, const char *path, const char *error)
+{
+	lock_guard<mutex> guard(run->reportLock);
+	fprintf(stderr, format, path, error);
+}
+
+static void FinishFile(TreeFile *file)
+{
+	TreeRun *run = file->run;
+
+	if(!file->ck.Close()) Fail(file, "write failed");
+	if(file->fd >= 0 && close(file->fd) != 0) Fail(file, strerror(errno));
+
+	if(!file->failed.load() && rename(file->temp.c_str(), file->target.c_str()) != 0)
+		Fail(file, strerror(errno));
+
+	if(file->failed.load())
+	{
+		unlink(file->temp.c_str());
+		++run->filesFailed;
+		Report(run, "\nfailed: %s: %s\n", file->source.c_str(), file->error.c_str());
+	}
+
+	++run->filesDone;
+}
+
+static bool WriteOut(int fd, const unsigned char *buffer, size_t length, uint64_t offset)
+{
+	size_t bytes = 0;
+	while(bytes < length)
+	{
+		ssize_t result = pwrite(fd, buffer + bytes, length - bytes, offset + bytes);
+		if(result < 0 && errno == EINTR) continue;
+		if(result <= 0) break;
+		bytes += result;
+	}
+
+	return bytes == length;
+}
+
+static void Unpack(shared_ptr<TreeFile> file)
+{
+	CryptKeeperZlib zc(file->ck);
+	vector<unsigned char> buffer(file->run->chunkSize);
+
+	if(!zc.Open(false))
+	{
+		Fail(file.get(), "bad compression index");
+		return;
+	}
+
+	uint64_t offset = 0;
+	while(!file->failed.load() && offset < zc.GetDataLength())
+	{
+		size_t length = zc.Read(&buffer[0], buffer.size());
+		if(length == 0)
+		{
+			Fail(file.get(), file->ck.IntegrityFailed() ? "failed integrity check" : "can't decompress");
+			break;
+		}
+
+		if(!WriteOut(file->fd, &buffer[0], length, offset)) Fail(file.get(), strerror(errno));
+
+		offset += length;
+		file->run->bytesDone += length;
+	}
+}
+
+static void DoChunk(shared_ptr<TreeFile> file, size_t index)
+{
+	TreeRun *run = file->run;
+	uint64_t offset = (uint64_t)index * run->chunkSize;
+	size_t length = file->length - offset < run->chunkSize ? file->length - offset : run->chunkSize;
+
+	static thread_local vector<unsigned char> buffer;
+	if(buffer.size() < length) buffer.resize(length);
+
+	if(file->compressed)
+	{
+		if(!file->failed.load()) Unpack(file);
+	}
+	else if(!file->failed.load() && length > 0)
+	{
+		if(run->encrypt)
+		{
+			size_t bytes = 0;
+			while(bytes < length)
+			{
+				ssize_t result = pread(file->fd, &buffer[bytes], length - bytes, offset + bytes);
+				if(result < 0 && errno == EINTR) continue;
+				if(result <= 0) break;
+				bytes += result;
+			}
+
+			if(bytes < length) Fail(file.get(), "short read");
+			else if(file->ck.WriteAt(offset, &buffer[0], length) != length) Fail(file.get(), "write failed");
+		}
+		else
+		{
+			if(file->ck.ReadAt(offset, &buffer[0], length) != length)
+			{
+				Fail(file.get(), file->ck.IntegrityFailed() ? "failed integrity check" : "short read");
+			}
+			else if(!WriteOut(file->fd, &buffer[0], length, offset))
+			{
+				Fail(file.get(), strerror(errno));
+			}
+		}
+
+		run->bytesDone += length;
+	}
+
+	if(--file->remaining == 0) FinishFile(file.get());
+}
+
+static void StartFile(TreeRun *run, const string &path)
+{
+	shared_ptr<TreeFile> file(new TreeFile(run, run->password.c_str()));
+	file->source = path;
+
+	// decrypting only reads, so sharing the ring can't change how files are made
+	if(!run->encrypt || run->keyring) file->ck.UseKeyRing(run->ring);
+
+	if(run->encrypt)
+	{
+		// still ends in .enc, so the walk won't pick it up as a file to encrypt
+		file->target = path + ".enc";
+		file->temp = path + ".partial.enc";
+
+		struct stat st;
+		file->fd = open(path.c_str(), O_RDONLY);
+		if(file->fd < 0 || fstat(file->fd, &st) != 0)
+		{
+			Report(run, "\nfailed: %s: %s\n", path.c_str(), strerror(errno));
+			if(file->fd >= 0) close(file->fd);
+			++run->filesFailed;
+			++run->filesDone;
+			return;
+		}
+
+		file->length = st.st_size;
+		if(!file->ck.Open(file->temp.c_str(), "w"))
+		{
+			Fail(file.get(), "can't create " + file->temp);
+			file->length = 0;
+		}
+		else
+		{
+			file->ck.Reserve(file->length);
+		}
+	}
+	else
+	{
+		file->target = path.substr(0, path.length() - 4);
+		file->temp = file->target + ".partial";
+
+		if(!file->ck.Open(path.c_str(), "r"))
+		{
+			Report(run, "\nfailed: %s: %s\n", path.c_str(), "can't open");
+			++run->filesFailed;
+			++run->filesDone;
+			return;
+		}
+
+		// old text header files have nothing to check the data against
+		if(!file->ck.IsAuthenticated())
+			Report(run, "\nwarning: %s: %s\n", path.c_str(), "no integrity data, not checked");
+
+		file->length = file->ck.GetDataLength();
+		file->compressed = file->ck.IsCompressed();
+		file->fd = open(file->temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if(file->fd < 0)
+		{
+			Fail(file.get(), "can't create " + file->temp);
+			file->length = 0;
+		}
+	}
+
+	size_t chunks = (file->length + run->chunkSize - 1) / run->chunkSize;
+	if(chunks == 0 || file->compressed) chunks = 1;
+	file->remaining.store(chunks);
+
+	// the rest go on our own deque for idle workers to steal, and we start on the first
+	for(size_t i = 1; i < chunks; ++i)
+		run->pool->Submit([file, i]() { DoChunk(file, i); });
+
+	DoChunk(file, 0);
+}
+
+static void WalkDirectory(TreeRun *run, const string &path)
+{
+	DIR *dir = opendir(path.c_str());
+	if(dir == NULL)
+	{
+		Report(run, "\nfailed: %s: %s\n", path.c_str(), strerror(errno));
+		return;
+	}
+
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL)
+	{
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+		string child = path + "/" + entry->d_name;
+
+		// symlinks are left alone, so a link can't take us out of the tree or round in a loop
+		struct stat st;
+		if(lstat(child.c_str(), &st) != 0) continue;
+
+		if(S_ISDIR(st.st_mode))
+		{
+			run->pool->Submit([run, child]() { WalkDirectory(run, child); });
+		}
+		else if(S_ISREG(st.st_mode) && EndsWith(child, ".enc") != run->encrypt)
+		{
+			++run->filesFound;
+			run->pool->Submit([run, child]() { StartFile(run, child); });
+		}
+	}
+
+	closedir(dir);
+}
+
+static bool RunTree(const char *root, const char *password, bool encrypt, bool keyring,
+	unsigned threads, size_t chunkSize)
+{
+	if(threads == 0) threads = 2 * thread::hardware_concurrency();
+	if(threads == 0) threads = 4;
+
+	// chunks have to line up with the authentication chunks for WriteAt to tag them directly
+	if(chunkSize < 65536) chunkSize = 65536;
+	chunkSize -= chunkSize % 65536;
+
+	KeyRing ring(password, 4096);
+	WorkPool pool(threads);
+
+	TreeRun run;
+	run.pool = &pool;
+	run.password = password;
+	run.ring = &ring;
+	run.encrypt = encrypt;
+	run.keyring = keyring;
+	run.chunkSize = chunkSize;
+	run.filesFound.store(0);
+	run.filesDone.store(0);
+	run.filesFailed.store(0);
+	run.bytesDone.store(0);
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	string top = root;
+	while(top.length() > 1 && top[top.length() - 1] == '/') top.erase(top.length() - 1);
+	pool.Submit([&run, top]() { WalkDirectory(&run, top); });
+
+	// progress once a second on a terminal; the pool tells us when it's all done
+	bool finished = false;
+	mutex progressLock;
+	condition_variable progressDone;
+
+	thread progress([&]()
+	{
+		bool terminal = isatty(2);
+		unique_lock<mutex> lock(progressLock);
+		while(!progressDone.wait_for(lock, chrono::seconds(1), [&]() { return finished; }))
+		{
+			if(!terminal) continue;
+
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			double megabytes = run.bytesDone.load() / 1048576.0;
+
+			lock_guard<mutex> guard(run.reportLock);
+			fprintf(stderr, "\r%zu/%zu files, %.1f MB, %.1f MB/s   ", run.filesDone.load(),
+				run.filesFound.load(), megabytes, megabytes / seconds);
+		}
+	});
+
+	pool.Wait();
+
+	{
+		lock_guard<mutex> guard(progressLock);
+		finished = true;
+	}
+	progressDone.notify_all();
+	progress.join();
+
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	double megabytes = run.bytesDone.load() / 1048576.0;
+	fprintf(stderr, "\r%zu files, %zu failed, %.1f MB in %.1f s, %.1f MB/s\n", run.filesDone.load(),
+		run.filesFailed.load(), megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+
+	return run.filesFailed.load() == 0;
+}
+
+bool EncryptTree(const char *root, const char *password, bool keyring, unsigned threads, size_t chunkSize)
+{
+	return RunTree(root, password, true, keyring, threads, chunkSize);
+}
+
+bool DecryptTree(const char *root, const char *password, unsigned threads, size_t chunkSize)
+{
+	return RunTree(root, password, false, false, threads, chunkSize);
+}
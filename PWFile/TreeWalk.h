@@ -0,0 +1,22 @@
+#ifndef TreeWalk_h_included
+#define TreeWalk_h_included
+
+#include <stddef.h>
+
+// Encrypt or decrypt every file under a directory.  Directories are walked in parallel on a
+//  work-stealing pool, each file is a task, and files larger than chunkSize are split into
+//  chunk tasks that go through the thread safe ReadAt/WriteAt, so one huge file spreads over
+//  every worker instead of holding one up.  Encrypting makes name.enc next to each file that
+//  doesn't already end in .enc; decrypting does the reverse.  Each output is written under a
+//  temporary name and renamed into place when it's complete, so a failure (a wrong password,
+//  say) never clobbers an existing file.  Progress and any failures go to
+//  stderr; returns false if any file failed.
+//
+//  More threads than cores helps keep the storage queue full.  With keyring set, new files
+//  get keyring keys (see KeyRing.h); decrypting always shares one keyring, so keyring files
+//  only stretch the password once.  Compressed files (see CryptKeeperZlib.h) are decrypted
+//  whole by one worker.
+bool EncryptTree(const char *root, const char *password, bool keyring, unsigned threads, size_t chunkSize);
+bool DecryptTree(const char *root, const char *password, unsigned threads, size_t chunkSize);
+
+#endif
@@ -0,0 +1,125 @@
+#include "WorkPool.h"
+
+// which pool's worker this thread is, if any, and its deque
+static thread_local WorkPool *currentPool = NULL;
+static thread_local size_t currentIndex = 0;
+
+WorkPool::WorkPool(unsigned threads)
+{
+	if(threads == 0) threads = 1;
+
+	nextQueue.store(0);
+	queued = 0;
+	stopping = false;
+	pending = 0;
+
+	for(unsigned i = 0; i < threads; ++i)
+		queues.push_back(new Queue());
+
+	for(unsigned i = 0; i < threads; ++i)
+		workers.push_back(thread(&WorkPool::WorkerLoop, this, i));
+}
+
+WorkPool::~WorkPool()
+{
+	Wait();
+
+	{
+		lock_guard<mutex> guard(idleLock);
+		stopping = true;
+	}
+	idle.notify_all();
+
+	for(size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+
+	for(size_t i = 0; i < queues.size(); ++i)
+		delete queues[i];
+}
+
+size_t WorkPool::Threads()
+{
+	return workers.size();
+}
+
+void WorkPool::Submit(function<void()> task)
+{
+	{
+		lock_guard<mutex> guard(doneLock);
+		++pending;
+	}
+
+	// counted before it's in a deque, so a worker that takes it straight away can't take the
+	//  count below zero; one that wakes before the push just looks again
+	{
+		lock_guard<mutex> guard(idleLock);
+		++queued;
+	}
+
+	size_t index = (currentPool == this) ? currentIndex : nextQueue++ % queues.size();
+	{
+		lock_guard<mutex> guard(queues[index]->lock);
+		queues[index]->tasks.push_back(task);
+	}
+	idle.notify_one();
+}
+
+void WorkPool::Wait()
+{
+	unique_lock<mutex> lock(doneLock);
+	done.wait(lock, [this]() { return pending == 0; });
+}
+
+// newest from our own deque, otherwise the oldest from someone else's
+bool WorkPool::TakeTask(size_t index, function<void()> &task)
+{
+	for(size_t i = 0; i < queues.size(); ++i)
+	{
+		Queue *queue = queues[(index + i) % queues.size()];
+		lock_guard<mutex> guard(queue->lock);
+		if(queue->tasks.empty()) continue;
+
+		if(i == 0)
+		{
+			task = queue->tasks.back();
+			queue->tasks.pop_back();
+		}
+		else
+		{
+			task = queue->tasks.front();
+			queue->tasks.pop_front();
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+void WorkPool::WorkerLoop(size_t index)
+{
+	currentPool = this;
+	currentIndex = index;
+
+	for(;;)
+	{
+		function<void()> task;
+		if(TakeTask(index, task))
+		{
+			{
+				lock_guard<mutex> guard(idleLock);
+				--queued;
+			}
+
+			task();
+
+			lock_guard<mutex> guard(doneLock);
+			if(--pending == 0) done.notify_all();
+			continue;
+		}
+
+		unique_lock<mutex> lock(idleLock);
+		idle.wait(lock, [this]() { return queued > 0 || stopping; });
+		if(stopping && queued == 0) return;
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef WorkPool_h_included
+#define WorkPool_h_included
+
+#include <stddef.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+using namespace std;
+
+// Work-stealing thread pool.  Each worker has its own deque; tasks submitted from a worker go
+//  on the back of its own deque and it takes from the back, so related work stays on one
+//  thread, while idle workers steal the oldest tasks from the front of the others' deques.
+//  Tasks submitted from outside the pool are dealt out round robin.
+class WorkPool
+{
+protected:
+	struct Queue
+	{
+		mutex lock;
+		deque<function<void()> > tasks;
+	};
+
+	vector<Queue *> queues;
+	vector<thread> workers;
+	atomic<size_t> nextQueue;
+
+	// tasks waiting in the deques, or about to be, guarded by idleLock for sleeping workers
+	size_t queued;
+	bool stopping;
+	mutex idleLock;
+	condition_variable idle;
+
+	// tasks submitted and not finished yet
+	size_t pending;
+	mutex doneLock;
+	condition_variable done;
+
+	void WorkerLoop(size_t index);
+	bool TakeTask(size_t index, function<void()> &task);
+
+public:
+	WorkPool(unsigned threads);
+	~WorkPool();
+
+	void Submit(function<void()> task);
+	// wait for every task, including any that tasks submit while running
+	void Wait();
+	size_t Threads();
+};
+
+#endif
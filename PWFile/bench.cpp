@@ -0,0 +1,836 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+using namespace std;
+
+#include "CryptKeeperDES.h"
+#include "CryptKeeperPW.h"
+#include "CryptKeeperAES.h"
+#include "CryptKeeperAESPW.h"
+#include "Autotune.h"
+#include "PBKDF2.h"
+
+/* Benchmarks for encrypted file I/O.  Each cipher runs sequential writes and reads, random
+ * reads of a few sizes, small appends, small overwrites (read-modify-write), and open/close,
+ * over each file size; the positional reads and overwrites also run on each thread count.
+ * Results go out as JSON, one object per test, so runs can be kept and compared.
+ *
+ * With -x, a few self checks run on each cipher instead, for the cases the benchmarks 
+ * can't see going wrong.
+ */
+
+static const char *desKey = "0123456789abcdeffedcba987654321089abcdef01234567";
+static const char *aesKey = "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f";
+static const char *password = "benchmark password";
+
+struct Result
+{
+	string cipher;
+	string test;
+	size_t fileSize;
+	size_t ioSize;
+	unsigned threads;
+	size_t ops;
+	size_t bytes;
+	double seconds;
+};
+
+static vector<Result> results;
+static double duration = 1.0;
+static string directory = "/tmp";
+
+static double Now()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static CryptKeeper *MakeKeeper(const string &cipher)
+{
+	if(cipher == "des") return new CryptKeeperDES(desKey);
+	if(cipher == "pw") return new CryptKeeperPW(password);
+	if(cipher == "aes") return new CryptKeeperAES(aesKey);
+	if(cipher == "aespw") return new CryptKeeperAESPW(password);
+	return NULL;
+}
+
+// the same cipher with some other key, for the checks
+static CryptKeeper *MakeWrongKeeper(const string &cipher)
+{
+	if(cipher == "des") return new CryptKeeperDES(aesKey + 16);
+	if(cipher == "pw") return new CryptKeeperPW("wrong password");
+	if(cipher == "aes") return new CryptKeeperAES(desKey + 16);
+	if(cipher == "aespw") return new CryptKeeperAESPW("wrong password");
+	return NULL;
+}
+
+static void Record(const string &cipher, const string &test, size_t fileSize, size_t ioSize, unsigned threads,
+	size_t ops, size_t bytes, double seconds)
+{
+	Result result = { cipher, test, fileSize, ioSize, threads, ops, bytes, seconds };
+	results.push_back(result);
+
+	// progress on stderr, so stdout is just the JSON
+	fprintf(stderr, "%-6s %-16s %10zu %7zu %2u  %9.2f MB/s %11.1f ops/s\n", cipher.c_str(), test.c_str(),
+		fileSize, ioSize, threads, seconds > 0 ? bytes / seconds / 1048576.0 : 0.0, seconds > 0 ? ops / seconds : 0.0);
+}
+
+static void SequentialWrite(const string &cipher, const string &filename, size_t fileSize)
+{
+	const size_t ioSize = 65536;
+	vector<unsigned char> buffer(ioSize, 0x5a);
+
+	// Open is left out, as open_close has the cost of key stretching
+	CryptKeeper *ck = MakeKeeper(cipher);
+	ck->Open(filename.c_str(), "w");
+
+	double start = Now();
+	size_t ops = 0;
+	for(size_t done = 0; done < fileSize; done += ioSize, ++ops)
+		ck->Write(&buffer[0], fileSize - done < ioSize ? fileSize - done : ioSize);
+	ck->Close();
+
+	Record(cipher, "seq_write", fileSize, ioSize, 1, ops, fileSize, Now() - start);
+	delete ck;
+}
+
+static void SequentialRead(const string &cipher, const string &filename, size_t fileSize)
+{
+	const size_t ioSize = 65536;
+	vector<unsigned char> buffer(ioSize);
+
+	CryptKeeper *ck = MakeKeeper(cipher);
+	ck->Open(filename.c_str(), "r");
+
+	double start = Now();
+	size_t ops = 0;
+	size_t bytes = 0;
+	for(size_t length = ioSize; length == ioSize; ++ops)
+	{
+		length = ck->Read(&buffer[0], ioSize);
+		bytes += length;
+	}
+	double seconds = Now() - start;
+
+	ck->Close();
+	Record(cipher, "seq_read", fileSize, ioSize, 1, ops, bytes, seconds);
+	delete ck;
+}
+
+// Seek and Read, the way a single threaded caller does it
+static void RandomRead(const string &cipher, const string &filename, size_t fileSize, size_t ioSize)
+{
+	if(ioSize > fileSize) return;
+	vector<unsigned char> buffer(ioSize);
+
+	CryptKeeper *ck = MakeKeeper(cipher);
+	ck->Open(filename.c_str(), "r");
+
+	unsigned int seed = 1;
+	double start = Now();
+	double end = start + duration;
+	size_t ops = 0;
+
+	do
+	{
+		ck->Seek(rand_r(&seed) % (fileSize - ioSize + 1), SEEK_SET);
+		ck->Read(&buffer[0], ioSize);
+		++ops;
+	} while(Now() < end);
+
+	Record(cipher, "random_read", fileSize, ioSize, 1, ops, ops * ioSize, Now() - start);
+	ck->Close();
+	delete ck;
+}
+
+// ReadAt or WriteAt from several threads on one open file
+static void Positional(const string &cipher, const string &filename, size_t fileSize, size_t ioSize,
+	unsigned threads, bool write)
+{
+	if(ioSize > fileSize) return;
+
+	CryptKeeper *ck = MakeKeeper(cipher);
+	if(write && !ck->CanOverwrite())
+	{
+		delete ck;
+		return;
+	}
+	ck->Open(filename.c_str(), write ? "r+" : "r");
+
+	atomic<size_t> ops(0);
+	double start = Now();
+	double end = start + duration;
+
+	vector<thread> workers;
+	for(unsigned t = 0; t < threads; ++t)
+	{
+		workers.push_back(thread([&, t]()
+		{
+			vector<unsigned char> buffer(ioSize, 0xa5);
+			unsigned int seed = t + 1;
+			size_t count = 0;
+
+			do
+			{
+				size_t offset = rand_r(&seed) % (fileSize - ioSize + 1);
+				if(write) ck->WriteAt(offset, &buffer[0], ioSize);
+				else ck->ReadAt(offset, &buffer[0], ioSize);
+				++count;
+			} while(Now() < end);
+
+			ops += count;
+		}));
+	}
+
+	for(size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+	double seconds = Now() - start;
+
+	ck->Close();
+	Record(cipher, write ? "overwrite_at" : "random_read_at", fileSize, ioSize, threads, ops, ops * ioSize, seconds);
+	delete ck;
+}
+
+// small unaligned overwrites with Seek and Write; every one reads, decrypts and rewrites
+//  the blocks at its edges
+static void Overwrite(const string &cipher, const string &filename, size_t fileSize, size_t ioSize)
+{
+	if(ioSize > fileSize) return;
+	vector<unsigned char> buffer(ioSize, 0x3c);
+
+	CryptKeeper *ck = MakeKeeper(cipher);
+	if(!ck->CanOverwrite())
+	{
+		delete ck;
+		return;
+	}
+	ck->Open(filename.c_str(), "r+");
+
+	unsigned int seed = 7;
+	double start = Now();
+	double end = start + duration;
+	size_t ops = 0;
+
+	do
+	{
+		ck->Seek(rand_r(&seed) % (fileSize - ioSize + 1), SEEK_SET);
+		ck->Write(&buffer[0], ioSize);
+		++ops;
+	} while(Now() < end);
+
+	// the last write is still pending until here
+	ck->Close();
+	Record(cipher, "overwrite", fileSize, ioSize, 1, ops, ops * ioSize, Now() - start);
+	delete ck;
+}
+
+// log style appends, each one opened in "a" mode, written and closed
+static void Append(const string &cipher, const string &filename, size_t ioSize)
+{
+	vector<unsigned char> buffer(ioSize, 0x11);
+	unlink(filename.c_str());
+
+	double start = Now();
+	double end = start + duration;
+	size_t ops = 0;
+
+	do
+	{
+		CryptKeeper *ck = MakeKeeper(cipher);
+		ck->Open(filename.c_str(), "a");
+		ck->Write(&buffer[0], ioSize);
+		ck->Close();
+		delete ck;
+		++ops;
+	} while(Now() < end);
+
+	Record(cipher, "append", 0, ioSize, 1, ops, ops * ioSize, Now() - start);
+	unlink(filename.c_str());
+}
+
+// open and close for reading; for the password classes this is mostly key stretching
+static void OpenClose(const string &cipher, const string &filename, size_t fileSize)
+{
+	double start = Now();
+	double end = start + duration;
+	size_t ops = 0;
+
+	do
+	{
+		CryptKeeper *ck = MakeKeeper(cipher);
+		ck->Open(filename.c_str(), "r");
+		ck->Close();
+		delete ck;
+		++ops;
+	} while(Now() < end);
+
+	Record(cipher, "open_close", fileSize, 0, 1, ops, 0, Now() - start);
+}
+
+static bool CheckFailed(const string &cipher, const char *what)
+{
+	fprintf(stderr, "%-6s check failed: %s\n", cipher.c_str(), what);
+	return false;
+}
+
+// A file cut short in the tag table, the ciphertext, or just past the header has to fail to
+//  open or fail its integrity check, in both read modes and with the key made either way,
+//  rather than crash or read back as good.
+static bool CheckTruncated(const string &cipher, const string &filename)
+{
+	const size_t fileSize = 200000;
+	vector<unsigned char> buffer(fileSize, 0x42);
+
+	CryptKeeper *ck = MakeKeeper(cipher);
+	ck->Open(filename.c_str(), "w");
+	ck->Write(&buffer[0], fileSize);
+	ck->Close();
+	delete ck;
+
+	struct stat st;
+	if(stat(filename.c_str(), &st) != 0) return CheckFailed(cipher, "can't write the file");
+
+	// longest first, since each cut is made to the same file
+	off_t cuts[] = { st.st_size - 16, HEADER_V2_SIZE + (off_t)fileSize / 2, HEADER_V2_SIZE + 8 };
+	const char *modes[] = { "r", "rm" };
+	bool ok = true;
+
+	for(size_t c = 0; c < sizeof(cuts) / sizeof(cuts[0]); ++c)
+	{
+		if(truncate(filename.c_str(), cuts[c]) != 0) return CheckFailed(cipher, "can't truncate the file");
+
+		for(size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m)
+		{
+			for(int background = 0; background < 2; ++background)
+			{
+				ck = MakeKeeper(cipher);
+				ck->DeriveKeyInBackground(background != 0);
+				if(ck->Open(filename.c_str(), modes[m]))
+				{
+					size_t bytes = ck->VerifyKey() ? ck->Read(&buffer[0], fileSize) : 0;
+					bool failed = ck->IntegrityFailed();
+					ck->Close();
+
+					if(bytes == fileSize || !failed) ok = CheckFailed(cipher, "truncated file read back as good");
+				}
+				delete ck;
+			}
+		}
+	}
+
+	unlink(filename.c_str());
+	return ok;
+}
+
+// A header with a field that doesn't parse, a nonce of the wrong length or another cipher's 
+//  id, has to fail every open mode, rather than give a keeper with nothing to check its key
+//  against.  So does one too short for the fixed fields, or with the chunk tags switched off.
+static bool CheckBadHeader(const string &cipher, const string &filename)
+{
+	const size_t fileSize = 4096;
+	vector<unsigned char> buffer(fileSize, 0x21);
+	int fields[] = { HEADER_NONCE_LENGTH, HEADER_CIPHER, HEADER_SIZE, HEADER_FLAGS };
+	unsigned char values[][2] = { { 0x07, 0x7f }, { 0x07, 0x7f }, { 0x80, 0x00 }, { FLAG_KEY_CHECK, 0x00 } };
+	const char *modes[] = { "r", "rm", "r+", "a", "a+" };
+	bool ok = true;
+
+	for(size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); ++f)
+	{
+		CryptKeeper *ck = MakeKeeper(cipher);
+		ck->Open(filename.c_str(), "w");
+		ck->Write(&buffer[0], fileSize);
+		ck->Close();
+		delete ck;
+
+		int fd = open(filename.c_str(), O_WRONLY);
+		bool patched = fd >= 0 && pwrite(fd, values[f], 2, fields[f]) == 2;
+		if(fd >= 0) close(fd);
+		if(!patched) return CheckFailed(cipher, "can't patch the header");
+
+		for(size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m)
+		{
+			ck = MakeKeeper(cipher);
+			if(ck->Open(filename.c_str(), modes[m]))
+			{
+				ok = CheckFailed(cipher, "a header that doesn't parse opened");
+				ck->Close();
+			}
+			delete ck;
+		}
+	}
+
+	unlink(filename.c_str());
+	return ok;
+}
+
+// The password classes take their KDF parameters from the header, so a key length the cipher
+//  doesn't take, an iteration count out of range or an unknown KDF has to fail the open, 
+//  rather than stretch with whatever the header asks for.
+static bool CheckBadKDF(const string &cipher, const string &filename)
+{
+	if(cipher != "pw" && cipher != "aespw") return true;
+
+	vector<unsigned char> buffer(4096, 0x33);
+	int fields[] = { HEADER_KDF_KEY_LENGTH, HEADER_KDF_ITERATIONS, HEADER_KDF_ITERATIONS, HEADER_KDF };
+	uint32_t values[] = { 8, 20000000, 10, 0x7777 };
+	int sizes[] = { 2, 4, 4, 2 };
+	bool ok = true;
+
+	for(size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); ++f)
+	{
+		CryptKeeper *ck = MakeKeeper(cipher);
+		ck->Open(filename.c_str(), "w");
+		ck->Write(&buffer[0], buffer.size());
+		ck->Close();
+		delete ck;
+
+		unsigned char bad[4] = { (unsigned char)values[f], (unsigned char)(values[f] >> 8),
+			(unsigned char)(values[f] >> 16), (unsigned char)(values[f] >> 24) };
+		int fd = open(filename.c_str(), O_WRONLY);
+		bool patched = fd >= 0 && pwrite(fd, bad, sizes[f], fields[f]) == sizes[f];
+		if(fd >= 0) close(fd);
+		if(!patched) return CheckFailed(cipher, "can't patch the header");
+
+		ck = MakeKeeper(cipher);
+		if(ck->Open(filename.c_str(), "r"))
+		{
+			ok = CheckFailed(cipher, "a header with bad KDF parameters opened");
+			ck->Close();
+		}
+		delete ck;
+
+		ck = MakeKeeper(cipher);
+		ck->DeriveKeyInBackground(true);
+		if(ck->Open(filename.c_str(), "r") && ck->Read(&buffer[0], buffer.size()) != 0)
+			ok = CheckFailed(cipher, "a header with bad KDF parameters read back");
+		ck->Close();
+		delete ck;
+	}
+
+	unlink(filename.c_str());
+	return ok;
+}
+
+// An append that starts part way through a block carries the old data in front of it along
+//  into the new chunk tag.  With a flipped bit in that old data, the append has to fail, not 
+//  tag over the damage so the file reads back as good.
+static bool CheckPartialBlock(const string &cipher, const string &filename)
+{
+	const size_t fileSize = 65536 + 5;
+	vector<unsigned char> buffer(fileSize + 70000, 0x5a);
+
+	CryptKeeper *ck = MakeKeeper(cipher);
+	ck->Open(filename.c_str(), "w");
+	ck->Write(&buffer[0], fileSize);
+	ck->Close();
+	delete ck;
+
+	unsigned char byte;
+	off_t position = HEADER_V2_SIZE + fileSize - 4;
+	int fd = open(filename.c_str(), O_RDWR);
+	bool patched = fd >= 0 && pread(fd, &byte, 1, position) == 1;
+	byte ^= 0x01;
+	patched = patched && pwrite(fd, &byte, 1, position) == 1;
+	if(fd >= 0) close(fd);
+	if(!patched) return CheckFailed(cipher, "can't patch the ciphertext");
+
+	ck = MakeKeeper(cipher);
+	ck->Open(filename.c_str(), "a");
+	ck->Write(&buffer[fileSize], 70000);
+	ck->Close();
+	delete ck;
+
+	vector<unsigned char> back(buffer.size());
+	ck = MakeKeeper(cipher);
+	size_t bytes = ck->Open(filename.c_str(), "r") ? ck->Read(&back[0], back.size()) : 0;
+	bool failed = ck->IntegrityFailed();
+	ck->Close();
+	delete ck;
+
+	unlink(filename.c_str());
+	if(!failed && bytes >= fileSize) return CheckFailed(cipher, "damage in front of an append was tagged over");
+	return true;
+}
+
+// A keystream cipher has to refuse every kind of write over data that's already there, take
+//  appends that start part way through a block, and leave nothing but zeros on disk past the
+//  end of the data.
+static bool CheckRewrite(const string &cipher, const string &filename)
+{
+	CryptKeeper *ck = MakeKeeper(cipher);
+	bool overwrite = ck->CanOverwrite();
+	delete ck;
+	if(overwrite) return true;
+
+	const size_t fileSize = 1000;
+	vector<unsigned char> buffer(fileSize + 100);
+	for(size_t i = 0; i < buffer.size(); ++i) buffer[i] = (unsigned char)(i * 7 + 1);
+	bool ok = true;
+
+	ck = MakeKeeper(cipher);
+	ck->Open(filename.c_str(), "w");
+	ck->Write(&buffer[0], fileSize - 10);
+	ck->Seek(0, SEEK_SET);
+	if(ck->Write(&buffer[0], 10) != 0) ok = CheckFailed(cipher, "Write over data just written went through");
+	ck->Seek(fileSize - 10, SEEK_SET);
+	ck->Write(&buffer[fileSize - 10], 10);
+	ck->Close();
+	delete ck;
+
+	// the last block is only part data, and the rest of it has to be zeros on disk
+	size_t blockEnd = (fileSize + 15) / 16 * 16;
+	vector<unsigned char> tail(blockEnd - fileSize);
+	int fd = open(filename.c_str(), O_RDONLY);
+	bool read = fd >= 0 && pread(fd, &tail[0], tail.size(), HEADER_V2_SIZE + fileSize) == (ssize_t)tail.size();
+	if(fd >= 0) close(fd);
+	if(!read || tail != vector<unsigned char>(tail.size(), 0)) ok = CheckFailed(cipher, "padding went out as keystream");
+
+	ck = MakeKeeper(cipher);
+	ck->Open(filename.c_str(), "r+");
+	if(ck->Write(&buffer[0], 10) != 0) ok = CheckFailed(cipher, "Write over data in r+ went through");
+	if(ck->WriteAt(fileSize - 1, &buffer[0], 2) != 0) ok = CheckFailed(cipher, "WriteAt over the end of the data went through");
+	IORange ranges[2] = { { fileSize + 50, &buffer[0], 10, 0 }, { 500, &buffer[0], 10, 0 } };
+	if(ck->WriteV(ranges, 2) != 0) ok = CheckFailed(cipher, "WriteV over data went through");
+	ck->Close();
+	delete ck;
+
+	ck = MakeKeeper(cipher);
+	ck->Open(filename.c_str(), "a");
+	if(ck->Write(&buffer[fileSize], 100) != 100) ok = CheckFailed(cipher, "append was refused");
+	ck->Close();
+	delete ck;
+
+	vector<unsigned char> back(buffer.size() + 1);
+	ck = MakeKeeper(cipher);
+	size_t bytes = ck->Open(filename.c_str(), "r") ? ck->Read(&back[0], back.size()) : 0;
+	bool failed = ck->IntegrityFailed();
+	ck->Close();
+	delete ck;
+
+	back.resize(bytes);
+	if(failed || back != buffer) ok = CheckFailed(cipher, "appended file didn't read back");
+
+	unlink(filename.c_str());
+	return ok;
+}
+
+// With the wrong key the pipeline's chunk calls have to fail rather than hand back garbage; 
+//  a key made in the background lets the open through, and is only turned away once it's in.
+static bool CheckWrongKey(const string &cipher, const string &filename)
+{
+	vector<unsigned char> buffer(10000, 0x42);
+
+	CryptKeeper *ck = MakeKeeper(cipher);
+	ck->Open(filename.c_str(), "w");
+	ck->Write(&buffer[0], buffer.size());
+	ck->Close();
+	delete ck;
+
+	bool ok = true;
+	ck = MakeWrongKeeper(cipher);
+	ck->DeriveKeyInBackground(true);
+	ck->Open(filename.c_str(), "r");
+	if(ck->DecryptChunk(buffer, 0)) ok = CheckFailed(cipher, "DecryptChunk took the wrong key");
+	if(ck->EncryptChunk(buffer, 0)) ok = CheckFailed(cipher, "EncryptChunk took the wrong key");
+	ck->Close();
+	delete ck;
+
+	return ok;
+}
+
+static bool CheckCount(const string &cipher, const char *name, uint64_t value, uint64_t expected)
+{
+	if(value == expected) return true;
+
+	fprintf(stderr, "%-6s check failed: %s is %llu, expected %llu\n", cipher.c_str(), name, 
+		(unsigned long long)value, (unsigned long long)expected);
+	return false;
+}
+
+// A fixed pattern of WriteAt and ReadAt on a new file, with the counters it has to give: a
+//  64K aligned write, an unaligned 40 byte overwrite that reads and rewrites a partial block
+//  at each end, and an aligned 1K read.  The new file's chunks are all dirty, so nothing is
+//  read to check tags.
+static bool CheckMetrics(const string &cipher, const string &filename)
+{
+	vector<unsigned char> buffer(65536, 0x6b);
+
+	CryptKeeper *ck = MakeKeeper(cipher);
+	ck->EnableMetrics(true);
+	IOMetrics *metrics = ck->GetMetrics();
+	uint64_t processWritten = IOMetrics::Process().Get(METRIC_BYTES_WRITTEN);
+
+	// a keystream cipher can't write over the first write, so its partial blocks go past the 
+	//  end, where there's nothing to read back
+	size_t second = ck->CanOverwrite() ? 100 : 65536 + 100;
+	size_t rmwBytes = ck->CanOverwrite() ? 2 * ck->GetBlockSize() : 0;
+
+	ck->Open(filename.c_str(), "w");
+	ck->WriteAt(0, &buffer[0], 65536);
+	ck->WriteAt(second, &buffer[0], 40);
+	ck->ReadAt(0, &buffer[0], 1024);
+
+	size_t block = ck->GetBlockSize();
+	size_t overwriteBlocks = (second + 40 + block - 1) / block - second / block;
+
+	bool ok = true;
+	ok = CheckCount(cipher, "bytes_written", metrics->Get(METRIC_BYTES_WRITTEN), 65536 + overwriteBlocks * block) && ok;
+	ok = CheckCount(cipher, "write_calls", metrics->Get(METRIC_WRITE_CALLS), 2) && ok;
+	ok = CheckCount(cipher, "bytes_read", metrics->Get(METRIC_BYTES_READ), rmwBytes + 1024) && ok;
+	ok = CheckCount(cipher, "read_calls", metrics->Get(METRIC_READ_CALLS), 3) && ok;
+	ok = CheckCount(cipher, "rmw_blocks", metrics->Get(METRIC_RMW_BLOCKS), 2) && ok;
+	ok = CheckCount(cipher, "blocks_encrypted", metrics->Get(METRIC_BLOCKS_ENCRYPTED), 65536 / block + overwriteBlocks) && ok;
+	ok = CheckCount(cipher, "blocks_decrypted", metrics->Get(METRIC_BLOCKS_DECRYPTED), 2 + 1024 / block) && ok;
+	ok = CheckCount(cipher, "bytes_decrypted", metrics->Get(METRIC_BYTES_DECRYPTED), 2 * block + 1024) && ok;
+	ok = CheckCount(cipher, "process bytes_written", IOMetrics::Process().Get(METRIC_BYTES_WRITTEN) - processWritten,
+		metrics->Get(METRIC_BYTES_WRITTEN)) && ok;
+
+	ck->Close();
+	ok = CheckCount(cipher, "open count", metrics->Count(OP_OPEN), 1) && ok;
+	ok = CheckCount(cipher, "write count", metrics->Count(OP_WRITE), 2) && ok;
+	ok = CheckCount(cipher, "read count", metrics->Count(OP_READ), 1) && ok;
+	ok = CheckCount(cipher, "close count", metrics->Count(OP_CLOSE), 1) && ok;
+
+	delete ck;
+	unlink(filename.c_str());
+	return ok;
+}
+
+// each percentile is the upper bound of a power of two bucket, so it has to bracket the 
+//  sample at that rank: more than it, and no more than twice it
+static bool CheckPercentiles()
+{
+	IOMetrics metrics;
+	for(int i = 0; i < 99; ++i) metrics.Record(OP_READ, 1000);
+	metrics.Record(OP_READ, 1000000);
+	metrics.Record(OP_WRITE, 0);
+
+	double fractions[] = { 0.01, 0.5, 0.99, 1.0 };
+	uint64_t samples[] = { 1000, 1000, 1000, 1000000 };
+	bool ok = CheckCount("", "read count", metrics.Count(OP_READ), 100);
+
+	for(size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); ++i)
+	{
+		uint64_t bound = metrics.Percentile(OP_READ, fractions[i]);
+		if(bound <= samples[i] || bound > 2 * samples[i])
+		{
+			fprintf(stderr, "percentile %.2f is %llu, which doesn't bracket %llu\n", fractions[i], 
+				(unsigned long long)bound, (unsigned long long)samples[i]);
+			ok = false;
+		}
+	}
+
+	if(metrics.Percentile(OP_WRITE, 1.0) == 0 || metrics.Percentile(OP_CLOSE, 0.5) != 0)
+		ok = CheckFailed("", "percentile of a zero sample or of no samples");
+
+	return ok;
+}
+
+static size_t ParseSize(const string &text)
+{
+	char *end = NULL;
+	double value = strtod(text.c_str(), &end);
+
+	switch(end != NULL ? *end : 0)
+	{
+		case 'k': case 'K': value *= 1024; break;
+		case 'm': case 'M': value *= 1024 * 1024; break;
+		case 'g': case 'G': value *= 1024 * 1024 * 1024; break;
+	}
+
+	return (size_t)value;
+}
+
+static vector<string> Split(const string &text)
+{
+	vector<string> parts;
+	size_t start = 0;
+
+	while(start <= text.length())
+	{
+		size_t comma = text.find(',', start);
+		if(comma == string::npos) comma = text.length();
+		if(comma > start) parts.push_back(text.substr(start, comma - start));
+		start = comma + 1;
+	}
+
+	return parts;
+}
+
+// CPU model names can have quotes or backslashes in them
+static string Quote(const string &text)
+{
+	string quoted = "\"";
+	for(size_t i = 0; i < text.length(); ++i)
+	{
+		if(text[i] == '"' || text[i] == '\\') quoted += '\\';
+		if((unsigned char)text[i] >= 0x20) quoted += text[i];
+	}
+
+	return quoted + "\"";
+}
+
+static void WriteJSON(FILE *fp)
+{
+	fprintf(fp, "{\n  \"cpu\": %s,\n  \"cores\": %u,\n  \"des_kernel\": \"%s\",\n  \"kdf_kernel\": \"%s\",\n"
+		"  \"duration\": %.3f,\n  \"results\": [\n", Quote(CPUModel()).c_str(), thread::hardware_concurrency(),
+		GetDESKernel() == DES_KERNEL_OPENSSL ? "openssl" : "portable", 
+		GetKDFKernel() == KDF_KERNEL_OPENSSL ? "openssl" : "portable", duration);
+
+	for(size_t i = 0; i < results.size(); ++i)
+	{
+		const Result &r = results[i];
+		fprintf(fp, "    { \"cipher\": %s, \"test\": %s, \"file_size\": %zu, \"io_size\": %zu, \"threads\": %u, "
+			"\"ops\": %zu, \"bytes\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.3f, \"ops_per_s\": %.3f }%s\n",
+			Quote(r.cipher).c_str(), Quote(r.test).c_str(), r.fileSize, r.ioSize, r.threads, r.ops, r.bytes, r.seconds,
+			r.seconds > 0 ? r.bytes / r.seconds / 1048576.0 : 0.0, r.seconds > 0 ? r.ops / r.seconds : 0.0,
+			i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(fp, "  ]\n}\n");
+}
+
+void Usage()
+{
+	printf("usage: pwbench [-c ciphers] [-s sizes] [-r read sizes] [-t threads] [-d seconds] [-p dir] [-o file] [-k] [-x]\n");
+	printf("  -c  comma separated, from des, pw, aes, aespw (default des,pw)\n");
+	printf("  -s  file sizes, with K, M or G (default 256K,4M)\n");
+	printf("  -r  sizes for the random reads and overwrites (default 100,4K,64K)\n");
+	printf("  -t  thread counts for ReadAt and WriteAt (default 1,2,4)\n");
+	printf("  -d  seconds for each timed test (default 1)\n");
+	printf("  -p  directory for the test files (default /tmp)\n");
+	printf("  -o  write the JSON here instead of stdout\n");
+	printf("  -k  use the DES and PBKDF2 kernels tuned for this machine, tuning it first if need be\n");
+	printf("  -x  run the self checks instead, and exit nonzero if any fail\n");
+}
+
+int main(int argc, char **argv)
+{
+	string cipherList = "des,pw";
+	string sizeList = "256K,4M";
+	string ioList = "100,4K,64K";
+	string threadList = "1,2,4";
+	string output;
+	bool tuned = false;
+	bool checks = false;
+
+	int opt;
+	while((opt = getopt(argc, argv, "c:s:r:t:d:p:o:kx")) != -1)
+	{
+		switch(opt)
+		{
+			case 'c': cipherList = optarg; break;
+			case 's': sizeList = optarg; break;
+			case 'r': ioList = optarg; break;
+			case 't': threadList = optarg; break;
+			case 'd': duration = atof(optarg); break;
+			case 'p': directory = optarg; break;
+			case 'o': output = optarg; break;
+			case 'k': tuned = true; break;
+			case 'x': checks = true; break;
+			default:
+				Usage();
+				return 1;
+		}
+	}
+
+	if(tuned) ApplyProfile(GetProfile(DefaultProfilePath(), false));
+
+	vector<string> ciphers = Split(cipherList);
+	vector<size_t> sizes;
+	vector<size_t> ioSizes;
+	vector<unsigned> threadCounts;
+
+	vector<string> parts = Split(sizeList);
+	for(size_t i = 0; i < parts.size(); ++i) sizes.push_back(ParseSize(parts[i]));
+	parts = Split(ioList);
+	for(size_t i = 0; i < parts.size(); ++i) ioSizes.push_back(ParseSize(parts[i]));
+	parts = Split(threadList);
+	for(size_t i = 0; i < parts.size(); ++i) threadCounts.push_back(atoi(parts[i].c_str()));
+
+	for(size_t c = 0; c < ciphers.size(); ++c)
+	{
+		CryptKeeper *check = MakeKeeper(ciphers[c]);
+		if(check == NULL)
+		{
+			fprintf(stderr, "unknown cipher %s\n", ciphers[c].c_str());
+			return 1;
+		}
+		delete check;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "/pwbench.%d", (int)getpid());
+	string filename = directory + name + ".enc";
+	string appendName = directory + name + ".log.enc";
+
+	if(checks)
+	{
+		bool ok = CheckPercentiles();
+		for(size_t c = 0; c < ciphers.size(); ++c)
+		{
+			ok = CheckTruncated(ciphers[c], filename) && ok;
+			ok = CheckBadHeader(ciphers[c], filename) && ok;
+			ok = CheckBadKDF(ciphers[c], filename) && ok;
+			ok = CheckRewrite(ciphers[c], filename) && ok;
+			ok = CheckPartialBlock(ciphers[c], filename) && ok;
+			ok = CheckWrongKey(ciphers[c], filename) && ok;
+			ok = CheckMetrics(ciphers[c], filename) && ok;
+		}
+
+		fprintf(stderr, ok ? "checks passed\n" : "checks failed\n");
+		return ok ? 0 : 1;
+	}
+
+	for(size_t c = 0; c < ciphers.size(); ++c)
+	{
+		const string &cipher = ciphers[c];
+
+		for(size_t s = 0; s < sizes.size(); ++s)
+		{
+			size_t size = sizes[s];
+
+			SequentialWrite(cipher, filename, size);
+			SequentialRead(cipher, filename, size);
+
+			for(size_t i = 0; i < ioSizes.size(); ++i)
+				RandomRead(cipher, filename, size, ioSizes[i]);
+
+			for(size_t i = 0; i < ioSizes.size(); ++i)
+				for(size_t t = 0; t < threadCounts.size(); ++t)
+					Positional(cipher, filename, size, ioSizes[i], threadCounts[t], false);
+
+			for(size_t i = 0; i < ioSizes.size(); ++i)
+				Overwrite(cipher, filename, size, ioSizes[i]);
+
+			for(size_t i = 0; i < ioSizes.size(); ++i)
+				for(size_t t = 0; t < threadCounts.size(); ++t)
+					Positional(cipher, filename, size, ioSizes[i], threadCounts[t], true);
+
+			OpenClose(cipher, filename, size);
+			unlink(filename.c_str());
+		}
+
+		Append(cipher, appendName, 100);
+	}
+
+	FILE *fp = output.empty() ? stdout : fopen(output.c_str(), "w");
+	if(fp == NULL)
+	{
+		fprintf(stderr, "can't write %s\n", output.c_str());
+		return 1;
+	}
+
+	WriteJSON(fp);
+	if(fp != stdout) fclose(fp);
+
+	return 0;
+}
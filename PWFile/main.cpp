@@ -2,49 +2,339 @@
 #include <cstdio>
 #include <string>
 #include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <openssl/sha.h>
 using namespace std;
 
 #include "CryptKeeperPW.h"
+#include "CryptKeeperZlib.h"
+#include "Pipeline.h"
+#include "TreeWalk.h"
+#include "Autotune.h"
 
-// Test key stretcher against a set of PBKDF2 test cases
+void Usage()
+{
+	printf("usage: pwfile [-t threads] [-u] [-v] [-d] [-k] [-z] [-a] [-m] filename password\n");
+	printf("       pwfile -r [-t threads] [-d] [-k] directory password\n");
+	printf("       pwfile -p newpassword [-t threads] [-k] filename password\n");
+	printf("  files ending in .enc are decrypted, anything else is encrypted\n");
+	printf("  a filename of - streams stdin to stdout, encrypting unless -d is given\n");
+	printf("  -t  encrypt/decrypt in a pipeline with this many cipher threads; 0 for none (the \n");
+	printf("      default is what was fastest when this machine was tuned)\n");
+	printf("  -u  use io_uring for the encrypted file, if the kernel supports it\n");
+	printf("  -z  compress before encrypting; compressed files are decrypted the same as others\n");
+	printf("  -k  keyring mode: stretch the password once, and give each file a cheap subkey\n");
+	printf("  -r  every file under a directory, on a pool of threads (default two per core); \n");
+	printf("      encrypts files not ending in .enc, or decrypts the .enc files with -d\n");
+	printf("  -v  just check the integrity of an encrypted file, using all the cores\n");
+	printf("  -p  change the password of an encrypted file in place; run it again with the \n");
+	printf("      same passwords to finish a change that was interrupted\n");
+	printf("  -a  tune for this machine again; the first run on a CPU measures the cipher and key \n");
+	printf("      stretching code and the pipeline, and keeps the fastest in ~/.cache/pwfile.tune\n");
+	printf("  -m  print the cipher, I/O and latency metrics to stderr at the end\n");
+}
+
+static void PrintMetrics()
+{
+	IOMetrics::Process().Print(stderr);
+}
+
+// encrypt or decrypt one file, a stream or a tree, or check or rekey a file; see Usage
 int main(int argc, char **argv)
 {
-	string filename = argv[1];
-	string password = argv[2];
-	
+	int threads = 0;
+	bool threadsGiven = false;
+	bool retune = false;
+	bool showMetrics = false;
+	bool uring = false;
+	bool verify = false;
+	bool decrypt = false;
+	bool keyring = false;
+	bool recursive = false;
+	string newPassword;
+	bool rekey = false;
+	bool compress = false;
+
+	int opt;
+	while((opt = getopt(argc, argv, "t:uvdkrp:zam")) != -1)
+	{
+		switch(opt)
+		{
+			case 't':
+				threads = atoi(optarg);
+				threadsGiven = true;
+				break;
+			case 'u':
+				uring = true;
+				break;
+			case 'v':
+				verify = true;
+				break;
+			case 'd':
+				decrypt = true;
+				break;
+			case 'k':
+				keyring = true;
+				break;
+			case 'r':
+				recursive = true;
+				break;
+			case 'p':
+				newPassword = optarg;
+				rekey = true;
+				break;
+			case 'z':
+				compress = true;
+				break;
+			case 'a':
+				retune = true;
+				break;
+			case 'm':
+				showMetrics = true;
+				break;
+			default:
+				Usage();
+				return 1;
+		}
+	}
+
+	if(argc - optind < 2)
+	{
+		Usage();
+		return 1;
+	}
+
+	string filename = argv[optind];
+	string password = argv[optind + 1];
+
+	// the kernels and sizes that were fastest on this CPU; measured on the first run, then saved
+	TuneProfile profile = GetProfile(DefaultProfilePath(), retune);
+	ApplyProfile(profile);
+
+	// every keeper from here on counts into the process metrics; tuning doesn't
+	if(showMetrics)
+	{
+		IOMetrics::EnableProcess(true);
+		IOMetrics::Process();
+		atexit(PrintMetrics);
+	}
+
+	// a whole tree gets 4M chunks spread over the pool
+	if(recursive)
+	{
+		bool ok = decrypt ? DecryptTree(filename.c_str(), password.c_str(), threads, 4 * 1024 * 1024) :
+			EncryptTree(filename.c_str(), password.c_str(), keyring, threads, 4 * 1024 * 1024);
+
+		return ok ? 0 : 1;
+	}
+
 	CryptKeeperPW cc(password.c_str());
+	cc.SetCache(profile.cacheChunk, 4 * 1024 * 1024 / profile.cacheChunk, 4);
+
+	KeyRing ring(password.c_str(), 4096);
+	if(keyring) cc.UseKeyRing(&ring);
+
+	// one read and one write of the ciphertext, across all the cores
+	if(rekey)
+	{
+		KeyRing newRing(newPassword.c_str(), 4096);
+		if(!cc.ChangePassword(filename.c_str(), newPassword.c_str(), keyring ? &newRing : NULL, threads))
+		{
+			fprintf(stderr, "can't change the password of %s\n", filename.c_str());
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// 8 requests of 256k in flight; falls back to stdio if io_uring isn't there
+	if(uring && !cc.EnableAsyncIO(8, 256 * 1024))
+		fprintf(stderr, "io_uring not available, using blocking I/O\n");
+
+	// streaming never touches the disk, so it works in the middle of a pipeline
+	if(filename == "-")
+	{
+		bool ok = decrypt ? cc.DecryptStream(0, 1) : cc.EncryptStream(0, 1);
+		if(!ok)
+		{
+			if(cc.IntegrityFailed())
+				fprintf(stderr, "stream failed integrity check\n");
+			else
+				fprintf(stderr, "can't %s stream\n", decrypt ? "decrypt" : "encrypt");
+		}
+
+		return ok ? 0 : 1;
+	}
+
+	if(verify)
+	{
+		if(!cc.Open(filename.c_str(), "r"))
+		{
+			fprintf(stderr, "can't open %s\n", filename.c_str());
+			return 1;
+		}
+
+		bool ok = cc.IsAuthenticated() && cc.Verify(threads);
+		if(!cc.IsAuthenticated())
+			fprintf(stderr, "%s has no integrity data\n", filename.c_str());
+		else if(!ok)
+			fprintf(stderr, "%s failed integrity check\n", filename.c_str());
+
+		cc.Close();
+		return ok ? 0 : 1;
+	}
+
+	// the pipeline as tuned, unless -t says otherwise
+	size_t chunkSize = profile.pipelineChunk;
+	if(!threadsGiven) threads = profile.threads;
 
 	// if the file ends in .enc, assume it's encrypted, and try to decrypt it
-	if(filename.substr(filename.length() - 4, 4) == ".enc")
+	if(filename.length() > 4 && filename.substr(filename.length() - 4, 4) == ".enc")
 	{
 		unsigned char buffer[4096];
-		FILE *fp = fopen(filename.substr(0, filename.length() - 4).c_str(), "w");
-		cc.Open(filename.c_str(), "r");
-		int size = 4096;
-		while(size == 4096)
+		string target = filename.substr(0, filename.length() - 4);
+		string temp = target + ".partial";
+
+		// the key is made on another thread while the output is created, the pipeline starts, 
+		//  and the first chunks come off the disk; the first read waits for it
+		cc.DeriveKeyInBackground(true);
+
+		if(!cc.Open(filename.c_str(), "r"))
+		{
+			fprintf(stderr, "can't open %s\n", filename.c_str());
+			return 1;
+		}
+
+		// old text header files have nothing to check the data against, the same as -v says
+		if(!cc.IsAuthenticated())
+			fprintf(stderr, "warning: %s has no integrity data, it can't be checked\n", filename.c_str());
+
+		// the output goes to a temporary file, so a wrong password doesn't clobber the target
+		FILE *fp = fopen(temp.c_str(), "w");
+		if(fp == NULL)
 		{
-			size = cc.Read(buffer, 4096);
-			fwrite((void *)buffer, 1, size, fp);
+			fprintf(stderr, "can't create %s\n", temp.c_str());
+			cc.Close();
+			return 1;
 		}
+
+		// compressed chunks have to be undone in order, so they skip the pipeline; written 
+		//  says all the output made it to the temporary file
+		bool unpacked = true;
+		bool written = true;
+		if(cc.IsCompressed())
+		{
+			CryptKeeperZlib zc(cc);
+			size_t total = 0;
+			size_t size = 4096;
+
+			unpacked = zc.Open(false);
+			while(unpacked && size == 4096)
+			{
+				size = zc.Read(buffer, 4096);
+				if(fwrite((void *)buffer, 1, size, fp) != size) written = false;
+				total += size;
+			}
+
+			unpacked = unpacked && total == zc.GetDataLength();
+		}
+		else if(threads > 0)
+		{
+			written = PipelineDecrypt(cc, fp, threads, chunkSize);
+		}
+		else
+		{
+			size_t size = 4096;
+			while(size == 4096)
+			{
+				size = cc.Read(buffer, 4096);
+				if(fwrite((void *)buffer, 1, size, fp) != size) written = false;
+			}
+		}
+
+		// a wrong key reads nothing; the key is in by now, so this doesn't wait
+		bool keyGood = cc.VerifyKey();
+
+		// a chunk that fails its check ends the output early, and the pipeline with it
+		bool failed = cc.IntegrityFailed();
 		cc.Close();
-		fclose(fp);
+		if(fclose(fp) != 0) written = false;
+
+		// the target only shows up once all of it has been checked and written out
+		if(!keyGood || !written || failed || !unpacked)
+		{
+			unlink(temp.c_str());
+			if(!keyGood)
+				fprintf(stderr, "wrong password for %s\n", filename.c_str());
+			else if(failed)
+				fprintf(stderr, "%s failed integrity check\n", filename.c_str());
+			else if(!unpacked)
+				fprintf(stderr, "can't decompress %s\n", filename.c_str());
+			else
+				fprintf(stderr, "can't write %s\n", target.c_str());
+			return 1;
+		}
+		if(rename(temp.c_str(), target.c_str()) != 0)
+		{
+			unlink(temp.c_str());
+			fprintf(stderr, "can't create %s\n", target.c_str());
+			return 1;
+		}
 	}
 	else
 	{
 		unsigned char buffer[4096];
 		FILE *fp = fopen(filename.c_str(), "r");
-		cc.Open((filename + ".enc").c_str(), "w");
-		int size = 4096;
-		while(size == 4096)
+		if(fp == NULL || !cc.Open((filename + ".enc").c_str(), "w"))
 		{
-			size = fread(buffer, 1, 4096, fp);
-			cc.Write(buffer, size);
+			fprintf(stderr, "can't open %s\n", filename.c_str());
+			return 1;
 		}
-		cc.Close();
+
+		// we know how big the encrypted file will be, so get the space in one go
+		struct stat st;
+		if(!compress && fp != NULL && fstat(fileno(fp), &st) == 0) cc.Reserve(st.st_size);
+		bool written = true;
+		if(compress)
+		{
+			CryptKeeperZlib zc(cc);
+			written = zc.Open(true);
+
+			size_t size = 4096;
+			while(written && size == 4096)
+			{
+				size = fread(buffer, 1, 4096, fp);
+				if(zc.Write(buffer, size) != size) written = false;
+			}
+
+			written = zc.Close() && written;
+		}
+		else if(threads > 0)
+		{
+			written = PipelineEncrypt(cc, fp, threads, chunkSize);
+		}
+		else
+		{
+			size_t size = 4096;
+			while(written && size == 4096)
+			{
+				size = fread(buffer, 1, 4096, fp);
+				if(cc.Write(buffer, size) != size) written = false;
+			}
+		}
+		if(ferror(fp)) written = false;
+		if(!cc.Close()) written = false;
 		fclose(fp);
+
+		// half an encrypted file is no use to anyone
+		if(!written)
+		{
+			unlink((filename + ".enc").c_str());
+			fprintf(stderr, "can't encrypt %s\n", filename.c_str());
+			return 1;
+		}
 	}
 
 	return 0;
 }
-
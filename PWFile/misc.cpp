@@ -95,8 +95,13 @@ vector<unsigned char> GenerateRandom(unsigned int length)
 	vector<unsigned char> random;
 	random.resize(length);
 
+	// a nonce that isn't random gives the same keystream twice, so there's no going on without
 	FILE *fd = fopen("/dev/urandom", "r");
-	size_t bytesRead = fread(&random[0], 1, length, fd);
+	if(fd == NULL || fread(&random[0], 1, length, fd) != length)
+	{
+		perror("/dev/urandom");
+		abort();
+	}
 	fclose(fd);
 
 	return random;